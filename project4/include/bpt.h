@@ -23,6 +23,9 @@
 
 #define BUF_FRAME_NUM 16
 
+// join_table() merges this many key ranges in parallel
+#define JOIN_THREAD_NUM 8
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -0,0 +1,179 @@
+/* File Name : bpt_join.h
+ *
+ * Join operators over tables */
+
+#ifndef __BPT_JOIN_H__
+#define __BPT_JOIN_H__
+
+#include "bpt.h"
+#include "bpt_page_object.h"
+#include "bpt_fd_table_map.h"
+
+// A merge join follows at most this many right siblings
+// before it searches the next key from the root. A search reads
+// about one page per level, so a few leaves cost no more.
+#define JOIN_SKIP_LEAVES 4
+
+// The build side of a hash join spills to disk beyond this size
+#define HASH_JOIN_MEM_BUDGET ((int64_t)64 * 1024 * 1024)
+#define HASH_JOIN_PARTITION_NUM 64
+
+// Bloom filter of semi-joins and anti-joins
+#define JOIN_BLOOM_BITS_PER_KEY 10
+#define JOIN_BLOOM_HASH_NUM 7
+
+// join_tables() joins at most this many tables
+#define JOIN_MAX_TABLES MAX_TABLE_NUM
+
+// Output buffer of a join sink
+#define JOIN_SINK_BUF_SIZE (PAGE_SIZE * 256)
+
+// Leaf cursor for joins.
+// It reads pages with pread() instead of the buffer manager,
+// so several threads can scan the same table at once.
+// Dirty frames of the table must be flushed before it is used.
+typedef struct __leaf_cursor {
+  struct __leaf_cursor *this;
+
+  struct __page *page;
+  int32_t table_id;
+  int32_t fd;
+
+  // 0 when the cursor is past the last record
+  int64_t page_offset;
+  int32_t idx;
+
+  // Position at the first record whose key is not smaller than key
+  bool (*seek)(struct __leaf_cursor * const, const int64_t key);
+  bool (*next)(struct __leaf_cursor * const);
+  // Same as seek, but only moves forward and starts from here
+  bool (*advance_to)(struct __leaf_cursor * const, const int64_t key);
+  bool (*is_valid)(const struct __leaf_cursor * const);
+
+  int64_t (*get_key)(const struct __leaf_cursor * const);
+  char* (*get_value)(const struct __leaf_cursor * const);
+} leaf_cursor_t;
+
+void leaf_cursor_constructor(leaf_cursor_t * const this,
+    const int32_t table_id);
+void leaf_cursor_destructor(leaf_cursor_t * const this);
+
+// Read one page of a table. It does not touch the buffer manager.
+void join_read_page(const int32_t table_id, const int64_t page_offset,
+    struct __page * const page);
+
+// One joined tuple in binary form.
+// The values point into pages of the join, so they are valid
+// only until the next tuple is asked for.
+typedef struct __joined_tuple {
+  int64_t key;
+  char *left_value;
+  char *right_value;
+} joined_tuple_t;
+
+// Consume a joined tuple. Returning false stops the join.
+typedef bool (*join_callback_t)(const joined_tuple_t *tuple, void *arg);
+
+// Tuple of an N-way join, values in the order of the tables
+typedef struct __multi_joined_tuple {
+  int64_t key;
+  int32_t num_values;
+  char *values[JOIN_MAX_TABLES];
+} multi_joined_tuple_t;
+
+typedef bool (*multi_join_callback_t)(const multi_joined_tuple_t *tuple,
+    void *arg);
+
+
+// Merge join iterator over two tables, in key order.
+typedef struct __join_iterator {
+  struct __join_iterator *this;
+
+  leaf_cursor_t left;
+  leaf_cursor_t right;
+  bool has_tuple;
+  bool has_end;
+  int64_t end_key;
+
+  bool (*next)(struct __join_iterator * const, joined_tuple_t * const tuple);
+} join_iterator_t;
+
+void join_iterator_constructor(join_iterator_t * const this,
+    const int32_t table_id_1, const int32_t table_id_2);
+void join_iterator_destructor(join_iterator_t * const this);
+
+// Merge join calling callback for each tuple in key order.
+// Returns the number of tuples produced.
+int64_t join_table_foreach(int table_id_1, int table_id_2,
+    join_callback_t callback, void *arg);
+
+
+// Join result file with a large buffer and one fsync at the end
+enum join_sink_format {JOIN_SINK_TEXT, JOIN_SINK_BINARY};
+
+// Record of a binary join result file
+typedef struct __joined_record {
+  int64_t key;
+  char left_value[VALUE_SIZE];
+  char right_value[VALUE_SIZE];
+} joined_record_t;
+
+typedef struct __join_sink {
+  struct __join_sink *this;
+
+  int fd;
+  enum join_sink_format format;
+  bool sync;
+  uint8_t *buf;
+  int64_t buf_idx;
+  int64_t num_records;
+
+  bool (*put)(struct __join_sink * const, const joined_tuple_t * const tuple);
+  bool (*put_multi)(struct __join_sink * const,
+      const multi_joined_tuple_t * const tuple);
+} join_sink_t;
+
+bool join_sink_constructor(join_sink_t * const this, const char *pathname,
+    const enum join_sink_format format);
+void join_sink_destructor(join_sink_t * const this);
+
+// join_callback_t writing to the join_sink_t given as arg
+bool join_sink_callback(const joined_tuple_t *tuple, void *sink);
+bool join_sink_multi_callback(const multi_joined_tuple_t *tuple, void *sink);
+
+
+// Extract the join key of a record.
+// Returning false leaves the record out of the join.
+typedef bool (*join_key_extractor_t)(const record_t *record, int64_t *join_key);
+
+// Hash join of two tables on extracted keys.
+// A NULL extractor joins on the primary key.
+int hash_join_table(int table_id_1, join_key_extractor_t key_of_1,
+    int table_id_2, join_key_extractor_t key_of_2, char * pathname);
+int64_t hash_join_foreach(int table_id_1, join_key_extractor_t key_of_1,
+    int table_id_2, join_key_extractor_t key_of_2,
+    join_callback_t callback, void *arg);
+
+// Merge join of N tables on the primary key in one pass
+int64_t join_tables_foreach(const int * const table_ids,
+    const int num_tables, multi_join_callback_t callback, void *arg);
+int join_tables(const int * const table_ids, const int num_tables,
+    char * pathname);
+
+// Records of table_id_1 whose key is (semi) or is not (anti)
+// in table_id_2. Tuples have one value. Pass the smaller table second.
+int64_t semi_join_foreach(int table_id_1, int table_id_2,
+    multi_join_callback_t callback, void *arg);
+int64_t anti_join_foreach(int table_id_1, int table_id_2,
+    multi_join_callback_t callback, void *arg);
+int semi_join_table(int table_id_1, int table_id_2, char * pathname);
+int anti_join_table(int table_id_1, int table_id_2, char * pathname);
+
+// Join two tables into a new table built bottom-up.
+// num_truncated, if not NULL, gets the number of records whose
+// "left,right" value was cut to fit in VALUE_SIZE.
+// Returns the table id of the new table, or -1.
+int join_into_table(int table_id_1, int table_id_2, char * dest_path,
+    int64_t * num_truncated);
+
+#endif
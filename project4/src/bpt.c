@@ -415,268 +415,3 @@ int shutdown_db(void) {
   }
   buf_mgr_destructor(&buf_mgr);
 }
-
-
-#define GET_KEY(page_obj, idx) (page_obj.page->content.records[idx].key)
-#define GET_VALUE(page_obj, idx) (page_obj.page->content.records[idx].value)
-
-// return -1 when current idx is the last of the table
-int __advance_idx(page_object_t *page, int idx) {
-  if (idx + 1 < page->get_number_of_keys(page)) {
-    return idx + 1;
-  } else {
-    page->current_page_number = 
-      page->page->header.one_more_page_offset / PAGE_SIZE;
-
-    if (page->current_page_number == 0) {
-      return -1;
-    }
-    page->read(page);
-    return 0;
-  }
-}
-
-#define REC_BUF_SIZE (VALUE_SIZE * (2 + 1)) // +1 for other infos
-
-
-void __write_joined_record_to_buf(uint8_t rec_buf[REC_BUF_SIZE], int *rec_buf_idx,
-    int key, char* left_value, char *right_value){
-  memset(rec_buf, 0, sizeof(*rec_buf) * REC_BUF_SIZE);
-  *rec_buf_idx = 0;
-
-  // write key
-  int key_to_write = key;
-  int num_char_count = 0;
-  int start_idx = *rec_buf_idx;
-  int end_idx;
-  do {
-    rec_buf[*rec_buf_idx] = key_to_write % 10 + '0';
-    (*rec_buf_idx)++;
-    key_to_write /= 10;
-    num_char_count++;
-  } while (key_to_write > 0);
-  // reverse result number
-  end_idx = *rec_buf_idx - 1;
-  uint8_t for_swap;
-  while (start_idx < end_idx) {
-    for_swap = rec_buf[start_idx];
-    rec_buf[start_idx] = rec_buf[end_idx];
-    rec_buf[end_idx] = for_swap;
-    start_idx++;
-    end_idx--;
-  }
-
-  rec_buf[*rec_buf_idx] = ',';
-  (*rec_buf_idx)++;
-
-  int left_len = strlen(left_value);
-  memcpy(&rec_buf[*rec_buf_idx], left_value, left_len);
-  *rec_buf_idx += left_len;
-
-  rec_buf[*rec_buf_idx] = ',';
-  (*rec_buf_idx)++;
-
-  // write number again
-  memcpy(&rec_buf[*rec_buf_idx], rec_buf, num_char_count);
-  *rec_buf_idx += num_char_count;
-
-  rec_buf[*rec_buf_idx] = ',';
-  (*rec_buf_idx)++;
-
-  int right_len = strlen(right_value);
-  memcpy(&rec_buf[*rec_buf_idx], right_value, right_len);
-  *rec_buf_idx += right_len;
-
-  rec_buf[*rec_buf_idx] = '\n';
-  (*rec_buf_idx)++;
-}
-
-
-// Sort-merge join algorithm is used.
-int join_table(int table_id_1, int table_id_2, char * pathname) {
-#ifdef DBG
-  printf("(join_table) is called.\n");
-  printf("(join_table) table_id_1: %d, table_id_2: %d, pathname: %s\n",
-      table_id_1, table_id_2, pathname);
-#endif
-  // initialization
-  const int32_t num_result_buf = 1;
-  uint8_t *result_buf;
-  int result_buf_idx = 0;
-  int result_buf_size = PAGE_SIZE * num_result_buf;
-  uint8_t rec_buf[REC_BUF_SIZE]; 
-  int rec_buf_idx = 0;
-  int status = 0;
-  int result_fd;
-
-
-  result_fd = open(pathname, O_RDWR | O_LARGEFILE);
-  if (result_fd < 0) {
-    //create file
-    result_fd = open(pathname, O_RDWR | O_CREAT | O_EXCL | O_LARGEFILE);
-    if (result_fd < 0) {
-      // Creating is failed.
-      perror("(open_table) Join result file opening is failed.");
-      return -1;
-    }
-    chmod(pathname, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-  }
-
-  result_buf = (uint8_t*)calloc(result_buf_size,
-      sizeof(*result_buf));
-
-  memset(&rec_buf, 0, sizeof(rec_buf));
-
-  page_object_t left_tbl_pg;
-  page_object_t right_tbl_pg;
-
-  page_object_constructor(&left_tbl_pg, table_id_1,
-      header_page[table_id_1].page.root_page_offset / PAGE_SIZE);
-  page_object_constructor(&right_tbl_pg, table_id_2,
-      header_page[table_id_2].page.root_page_offset / PAGE_SIZE);
-
-  // If at least one table has no key, return error
-  if (left_tbl_pg.get_number_of_keys(&left_tbl_pg) == 0
-      || right_tbl_pg.get_number_of_keys(&right_tbl_pg) == 0) {
-    status = -1;
-    goto end;
-  }
-
-
-  // fine leaf page of table_id_1
-  while (left_tbl_pg.get_type(&left_tbl_pg) != LEAF_PAGE) {
-    assert(left_tbl_pg.get_type(&left_tbl_pg) != INVALID_PAGE);
-
-    left_tbl_pg.set_current_page_number(&left_tbl_pg,
-        left_tbl_pg.page->header.one_more_page_offset / PAGE_SIZE);
-    left_tbl_pg.read(&left_tbl_pg);
-  }
-
-  // fine leaf page of table_id_2
-  while (right_tbl_pg.get_type(&right_tbl_pg) != LEAF_PAGE) {
-    assert(right_tbl_pg.get_type(&right_tbl_pg) != INVALID_PAGE);
-
-    right_tbl_pg.set_current_page_number(&right_tbl_pg,
-        right_tbl_pg.page->header.one_more_page_offset / PAGE_SIZE);
-    right_tbl_pg.read(&right_tbl_pg);
-  }
-
-  // both table's leaves are found
-
-  // sort-merge algorithm
-  // iterate whole page of table_id_1 and table_id_2.
-  // What is end condition?
-  //  At least one table is in last page.
-
-  int i = 0, j = 0;
-
-  // find first same key
-  while(GET_KEY(left_tbl_pg, i) < GET_KEY(right_tbl_pg, j)) {
-    i = __advance_idx(&left_tbl_pg, i);
-    if (i < 0) {
-#ifdef DBG
-      fprintf(stderr, "(join_table) No matching key found\n");
-      fprintf(stderr, "(join_table) Join failed\n");
-#endif
-      status = -1;
-      goto end;
-    }
-  }
-
-  while(GET_KEY(left_tbl_pg, i) > GET_KEY(right_tbl_pg, j)) {
-    j = __advance_idx(&right_tbl_pg, j);
-    if (j < 0) {
-#ifdef DBG
-      fprintf(stderr, "(join_table) No matching key found\n");
-      fprintf(stderr, "(join_table) Join failed\n");
-#endif
-      status = -1;
-      goto end;
-    }
-  }
-
-
-  // at least one same key is found
-  do {
-    assert(GET_KEY(left_tbl_pg, i) == GET_KEY(right_tbl_pg, j));
-    // No marking is needed because
-    // this DBMS does only handles primary key
-
-    // TODO: yield
-    int64_t key = GET_KEY(left_tbl_pg, i);
-    char* left_value = GET_VALUE(left_tbl_pg, i);
-    char* right_value = GET_VALUE(right_tbl_pg, j);
-
-    // Make a joined record to joined_record_buf
-    // if result_buf has no room to store the record
-    //    flush result_buf
-    // endif
-    // copy the record to result_buf
-
-    // Make a joined record to joined_record_buf
-    __write_joined_record_to_buf(rec_buf, &rec_buf_idx,
-        key, left_value, right_value);
-    // rec_buf has joined record
-    // its size is rec_buf_idx
-
-    if (result_buf_idx + rec_buf_idx >= result_buf_size) {
-      // no room to write
-      // flush
-      if (write(result_fd, result_buf, result_buf_idx) < 0) {
-        assert(false);
-        exit(1);
-      }
-      memset(result_buf, 0, result_buf_size);
-      result_buf_idx = 0;
-      fsync(result_fd);
-    }
-
-    // write record to result_buf
-    memcpy(&result_buf[result_buf_idx], rec_buf, rec_buf_idx);
-    result_buf_idx += rec_buf_idx;
-
-    // go to next record
-    i = __advance_idx(&left_tbl_pg, i);
-    j = __advance_idx(&right_tbl_pg, j);
-
-    // table is fully iterated
-    if (i < 0 || j < 0) {
-      break;
-    }
-
-    while (GET_KEY(left_tbl_pg, i) != GET_KEY(right_tbl_pg, j)) {
-      while(GET_KEY(left_tbl_pg, i) < GET_KEY(right_tbl_pg, j)) {
-        i = __advance_idx(&left_tbl_pg, i);
-        if (i < 0) {
-          goto break_loop;
-        }
-      }
-
-      while(GET_KEY(left_tbl_pg, i) > GET_KEY(right_tbl_pg, j)) {
-        j = __advance_idx(&right_tbl_pg, j);
-        if (j < 0) {
-          goto break_loop;
-        }
-      }
-    }
-  } while(i >= 0 && j >= 0);
-break_loop:
-
-  //flush buffer
-  if (write(result_fd, result_buf, result_buf_idx) < 0) {
-    assert(false);
-    exit(1);
-  }
-  fsync(result_fd);
-
-end:
-
-  page_object_destructor(&left_tbl_pg);
-  page_object_destructor(&right_tbl_pg);
-
-  free(result_buf);
-  result_buf = NULL;
-
-  close(result_fd);
-  return status;
-}
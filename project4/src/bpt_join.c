@@ -0,0 +1,1600 @@
+/* File Name : bpt_join.c
+ *
+ * This is a implementation of join operators */
+
+#include "bpt.h"
+
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "bpt_header_object.h"
+#include "bpt_page_object.h"
+#include "bpt_fd_table_map.h"
+#include "bpt_buffer_manager.h"
+#include "bpt_join.h"
+
+extern header_object_t header_page[MAX_TABLE_NUM + 1];
+extern buf_mgr_t buf_mgr;
+
+
+void join_read_page(const int32_t table_id, const int64_t page_offset,
+    struct __page * const page) {
+  int32_t fd = get_fd_of_table(table_id);
+  assert(fd != 0);
+
+  if (pread(fd, page, PAGE_SIZE, page_offset) != PAGE_SIZE) {
+    perror("(join_read_page)");
+    assert(false);
+    exit(1);
+  }
+}
+
+
+/** Leaf cursor **/
+
+// Skip empty leaves and the end of a leaf.
+static bool __cursor_settle(leaf_cursor_t * const this) {
+  while (this->page_offset != 0
+      && this->idx >= this->page->header.number_of_keys) {
+    this->page_offset = this->page->header.one_more_page_offset;
+    this->idx = 0;
+    if (this->page_offset != 0) {
+      join_read_page(this->table_id, this->page_offset, this->page);
+    }
+  }
+  return this->page_offset != 0;
+}
+
+static bool __cursor_seek(leaf_cursor_t * const this, const int64_t key) {
+  int32_t i;
+
+  this->page_offset = header_page[this->table_id].page.root_page_offset;
+  join_read_page(this->table_id, this->page_offset, this->page);
+
+  // Internal page: key >= separator goes right, like find_leaf_page().
+  while (this->page->header.is_leaf == false) {
+    i = 0;
+    while (i < this->page->header.number_of_keys
+        && key >= this->page->content.key_and_offsets[i].key) {
+      i++;
+    }
+    if (i == 0) {
+      this->page_offset = this->page->header.one_more_page_offset;
+    } else {
+      this->page_offset = this->page->content.key_and_offsets[i - 1].page_offset;
+    }
+    join_read_page(this->table_id, this->page_offset, this->page);
+  }
+
+  this->idx = 0;
+  while (this->idx < this->page->header.number_of_keys
+      && this->page->content.records[this->idx].key < key) {
+    this->idx++;
+  }
+  return __cursor_settle(this);
+}
+
+static bool __cursor_next(leaf_cursor_t * const this) {
+  if (this->page_offset == 0) {
+    return false;
+  }
+  this->idx++;
+  return __cursor_settle(this);
+}
+
+// Move forward to the first record whose key is not smaller than key.
+// Inside a leaf, it gallops: probe 1, 2, 4, ... records ahead,
+// then binary search the last step. A key beyond the next
+// JOIN_SKIP_LEAVES leaves is found again from the root instead,
+// so a sparse probe costs O(log n) page reads, not a scan.
+static bool __cursor_advance_to(leaf_cursor_t * const this, const int64_t key) {
+  const record_t *records = this->page->content.records;
+  int32_t num_keys;
+  int32_t lo, hi, mid, step;
+  int32_t hops = 0;
+
+  if (this->page_offset == 0) {
+    return false;
+  }
+  if (records[this->idx].key >= key) {
+    return true;
+  }
+
+  num_keys = this->page->header.number_of_keys;
+  while (num_keys == 0 || records[num_keys - 1].key < key) {
+    if (hops++ >= JOIN_SKIP_LEAVES) {
+      return this->seek(this, key);
+    }
+    this->page_offset = this->page->header.one_more_page_offset;
+    this->idx = 0;
+    if (this->page_offset == 0) {
+      return false;
+    }
+    join_read_page(this->table_id, this->page_offset, this->page);
+    num_keys = this->page->header.number_of_keys;
+  }
+
+  // records[num_keys - 1].key >= key here.
+  if (records[this->idx].key >= key) {
+    return true;
+  }
+  lo = this->idx;
+  step = 1;
+  while (lo + step < num_keys && records[lo + step].key < key) {
+    lo += step;
+    step *= 2;
+  }
+  hi = lo + step < num_keys ? lo + step : num_keys - 1;
+
+  // records[lo].key < key <= records[hi].key
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if (records[mid].key < key) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  this->idx = hi;
+  return true;
+}
+
+static bool __cursor_is_valid(const leaf_cursor_t * const this) {
+  return this->page_offset != 0;
+}
+
+static int64_t __cursor_get_key(const leaf_cursor_t * const this) {
+  return this->page->content.records[this->idx].key;
+}
+
+static char* __cursor_get_value(const leaf_cursor_t * const this) {
+  return this->page->content.records[this->idx].value;
+}
+
+void leaf_cursor_constructor(leaf_cursor_t * const this,
+    const int32_t table_id) {
+  memset(this, 0, sizeof(*this));
+  this->this = this;
+  this->table_id = table_id;
+  this->fd = get_fd_of_table(table_id);
+  this->page = (struct __page*)malloc(sizeof(*this->page));
+
+  this->seek = __cursor_seek;
+  this->next = __cursor_next;
+  this->advance_to = __cursor_advance_to;
+  this->is_valid = __cursor_is_valid;
+  this->get_key = __cursor_get_key;
+  this->get_value = __cursor_get_value;
+}
+
+void leaf_cursor_destructor(leaf_cursor_t * const this) {
+  free(this->page);
+  memset(this, 0, sizeof(*this));
+}
+
+
+/** Partitioning **/
+
+// Collect the separator keys of the shallowest internal level
+// which has at least 'want' keys, or of the deepest internal level.
+// The keys are sorted. Returns the number of keys.
+static int32_t __collect_separators(const int32_t table_id,
+    const int32_t want, int64_t **keys) {
+  struct __page *page = (struct __page*)malloc(sizeof(*page));
+  int64_t *level = (int64_t*)malloc(sizeof(*level));
+  int64_t *next_level;
+  int32_t level_size = 1, next_size;
+  int32_t num_keys = 0;
+  int32_t i, j;
+
+  *keys = NULL;
+  level[0] = header_page[table_id].page.root_page_offset;
+
+  while (level_size > 0) {
+    join_read_page(table_id, level[0], page);
+    if (page->header.is_leaf) {
+      break;
+    }
+
+    // This level has at most OFFSET_ORDER times more pages.
+    free(*keys);
+    *keys = (int64_t*)malloc(sizeof(**keys) * level_size * OFFSETS_PER_PAGE);
+    next_level = (int64_t*)malloc(sizeof(*next_level)
+        * level_size * OFFSET_ORDER);
+    num_keys = 0;
+    next_size = 0;
+
+    for (i = 0; i < level_size; ++i) {
+      if (i > 0) {
+        join_read_page(table_id, level[i], page);
+      }
+      next_level[next_size++] = page->header.one_more_page_offset;
+      for (j = 0; j < page->header.number_of_keys; ++j) {
+        (*keys)[num_keys++] = page->content.key_and_offsets[j].key;
+        next_level[next_size++] = page->content.key_and_offsets[j].page_offset;
+      }
+    }
+
+    free(level);
+    level = next_level;
+    level_size = next_size;
+    if (num_keys >= want) {
+      break;
+    }
+  }
+
+  free(level);
+  free(page);
+  return num_keys;
+}
+
+// Split the key space into at most num_parts ranges,
+// using the separators of both trees as candidate boundaries.
+// bounds[i] is the first key of range i + 1.
+// Returns the number of ranges.
+static int32_t __make_partitions(const int32_t table_id_1,
+    const int32_t table_id_2, const int32_t num_parts, int64_t *bounds) {
+  int64_t *keys_1, *keys_2, *merged;
+  int32_t n_1, n_2, n = 0;
+  int32_t i = 0, j = 0, k;
+  int32_t num_bounds = 0;
+
+  n_1 = __collect_separators(table_id_1, num_parts, &keys_1);
+  n_2 = __collect_separators(table_id_2, num_parts, &keys_2);
+
+  // Merge two sorted key lists without duplicates
+  merged = (int64_t*)malloc(sizeof(*merged) * (n_1 + n_2 + 1));
+  while (i < n_1 || j < n_2) {
+    int64_t key;
+    if (j >= n_2 || (i < n_1 && keys_1[i] <= keys_2[j])) {
+      key = keys_1[i++];
+    } else {
+      key = keys_2[j++];
+    }
+    if (n == 0 || merged[n - 1] != key) {
+      merged[n++] = key;
+    }
+  }
+
+  // Pick evenly spaced separators as range boundaries
+  for (k = 1; k < num_parts && n > 0; ++k) {
+    int64_t key = merged[(int64_t)k * n / num_parts];
+    if (num_bounds == 0 || bounds[num_bounds - 1] < key) {
+      bounds[num_bounds++] = key;
+    }
+  }
+
+  free(keys_1);
+  free(keys_2);
+  free(merged);
+  return num_bounds + 1;
+}
+
+
+/** Join sink **/
+
+// Longest text line: a key and a value per table, a comma between
+// each and '\n'
+#define TEXT_LINE_MAX (JOIN_MAX_TABLES * (20 + VALUE_SIZE + 2))
+#define PART_PATH_SIZE 512
+
+// Format a key in decimal. Returns the number of characters.
+static int32_t __format_key(char *buf, const int64_t key) {
+  char digits[20];
+  uint64_t v = key < 0 ? -(uint64_t)key : (uint64_t)key;
+  int32_t n = 0, len = 0;
+
+  do {
+    digits[n++] = v % 10 + '0';
+    v /= 10;
+  } while (v > 0);
+
+  if (key < 0) {
+    buf[len++] = '-';
+  }
+  while (n > 0) {
+    buf[len++] = digits[--n];
+  }
+  return len;
+}
+
+static void __sink_flush(join_sink_t * const this) {
+  if (write(this->fd, this->buf, this->buf_idx) != this->buf_idx) {
+    perror("(join_sink) Writing a join result is failed.");
+    assert(false);
+    exit(1);
+  }
+  this->buf_idx = 0;
+}
+
+// "key,value_1,key,value_2,...\n", like the old join output
+static void __sink_put_text(join_sink_t * const this, const int64_t key,
+    char * const * const values, const int32_t num_values) {
+  char *line;
+  int32_t key_len, value_len, len, i;
+
+  if (this->buf_idx + TEXT_LINE_MAX > JOIN_SINK_BUF_SIZE) {
+    __sink_flush(this);
+  }
+  line = (char*)this->buf + this->buf_idx;
+
+  key_len = __format_key(line, key);
+  len = 0;
+  for (i = 0; i < num_values; ++i) {
+    if (i > 0) {
+      line[len++] = ',';
+      memcpy(line + len, line, key_len);
+    }
+    len += key_len;
+    line[len++] = ',';
+    value_len = strnlen(values[i], VALUE_SIZE);
+    memcpy(line + len, values[i], value_len);
+    len += value_len;
+  }
+  line[len++] = '\n';
+
+  this->buf_idx += len;
+}
+
+// The key and then every value in full.
+// With two tables it is a joined_record_t.
+static void __sink_put_binary(join_sink_t * const this, const int64_t key,
+    char * const * const values, const int32_t num_values) {
+  const int64_t len = sizeof(key) + num_values * VALUE_SIZE;
+  uint8_t *record;
+  int32_t i;
+
+  if (this->buf_idx + len > JOIN_SINK_BUF_SIZE) {
+    __sink_flush(this);
+  }
+  record = this->buf + this->buf_idx;
+  memcpy(record, &key, sizeof(key));
+  for (i = 0; i < num_values; ++i) {
+    memcpy(record + sizeof(key) + i * VALUE_SIZE, values[i], VALUE_SIZE);
+  }
+  this->buf_idx += len;
+}
+
+static void __sink_put_values(join_sink_t * const this, const int64_t key,
+    char * const * const values, const int32_t num_values) {
+  if (this->format == JOIN_SINK_TEXT) {
+    __sink_put_text(this, key, values, num_values);
+  } else {
+    __sink_put_binary(this, key, values, num_values);
+  }
+  this->num_records++;
+}
+
+static bool __sink_put(join_sink_t * const this,
+    const joined_tuple_t * const tuple) {
+  char *values[2] = {tuple->left_value, tuple->right_value};
+  __sink_put_values(this, tuple->key, values, 2);
+  return true;
+}
+
+static bool __sink_put_multi(join_sink_t * const this,
+    const multi_joined_tuple_t * const tuple) {
+  __sink_put_values(this, tuple->key, tuple->values, tuple->num_values);
+  return true;
+}
+
+bool join_sink_constructor(join_sink_t * const this, const char *pathname,
+    const enum join_sink_format format) {
+  memset(this, 0, sizeof(*this));
+  this->fd = open(pathname, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE,
+      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (this->fd < 0) {
+    perror("(join_sink) Join result file opening is failed.");
+    return false;
+  }
+  this->this = this;
+  this->format = format;
+  this->sync = true;
+  this->buf = (uint8_t*)malloc(JOIN_SINK_BUF_SIZE);
+  this->put = __sink_put;
+  this->put_multi = __sink_put_multi;
+  return true;
+}
+
+void join_sink_destructor(join_sink_t * const this) {
+  __sink_flush(this);
+  if (this->sync) {
+    fsync(this->fd);
+  }
+  close(this->fd);
+  free(this->buf);
+  memset(this, 0, sizeof(*this));
+}
+
+bool join_sink_callback(const joined_tuple_t *tuple, void *sink) {
+  return ((join_sink_t*)sink)->put((join_sink_t*)sink, tuple);
+}
+
+bool join_sink_multi_callback(const multi_joined_tuple_t *tuple, void *sink) {
+  return ((join_sink_t*)sink)->put_multi((join_sink_t*)sink, tuple);
+}
+
+
+/** Sort-merge join **/
+
+static bool __join_iterator_next(join_iterator_t * const this,
+    joined_tuple_t * const tuple) {
+  leaf_cursor_t *left = &this->left;
+  leaf_cursor_t *right = &this->right;
+  int64_t left_key, right_key;
+
+  // The last tuple pointed into the current pages.
+  if (this->has_tuple) {
+    left->next(left);
+    right->next(right);
+    this->has_tuple = false;
+  }
+
+  while (left->is_valid(left) && right->is_valid(right)) {
+    left_key = left->get_key(left);
+    right_key = right->get_key(right);
+
+    if (this->has_end
+        && (left_key >= this->end_key || right_key >= this->end_key)) {
+      break;
+    }
+
+    // Skip ahead on the side which is behind.
+    if (left_key < right_key) {
+      left->advance_to(left, right_key);
+      continue;
+    }
+    if (left_key > right_key) {
+      right->advance_to(right, left_key);
+      continue;
+    }
+
+    // No marking is needed because
+    // this DBMS does only handles primary key
+    tuple->key = left_key;
+    tuple->left_value = left->get_value(left);
+    tuple->right_value = right->get_value(right);
+    this->has_tuple = true;
+    return true;
+  }
+  return false;
+}
+
+// Merge the key range [begin_key, end_key).
+// It does not flush the buffer manager, so workers can use it.
+static void __join_iterator_init(join_iterator_t * const this,
+    const int32_t table_id_1, const int32_t table_id_2,
+    const int64_t begin_key, const bool has_end, const int64_t end_key) {
+  memset(this, 0, sizeof(*this));
+  this->this = this;
+  leaf_cursor_constructor(&this->left, table_id_1);
+  leaf_cursor_constructor(&this->right, table_id_2);
+  this->left.seek(&this->left, begin_key);
+  this->right.seek(&this->right, begin_key);
+  this->has_end = has_end;
+  this->end_key = end_key;
+  this->next = __join_iterator_next;
+}
+
+void join_iterator_constructor(join_iterator_t * const this,
+    const int32_t table_id_1, const int32_t table_id_2) {
+  buf_mgr.flush_table(&buf_mgr, table_id_1);
+  buf_mgr.flush_table(&buf_mgr, table_id_2);
+  __join_iterator_init(this, table_id_1, table_id_2, INT64_MIN, false, 0);
+}
+
+void join_iterator_destructor(join_iterator_t * const this) {
+  leaf_cursor_destructor(&this->left);
+  leaf_cursor_destructor(&this->right);
+  memset(this, 0, sizeof(*this));
+}
+
+int64_t join_table_foreach(int table_id_1, int table_id_2,
+    join_callback_t callback, void *arg) {
+  join_iterator_t iter;
+  joined_tuple_t tuple;
+  int64_t num_records = 0;
+
+  join_iterator_constructor(&iter, table_id_1, table_id_2);
+  while (iter.next(&iter, &tuple)) {
+    num_records++;
+    if (callback(&tuple, arg) == false) {
+      break;
+    }
+  }
+  join_iterator_destructor(&iter);
+  return num_records;
+}
+
+
+// A key range [begin_key, end_key) merged by one worker thread.
+// The first range has no begin key and the last has no end key.
+typedef struct __join_partition {
+  int32_t table_id_1;
+  int32_t table_id_2;
+  bool has_begin;
+  bool has_end;
+  int64_t begin_key;
+  int64_t end_key;
+
+  char path[PART_PATH_SIZE];
+  int64_t num_records;
+  int32_t status;
+} join_partition_t;
+
+
+static void* __join_worker(void *arg) {
+  join_partition_t *part = (join_partition_t*)arg;
+  join_sink_t sink;
+  join_iterator_t iter;
+  joined_tuple_t tuple;
+
+  if (join_sink_constructor(&sink, part->path, JOIN_SINK_TEXT) == false) {
+    part->status = -1;
+    return NULL;
+  }
+  // Partition files are copied and removed, so they need no fsync.
+  sink.sync = false;
+
+  __join_iterator_init(&iter, part->table_id_1, part->table_id_2,
+      part->has_begin ? part->begin_key : INT64_MIN,
+      part->has_end, part->end_key);
+  while (iter.next(&iter, &tuple)) {
+    sink.put(&sink, &tuple);
+  }
+  join_iterator_destructor(&iter);
+
+  part->num_records = sink.num_records;
+  join_sink_destructor(&sink);
+  return NULL;
+}
+
+// Append a whole file to dst_fd
+static int __append_file(const int dst_fd, const char *src_path) {
+  const int32_t copy_buf_size = JOIN_SINK_BUF_SIZE;
+  uint8_t *copy_buf;
+  ssize_t len;
+  int src_fd = open(src_path, O_RDONLY | O_LARGEFILE);
+
+  if (src_fd < 0) {
+    return -1;
+  }
+  copy_buf = (uint8_t*)malloc(copy_buf_size);
+  while ((len = read(src_fd, copy_buf, copy_buf_size)) > 0) {
+    if (write(dst_fd, copy_buf, len) != len) {
+      len = -1;
+      break;
+    }
+  }
+  free(copy_buf);
+  close(src_fd);
+  return len < 0 ? -1 : 0;
+}
+
+
+// Sort-merge join algorithm is used.
+// The key space is split into ranges by the separator keys of
+// both trees, and each range is merged by its own thread into
+// its own file. The files are concatenated in key order at the end.
+int join_table(int table_id_1, int table_id_2, char * pathname) {
+#ifdef DBG
+  printf("(join_table) is called.\n");
+  printf("(join_table) table_id_1: %d, table_id_2: %d, pathname: %s\n",
+      table_id_1, table_id_2, pathname);
+#endif
+  join_partition_t parts[JOIN_THREAD_NUM];
+  pthread_t threads[JOIN_THREAD_NUM];
+  int64_t bounds[JOIN_THREAD_NUM];
+  int64_t num_records = 0;
+  int32_t num_parts;
+  int32_t i;
+  int status = 0;
+  int result_fd;
+
+  result_fd = open(pathname, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE,
+      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (result_fd < 0) {
+    perror("(join_table) Join result file opening is failed.");
+    return -1;
+  }
+
+  // Workers read the files directly.
+  buf_mgr.flush_table(&buf_mgr, table_id_1);
+  buf_mgr.flush_table(&buf_mgr, table_id_2);
+
+  num_parts = __make_partitions(table_id_1, table_id_2,
+      JOIN_THREAD_NUM, bounds);
+
+  memset(parts, 0, sizeof(parts));
+  for (i = 0; i < num_parts; ++i) {
+    parts[i].table_id_1 = table_id_1;
+    parts[i].table_id_2 = table_id_2;
+    parts[i].has_begin = i > 0;
+    parts[i].has_end = i < num_parts - 1;
+    if (parts[i].has_begin) {
+      parts[i].begin_key = bounds[i - 1];
+    }
+    if (parts[i].has_end) {
+      parts[i].end_key = bounds[i];
+    }
+    snprintf(parts[i].path, sizeof(parts[i].path), "%s.%d", pathname, i);
+
+    if (pthread_create(&threads[i], NULL, __join_worker, &parts[i]) != 0) {
+      perror("(join_table) Creating a worker is failed.");
+      assert(false);
+      exit(1);
+    }
+  }
+
+  for (i = 0; i < num_parts; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (i = 0; i < num_parts; ++i) {
+    if (parts[i].status != 0 || __append_file(result_fd, parts[i].path) != 0) {
+      status = -1;
+    }
+    num_records += parts[i].num_records;
+    unlink(parts[i].path);
+  }
+  fsync(result_fd);
+  close(result_fd);
+
+  if (num_records == 0) {
+#ifdef DBG
+    fprintf(stderr, "(join_table) No matching key found\n");
+    fprintf(stderr, "(join_table) Join failed\n");
+#endif
+    status = -1;
+  }
+
+#ifdef DBG
+  printf("(join_table) %ld records in %d partitions\n", num_records, num_parts);
+#endif
+  return status;
+}
+
+
+/** Hash join **/
+
+// Build side entry of the in-memory hash table
+typedef struct __hash_entry {
+  int64_t join_key;
+  record_t record;
+  struct __hash_entry *next;
+} hash_entry_t;
+
+// Spilled record of a Grace partition
+typedef struct __spill_record {
+  int64_t join_key;
+  record_t record;
+} spill_record_t;
+
+typedef struct __hash_table {
+  hash_entry_t **buckets;
+  int32_t bucket_bits;
+  hash_entry_t *entries;
+  int64_t num_entries;
+  int64_t capacity;
+} hash_table_t;
+
+// Buffered writer of one spill file
+typedef struct __spill_file {
+  char path[PART_PATH_SIZE];
+  int fd;
+  spill_record_t *buf;
+  int32_t buf_idx;
+} spill_file_t;
+
+#define SPILL_BUF_RECORDS (PAGE_SIZE * 16 / sizeof(spill_record_t))
+
+
+static uint64_t __hash_key(const int64_t key) {
+  return (uint64_t)key * 0x9e3779b97f4a7c15ULL;
+}
+
+static int32_t __spill_partition_of(const int64_t join_key) {
+  return (__hash_key(join_key) >> 20) % HASH_JOIN_PARTITION_NUM;
+}
+
+static bool __extract_key(join_key_extractor_t extractor,
+    const record_t * const record, int64_t *join_key) {
+  if (extractor == NULL) {
+    *join_key = record->key;
+    return true;
+  }
+  return extractor(record, join_key);
+}
+
+// Room for max_records entries, up to HASH_JOIN_MEM_BUDGET
+static void __hash_table_constructor(hash_table_t * const this,
+    const int64_t max_records) {
+  memset(this, 0, sizeof(*this));
+  this->capacity = HASH_JOIN_MEM_BUDGET / sizeof(hash_entry_t);
+  if (max_records < this->capacity) {
+    this->capacity = max_records > 0 ? max_records : 1;
+  }
+  // About one bucket per entry, and at least two
+  this->bucket_bits = 1;
+  while (((int64_t)1 << this->bucket_bits) < this->capacity) {
+    this->bucket_bits++;
+  }
+  this->buckets = (hash_entry_t**)calloc((size_t)1 << this->bucket_bits,
+      sizeof(*this->buckets));
+  this->entries = (hash_entry_t*)malloc(this->capacity
+      * sizeof(*this->entries));
+}
+
+static void __hash_table_clear(hash_table_t * const this) {
+  memset(this->buckets, 0, ((size_t)1 << this->bucket_bits)
+      * sizeof(*this->buckets));
+  this->num_entries = 0;
+}
+
+static void __hash_table_destructor(hash_table_t * const this) {
+  free(this->buckets);
+  free(this->entries);
+  memset(this, 0, sizeof(*this));
+}
+
+static hash_entry_t **__hash_bucket(const hash_table_t * const this,
+    const int64_t join_key) {
+  return &this->buckets[__hash_key(join_key) >> (64 - this->bucket_bits)];
+}
+
+// Returns false when the memory budget is used up.
+static bool __hash_table_insert(hash_table_t * const this,
+    const int64_t join_key, const record_t * const record) {
+  hash_entry_t **bucket;
+  hash_entry_t *entry;
+
+  if (this->num_entries == this->capacity) {
+    return false;
+  }
+  entry = &this->entries[this->num_entries++];
+  entry->join_key = join_key;
+  entry->record = *record;
+
+  bucket = __hash_bucket(this, join_key);
+  entry->next = *bucket;
+  *bucket = entry;
+  return true;
+}
+
+static void __spill_open(spill_file_t * const this, const char *pathname,
+    const char *side, const int32_t idx) {
+  snprintf(this->path, sizeof(this->path), "%s.%s%d", pathname, side, idx);
+  this->fd = open(this->path, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE,
+      S_IRUSR | S_IWUSR);
+  if (this->fd < 0) {
+    perror("(hash_join_table) Spill file opening is failed.");
+    assert(false);
+    exit(1);
+  }
+  this->buf = (spill_record_t*)malloc(SPILL_BUF_RECORDS * sizeof(*this->buf));
+  this->buf_idx = 0;
+}
+
+static void __spill_flush(spill_file_t * const this) {
+  ssize_t len = this->buf_idx * sizeof(*this->buf);
+  if (write(this->fd, this->buf, len) != len) {
+    perror("(hash_join_table) Spilling is failed.");
+    assert(false);
+    exit(1);
+  }
+  this->buf_idx = 0;
+}
+
+static void __spill_put(spill_file_t * const this, const int64_t join_key,
+    const record_t * const record) {
+  if (this->buf_idx == SPILL_BUF_RECORDS) {
+    __spill_flush(this);
+  }
+  this->buf[this->buf_idx].join_key = join_key;
+  this->buf[this->buf_idx].record = *record;
+  this->buf_idx++;
+}
+
+// Flush and rewind, so the file can be read back
+static void __spill_rewind(spill_file_t * const this) {
+  __spill_flush(this);
+  free(this->buf);
+  this->buf = NULL;
+  lseek64(this->fd, 0, SEEK_SET);
+}
+
+static void __spill_close(spill_file_t * const this) {
+  free(this->buf);
+  close(this->fd);
+  unlink(this->path);
+  memset(this, 0, sizeof(*this));
+}
+
+// Read spilled records in chunks. Returns the number of records read.
+static int32_t __spill_read(spill_file_t * const this,
+    spill_record_t * const buf) {
+  ssize_t len = read(this->fd, buf, SPILL_BUF_RECORDS * sizeof(*buf));
+  if (len < 0) {
+    perror("(hash_join_table) Reading a spill file is failed.");
+    assert(false);
+    exit(1);
+  }
+  return len / sizeof(*buf);
+}
+
+// Consumer of hash join results
+typedef struct __hash_emitter {
+  join_callback_t callback;
+  void *arg;
+  bool build_is_left;
+  bool stopped;
+  int64_t num_records;
+} hash_emitter_t;
+
+// Probe one record and emit every match.
+// Results keep table_id_1 on the left whichever side was built.
+static void __hash_probe(const hash_table_t * const table,
+    hash_emitter_t * const emitter,
+    const int64_t join_key, record_t * const record) {
+  hash_entry_t *entry;
+  joined_tuple_t tuple;
+
+  tuple.key = join_key;
+  for (entry = *__hash_bucket(table, join_key);
+      entry != NULL && emitter->stopped == false; entry = entry->next) {
+    if (entry->join_key != join_key) {
+      continue;
+    }
+    if (emitter->build_is_left) {
+      tuple.left_value = entry->record.value;
+      tuple.right_value = record->value;
+    } else {
+      tuple.left_value = record->value;
+      tuple.right_value = entry->record.value;
+    }
+    emitter->num_records++;
+    if (emitter->callback(&tuple, emitter->arg) == false) {
+      emitter->stopped = true;
+    }
+  }
+}
+
+// Join one pair of Grace partitions in memory.
+// A build partition larger than the budget is joined in several
+// passes, each probing the whole probe partition.
+static void __hash_join_partition(hash_table_t * const table,
+    hash_emitter_t * const emitter,
+    spill_file_t * const build, spill_file_t * const probe) {
+  spill_record_t *build_buf = (spill_record_t*)malloc(SPILL_BUF_RECORDS
+      * sizeof(*build_buf));
+  spill_record_t *probe_buf = (spill_record_t*)malloc(SPILL_BUF_RECORDS
+      * sizeof(*probe_buf));
+  int32_t build_n = 0, build_idx = 0;
+  int32_t probe_n, i;
+  bool has_more = true;
+
+  while (has_more && emitter->stopped == false) {
+    __hash_table_clear(table);
+    for (;;) {
+      if (build_idx == build_n) {
+        build_n = __spill_read(build, build_buf);
+        build_idx = 0;
+        if (build_n == 0) {
+          has_more = false;
+          break;
+        }
+      }
+      if (__hash_table_insert(table, build_buf[build_idx].join_key,
+            &build_buf[build_idx].record) == false) {
+        break;
+      }
+      build_idx++;
+    }
+    if (table->num_entries == 0) {
+      break;
+    }
+
+    lseek64(probe->fd, 0, SEEK_SET);
+    while ((probe_n = __spill_read(probe, probe_buf)) > 0) {
+      for (i = 0; i < probe_n; ++i) {
+        __hash_probe(table, emitter,
+            probe_buf[i].join_key, &probe_buf[i].record);
+      }
+    }
+  }
+  free(build_buf);
+  free(probe_buf);
+}
+
+
+// Hash join on keys extracted from records.
+// The table with fewer pages is the build side. If it does not fit
+// in HASH_JOIN_MEM_BUDGET, both sides are split into
+// HASH_JOIN_PARTITION_NUM spill files by join key (Grace hash join)
+// and each pair of files is joined in memory.
+// Spill files are named after the process id in the working directory.
+int64_t hash_join_foreach(int table_id_1, join_key_extractor_t key_of_1,
+    int table_id_2, join_key_extractor_t key_of_2,
+    join_callback_t callback, void *arg) {
+  const bool build_is_left = header_page[table_id_1].page.number_of_pages
+    <= header_page[table_id_2].page.number_of_pages;
+  const int32_t build_id = build_is_left ? table_id_1 : table_id_2;
+  const int32_t probe_id = build_is_left ? table_id_2 : table_id_1;
+  join_key_extractor_t build_key_of = build_is_left ? key_of_1 : key_of_2;
+  join_key_extractor_t probe_key_of = build_is_left ? key_of_2 : key_of_1;
+  spill_file_t *build_files = NULL, *probe_files = NULL;
+  hash_emitter_t emitter;
+  hash_table_t table;
+  leaf_cursor_t cursor;
+  char spill_prefix[PART_PATH_SIZE];
+  int64_t join_key, i;
+  int32_t part;
+
+  memset(&emitter, 0, sizeof(emitter));
+  emitter.callback = callback;
+  emitter.arg = arg;
+  emitter.build_is_left = build_is_left;
+  snprintf(spill_prefix, sizeof(spill_prefix), "hash_join.%d", (int)getpid());
+
+  buf_mgr.flush_table(&buf_mgr, table_id_1);
+  buf_mgr.flush_table(&buf_mgr, table_id_2);
+
+  // Every page of the build side could be a full leaf
+  __hash_table_constructor(&table,
+      header_page[build_id].page.number_of_pages * RECORD_PER_PAGE);
+
+  // Build. Spill everything once the budget is exceeded.
+  leaf_cursor_constructor(&cursor, build_id);
+  for (cursor.seek(&cursor, INT64_MIN); cursor.is_valid(&cursor);
+      cursor.next(&cursor)) {
+    record_t *record = &cursor.page->content.records[cursor.idx];
+    if (__extract_key(build_key_of, record, &join_key) == false) {
+      continue;
+    }
+    if (build_files == NULL
+        && __hash_table_insert(&table, join_key, record)) {
+      continue;
+    }
+
+    if (build_files == NULL) {
+      build_files = (spill_file_t*)calloc(HASH_JOIN_PARTITION_NUM,
+          sizeof(*build_files));
+      for (part = 0; part < HASH_JOIN_PARTITION_NUM; ++part) {
+        __spill_open(&build_files[part], spill_prefix, "b", part);
+      }
+      for (i = 0; i < table.num_entries; ++i) {
+        __spill_put(&build_files[__spill_partition_of(table.entries[i].join_key)],
+            table.entries[i].join_key, &table.entries[i].record);
+      }
+      __hash_table_clear(&table);
+    }
+    __spill_put(&build_files[__spill_partition_of(join_key)],
+        join_key, record);
+  }
+  leaf_cursor_destructor(&cursor);
+
+  // Probe. Stream the leaves, or spill them too.
+  if (build_files != NULL) {
+    probe_files = (spill_file_t*)calloc(HASH_JOIN_PARTITION_NUM,
+        sizeof(*probe_files));
+    for (part = 0; part < HASH_JOIN_PARTITION_NUM; ++part) {
+      __spill_open(&probe_files[part], spill_prefix, "p", part);
+    }
+  }
+
+  leaf_cursor_constructor(&cursor, probe_id);
+  for (cursor.seek(&cursor, INT64_MIN);
+      cursor.is_valid(&cursor) && emitter.stopped == false;
+      cursor.next(&cursor)) {
+    record_t *record = &cursor.page->content.records[cursor.idx];
+    if (__extract_key(probe_key_of, record, &join_key) == false) {
+      continue;
+    }
+    if (probe_files == NULL) {
+      __hash_probe(&table, &emitter, join_key, record);
+    } else {
+      __spill_put(&probe_files[__spill_partition_of(join_key)],
+          join_key, record);
+    }
+  }
+  leaf_cursor_destructor(&cursor);
+
+  if (build_files != NULL) {
+    for (part = 0; part < HASH_JOIN_PARTITION_NUM; ++part) {
+      __spill_rewind(&build_files[part]);
+      __spill_rewind(&probe_files[part]);
+      __hash_join_partition(&table, &emitter,
+          &build_files[part], &probe_files[part]);
+      __spill_close(&build_files[part]);
+      __spill_close(&probe_files[part]);
+    }
+    free(build_files);
+    free(probe_files);
+  }
+
+  __hash_table_destructor(&table);
+  return emitter.num_records;
+}
+
+// Hash join written as text in the format of join_table(),
+// with the join key.
+int hash_join_table(int table_id_1, join_key_extractor_t key_of_1,
+    int table_id_2, join_key_extractor_t key_of_2, char * pathname) {
+#ifdef DBG
+  printf("(hash_join_table) table_id_1: %d, table_id_2: %d, pathname: %s\n",
+      table_id_1, table_id_2, pathname);
+#endif
+  join_sink_t sink;
+  int64_t num_records;
+
+  if (join_sink_constructor(&sink, pathname, JOIN_SINK_TEXT) == false) {
+    return -1;
+  }
+  num_records = hash_join_foreach(table_id_1, key_of_1, table_id_2, key_of_2,
+      join_sink_callback, &sink);
+  join_sink_destructor(&sink);
+
+#ifdef DBG
+  printf("(hash_join_table) %ld records\n", num_records);
+#endif
+  return num_records == 0 ? -1 : 0;
+}
+
+
+/** Join into a table **/
+
+// Bottom-up builder of a new table file
+typedef struct __bulk_loader {
+  int fd;
+  int64_t next_page_number;
+
+  // Leaves are written one behind, so the last two can be balanced.
+  struct __page *prev_leaf;
+  struct __page *cur_leaf;
+  bool has_prev_leaf;
+
+  // First key and offset of every page of the level being built
+  int64_t *keys;
+  int64_t *offsets;
+  int64_t num_pages;
+  int64_t capacity;
+
+  // Records whose value was cut to fit
+  int64_t num_truncated;
+} bulk_loader_t;
+
+static void __loader_write(bulk_loader_t * const this, const void *buf,
+    const size_t len, const int64_t offset) {
+  if (pwrite(this->fd, buf, len, offset) != (ssize_t)len) {
+    perror("(join_into_table) Writing a page is failed.");
+    assert(false);
+    exit(1);
+  }
+}
+
+static void __loader_push(bulk_loader_t * const this, const int64_t key,
+    const int64_t offset) {
+  if (this->num_pages == this->capacity) {
+    this->capacity = this->capacity == 0 ? 1024 : this->capacity * 2;
+    this->keys = (int64_t*)realloc(this->keys,
+        this->capacity * sizeof(*this->keys));
+    this->offsets = (int64_t*)realloc(this->offsets,
+        this->capacity * sizeof(*this->offsets));
+  }
+  this->keys[this->num_pages] = key;
+  this->offsets[this->num_pages] = offset;
+  this->num_pages++;
+}
+
+// Write prev_leaf. Its right sibling is the page allocated next.
+static void __loader_write_prev_leaf(bulk_loader_t * const this,
+    const bool is_last) {
+  const int64_t offset = this->next_page_number * PAGE_SIZE;
+
+  this->prev_leaf->header.is_leaf = true;
+  this->prev_leaf->header.one_more_page_offset =
+    is_last ? 0 : offset + PAGE_SIZE;
+  __loader_write(this, this->prev_leaf, PAGE_SIZE, offset);
+  __loader_push(this, this->prev_leaf->content.records[0].key, offset);
+  this->next_page_number++;
+}
+
+static void __loader_put(bulk_loader_t * const this,
+    const joined_tuple_t * const tuple) {
+  char value[VALUE_SIZE * 2 + 2];
+  record_t *record;
+  struct __page *page;
+  int len;
+
+  if (this->cur_leaf->header.number_of_keys == RECORD_PER_PAGE) {
+    if (this->has_prev_leaf) {
+      __loader_write_prev_leaf(this, false);
+    }
+    page = this->prev_leaf;
+    this->prev_leaf = this->cur_leaf;
+    this->cur_leaf = page;
+    this->has_prev_leaf = true;
+    memset(this->cur_leaf, 0, PAGE_SIZE);
+  }
+
+  record = &this->cur_leaf->content.records[
+    this->cur_leaf->header.number_of_keys++];
+  record->key = tuple->key;
+  // "left_value,right_value", cut to fit
+  len = snprintf(value, sizeof(value), "%.*s,%.*s",
+      VALUE_SIZE, tuple->left_value, VALUE_SIZE, tuple->right_value);
+  if (len > VALUE_SIZE - 1) {
+    len = VALUE_SIZE - 1;
+    this->num_truncated++;
+  }
+  memcpy(record->value, value, len);
+  record->value[len] = '\0';
+}
+
+static void __loader_finish_leaves(bulk_loader_t * const this) {
+  struct __page *page;
+  int32_t total, n, moved;
+
+  // Balance a short last leaf with the one before it
+  if (this->has_prev_leaf
+      && this->cur_leaf->header.number_of_keys
+      < (int32_t)(RECORD_PER_PAGE / 2)) {
+    total = this->prev_leaf->header.number_of_keys
+      + this->cur_leaf->header.number_of_keys;
+    n = total - total / 2;
+    moved = this->prev_leaf->header.number_of_keys - n;
+
+    memmove(&this->cur_leaf->content.records[moved],
+        &this->cur_leaf->content.records[0],
+        this->cur_leaf->header.number_of_keys * sizeof(record_t));
+    memcpy(&this->cur_leaf->content.records[0],
+        &this->prev_leaf->content.records[n], moved * sizeof(record_t));
+    memset(&this->prev_leaf->content.records[n], 0,
+        moved * sizeof(record_t));
+    this->prev_leaf->header.number_of_keys = n;
+    this->cur_leaf->header.number_of_keys = total - n;
+  }
+
+  if (this->has_prev_leaf) {
+    __loader_write_prev_leaf(this, false);
+  }
+  // The last leaf, or an empty root
+  page = this->prev_leaf;
+  this->prev_leaf = this->cur_leaf;
+  this->cur_leaf = page;
+  if (this->prev_leaf->header.number_of_keys > 0 || this->num_pages == 0) {
+    __loader_write_prev_leaf(this, true);
+  }
+}
+
+// Build internal levels over the pages of the level below,
+// spreading children evenly. Returns the root offset.
+static int64_t __loader_build_internal(bulk_loader_t * const this) {
+  struct __page *page = this->cur_leaf;
+  int64_t *child_keys, *child_offsets;
+  int64_t num_children, num_nodes, child, offset;
+  int64_t node, count, i;
+
+  while (this->num_pages > 1) {
+    child_keys = this->keys;
+    child_offsets = this->offsets;
+    num_children = this->num_pages;
+    this->keys = NULL;
+    this->offsets = NULL;
+    this->num_pages = 0;
+    this->capacity = 0;
+
+    num_nodes = (num_children + OFFSET_ORDER - 1) / OFFSET_ORDER;
+    child = 0;
+    for (node = 0; node < num_nodes; ++node) {
+      count = num_children / num_nodes + (node < num_children % num_nodes);
+      offset = this->next_page_number * PAGE_SIZE;
+
+      memset(page, 0, PAGE_SIZE);
+      page->header.is_leaf = false;
+      page->header.number_of_keys = count - 1;
+      page->header.one_more_page_offset = child_offsets[child];
+      for (i = 1; i < count; ++i) {
+        page->content.key_and_offsets[i - 1].key = child_keys[child + i];
+        page->content.key_and_offsets[i - 1].page_offset =
+          child_offsets[child + i];
+      }
+      __loader_write(this, page, PAGE_SIZE, offset);
+      __loader_push(this, child_keys[child], offset);
+      this->next_page_number++;
+
+      // Children are written already. Patch their parent offset.
+      for (i = 0; i < count; ++i) {
+        __loader_write(this, &offset, sizeof(offset), child_offsets[child + i]);
+      }
+      child += count;
+    }
+
+    free(child_keys);
+    free(child_offsets);
+  }
+  return this->offsets[0];
+}
+
+
+// Join two tables into a new table at dest_path.
+// The merged stream is sorted, so the tree is built bottom-up:
+// packed leaves are written on sequential pages, then each internal
+// level over the one below. A record of the new table is
+// "left_value,right_value", truncated to VALUE_SIZE; num_truncated,
+// if not NULL, gets how many records were.
+// Returns the table id of the new table, or -1.
+int join_into_table(int table_id_1, int table_id_2, char * dest_path,
+    int64_t * num_truncated) {
+  bulk_loader_t loader;
+  join_iterator_t iter;
+  joined_tuple_t tuple;
+  header_page_t header;
+  int8_t *dummy;
+
+  memset(&loader, 0, sizeof(loader));
+  loader.fd = open(dest_path, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE,
+      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (loader.fd < 0) {
+    perror("(join_into_table) Table file opening is failed.");
+    return -1;
+  }
+  loader.prev_leaf = (struct __page*)calloc(1, PAGE_SIZE);
+  loader.cur_leaf = (struct __page*)calloc(1, PAGE_SIZE);
+
+  // Page 0 is header page, page 1 is free page dummy.
+  loader.next_page_number = 2;
+
+  join_iterator_constructor(&iter, table_id_1, table_id_2);
+  while (iter.next(&iter, &tuple)) {
+    __loader_put(&loader, &tuple);
+  }
+  join_iterator_destructor(&iter);
+
+  __loader_finish_leaves(&loader);
+
+  memset(&header, 0, sizeof(header));
+  header.free_page_offset = 1 * PAGE_SIZE;
+  header.root_page_offset = __loader_build_internal(&loader);
+  header.number_of_pages = loader.next_page_number;
+
+  // An empty dummy makes open_table() start a new free page list.
+  dummy = (int8_t*)calloc(1, PAGE_SIZE);
+  __loader_write(&loader, dummy, PAGE_SIZE, 0);
+  __loader_write(&loader, &header, sizeof(header), 0);
+  __loader_write(&loader, dummy, PAGE_SIZE, PAGE_SIZE);
+  free(dummy);
+
+  fsync(loader.fd);
+  close(loader.fd);
+  free(loader.prev_leaf);
+#ifdef DBG
+  printf("(join_into_table) %ld records truncated\n", loader.num_truncated);
+#endif
+  if (num_truncated != NULL) {
+    *num_truncated = loader.num_truncated;
+  }
+  free(loader.cur_leaf);
+  free(loader.keys);
+  free(loader.offsets);
+
+  return open_table(dest_path);
+}
+
+
+/** Multi-way merge join **/
+
+// Leapfrog the cursors: every cursor advances to the largest
+// current key until all of them agree on one key.
+static bool __multi_join_next(leaf_cursor_t * const cursors,
+    const int32_t num_tables) {
+  int64_t max_key;
+  int32_t i, num_equal = 0;
+
+  for (i = 0; i < num_tables; ++i) {
+    if (cursors[i].is_valid(&cursors[i]) == false) {
+      return false;
+    }
+  }
+  max_key = cursors[0].get_key(&cursors[0]);
+
+  // Go round until num_tables cursors in a row sit on max_key
+  i = 0;
+  while (num_equal < num_tables) {
+    if (cursors[i].advance_to(&cursors[i], max_key) == false) {
+      return false;
+    }
+    if (cursors[i].get_key(&cursors[i]) == max_key) {
+      num_equal++;
+    } else {
+      max_key = cursors[i].get_key(&cursors[i]);
+      num_equal = 1;
+    }
+    i = (i + 1) % num_tables;
+  }
+  return true;
+}
+
+// Join N tables on the primary key in one pass.
+// Each table is read once, by its own leaf cursor.
+// Returns the number of tuples produced, or -1.
+int64_t join_tables_foreach(const int * const table_ids,
+    const int num_tables, multi_join_callback_t callback, void *arg) {
+  leaf_cursor_t cursors[JOIN_MAX_TABLES];
+  multi_joined_tuple_t tuple;
+  int64_t num_records = 0;
+  int32_t i;
+
+  if (num_tables < 1 || num_tables > JOIN_MAX_TABLES) {
+    return -1;
+  }
+
+  for (i = 0; i < num_tables; ++i) {
+    buf_mgr.flush_table(&buf_mgr, table_ids[i]);
+    leaf_cursor_constructor(&cursors[i], table_ids[i]);
+    cursors[i].seek(&cursors[i], INT64_MIN);
+  }
+
+  tuple.num_values = num_tables;
+  while (__multi_join_next(cursors, num_tables)) {
+    tuple.key = cursors[0].get_key(&cursors[0]);
+    for (i = 0; i < num_tables; ++i) {
+      tuple.values[i] = cursors[i].get_value(&cursors[i]);
+    }
+    num_records++;
+    if (callback(&tuple, arg) == false) {
+      break;
+    }
+    for (i = 0; i < num_tables; ++i) {
+      cursors[i].next(&cursors[i]);
+    }
+  }
+
+  for (i = 0; i < num_tables; ++i) {
+    leaf_cursor_destructor(&cursors[i]);
+  }
+  return num_records;
+}
+
+// N-way join written as text: "key,value_1,key,value_2,...".
+int join_tables(const int * const table_ids, const int num_tables,
+    char * pathname) {
+  join_sink_t sink;
+  int64_t num_records;
+
+  if (join_sink_constructor(&sink, pathname, JOIN_SINK_TEXT) == false) {
+    return -1;
+  }
+  num_records = join_tables_foreach(table_ids, num_tables,
+      join_sink_multi_callback, &sink);
+  join_sink_destructor(&sink);
+
+#ifdef DBG
+  printf("(join_tables) %ld records from %d tables\n",
+      num_records, num_tables);
+#endif
+  return num_records <= 0 ? -1 : 0;
+}
+
+
+/** Semi-join and anti-join **/
+
+typedef struct __bloom_filter {
+  uint64_t *bits;
+  uint64_t num_bits;
+} bloom_filter_t;
+
+// Double hashing: the i-th probe is h1 + i * h2
+static void __bloom_hashes(const int64_t key, uint64_t *h1, uint64_t *h2) {
+  uint64_t h = __hash_key(key);
+  *h1 = h ^ (h >> 31);
+  *h2 = ((h >> 17) * 0xc2b2ae3d27d4eb4fULL) | 1;
+}
+
+static void __bloom_add(bloom_filter_t * const this, const int64_t key) {
+  uint64_t h1, h2, bit;
+  int32_t i;
+  __bloom_hashes(key, &h1, &h2);
+  for (i = 0; i < JOIN_BLOOM_HASH_NUM; ++i) {
+    bit = (h1 + i * h2) % this->num_bits;
+    this->bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+  }
+}
+
+static bool __bloom_may_contain(const bloom_filter_t * const this,
+    const int64_t key) {
+  uint64_t h1, h2, bit;
+  int32_t i;
+  __bloom_hashes(key, &h1, &h2);
+  for (i = 0; i < JOIN_BLOOM_HASH_NUM; ++i) {
+    bit = (h1 + i * h2) % this->num_bits;
+    if ((this->bits[bit / 64] & ((uint64_t)1 << (bit % 64))) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Filter over every key of a table, sized by its number of pages
+static void __bloom_build(bloom_filter_t * const this, const int32_t table_id) {
+  leaf_cursor_t cursor;
+
+  this->num_bits = header_page[table_id].page.number_of_pages
+    * RECORD_PER_PAGE * JOIN_BLOOM_BITS_PER_KEY;
+  this->num_bits = (this->num_bits + 63) / 64 * 64;
+  this->bits = (uint64_t*)calloc(this->num_bits / 64, sizeof(*this->bits));
+
+  leaf_cursor_constructor(&cursor, table_id);
+  for (cursor.seek(&cursor, INT64_MIN); cursor.is_valid(&cursor);
+      cursor.next(&cursor)) {
+    __bloom_add(this, cursor.get_key(&cursor));
+  }
+  leaf_cursor_destructor(&cursor);
+}
+
+
+typedef struct __semi_join {
+  int32_t table_id;
+  bool anti;
+  bloom_filter_t bloom;
+  leaf_cursor_t filter;     // cursor on the filter table
+  struct __page *leaf;
+  multi_join_callback_t callback;
+  void *arg;
+  bool stopped;
+  int64_t num_records;
+} semi_join_t;
+
+// True when the filter table has key.
+// The probes come in key order, so the filter cursor only moves forward.
+static bool __semi_join_has(semi_join_t * const this, const int64_t key) {
+  if (__bloom_may_contain(&this->bloom, key) == false) {
+    return false;
+  }
+  return this->filter.advance_to(&this->filter, key)
+    && this->filter.get_key(&this->filter) == key;
+}
+
+// Handle the leaf at offset, holding keys in [lo, hi).
+static void __semi_join_leaf(semi_join_t * const this, const int64_t offset,
+    const bool has_lo, const int64_t lo, const bool has_hi, const int64_t hi) {
+  multi_joined_tuple_t tuple;
+  bool range_matches;
+  record_t *record;
+  int32_t i;
+
+  // Does the filter table have any key in [lo, hi)?
+  range_matches = this->filter.advance_to(&this->filter,
+      has_lo ? lo : INT64_MIN)
+    && (has_hi == false || this->filter.get_key(&this->filter) < hi);
+
+  // A semi-join never reads a leaf the filter table cannot match.
+  if (this->anti == false && range_matches == false) {
+    return;
+  }
+
+  join_read_page(this->table_id, offset, this->leaf);
+  tuple.num_values = 1;
+  for (i = 0; i < this->leaf->header.number_of_keys; ++i) {
+    record = &this->leaf->content.records[i];
+    // Every record of an anti-join leaf with no match is kept.
+    if (range_matches && __semi_join_has(this, record->key) == this->anti) {
+      continue;
+    }
+
+    tuple.key = record->key;
+    tuple.values[0] = record->value;
+    this->num_records++;
+    if (this->callback(&tuple, this->arg) == false) {
+      this->stopped = true;
+      return;
+    }
+  }
+}
+
+// Walk the internal pages from offset, which is 'height' levels above
+// the leaves, and hand each leaf over with its key range from the
+// separators. Leaves themselves are read only when needed.
+static void __semi_join_walk(semi_join_t * const this, const int64_t offset,
+    const int32_t height, const bool has_lo, const int64_t lo,
+    const bool has_hi, const int64_t hi) {
+  struct __page *page;
+  int64_t child;
+  int32_t i, num_keys;
+
+  if (height == 0) {
+    __semi_join_leaf(this, offset, has_lo, lo, has_hi, hi);
+    return;
+  }
+
+  page = (struct __page*)malloc(sizeof(*page));
+  join_read_page(this->table_id, offset, page);
+  num_keys = page->header.number_of_keys;
+
+  for (i = 0; i <= num_keys && this->stopped == false; ++i) {
+    child = i == 0 ? page->header.one_more_page_offset
+      : page->content.key_and_offsets[i - 1].page_offset;
+    __semi_join_walk(this, child, height - 1,
+        i == 0 ? has_lo : true,
+        i == 0 ? lo : page->content.key_and_offsets[i - 1].key,
+        i == num_keys ? has_hi : true,
+        i == num_keys ? hi : page->content.key_and_offsets[i].key);
+  }
+  free(page);
+}
+
+static int64_t __semi_join_foreach(int table_id_1, int table_id_2,
+    const bool anti, multi_join_callback_t callback, void *arg) {
+  semi_join_t join;
+  int64_t offset;
+  int32_t height = 0;
+
+  buf_mgr.flush_table(&buf_mgr, table_id_1);
+  buf_mgr.flush_table(&buf_mgr, table_id_2);
+
+  memset(&join, 0, sizeof(join));
+  join.table_id = table_id_1;
+  join.anti = anti;
+  join.callback = callback;
+  join.arg = arg;
+  join.leaf = (struct __page*)malloc(sizeof(*join.leaf));
+  __bloom_build(&join.bloom, table_id_2);
+  leaf_cursor_constructor(&join.filter, table_id_2);
+  join.filter.seek(&join.filter, INT64_MIN);
+
+  // The tree is balanced, so the leftmost path gives the height.
+  offset = header_page[table_id_1].page.root_page_offset;
+  join_read_page(table_id_1, offset, join.leaf);
+  while (join.leaf->header.is_leaf == false) {
+    join_read_page(table_id_1, join.leaf->header.one_more_page_offset,
+        join.leaf);
+    height++;
+  }
+
+  __semi_join_walk(&join, offset, height, false, 0, false, 0);
+
+  leaf_cursor_destructor(&join.filter);
+  free(join.bloom.bits);
+  free(join.leaf);
+  return join.num_records;
+}
+
+// Records of table_id_1 whose key is in table_id_2, in key order.
+// The keys of table_id_2 go into a bloom filter, and leaves of
+// table_id_1 whose separator range holds no key of table_id_2
+// are not read at all. Pass the smaller table as table_id_2.
+int64_t semi_join_foreach(int table_id_1, int table_id_2,
+    multi_join_callback_t callback, void *arg) {
+  return __semi_join_foreach(table_id_1, table_id_2, false, callback, arg);
+}
+
+// Records of table_id_1 whose key is not in table_id_2, in key order
+int64_t anti_join_foreach(int table_id_1, int table_id_2,
+    multi_join_callback_t callback, void *arg) {
+  return __semi_join_foreach(table_id_1, table_id_2, true, callback, arg);
+}
+
+// Semi-join or anti-join written as text: "key,value".
+static int __semi_join_table(int table_id_1, int table_id_2, const bool anti,
+    char * pathname) {
+  join_sink_t sink;
+  int64_t num_records;
+
+  if (join_sink_constructor(&sink, pathname, JOIN_SINK_TEXT) == false) {
+    return -1;
+  }
+  num_records = __semi_join_foreach(table_id_1, table_id_2, anti,
+      join_sink_multi_callback, &sink);
+  join_sink_destructor(&sink);
+  return num_records == 0 ? -1 : 0;
+}
+
+int semi_join_table(int table_id_1, int table_id_2, char * pathname) {
+  return __semi_join_table(table_id_1, table_id_2, false, pathname);
+}
+
+int anti_join_table(int table_id_1, int table_id_2, char * pathname) {
+  return __semi_join_table(table_id_1, table_id_2, true, pathname);
+}
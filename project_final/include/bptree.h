@@ -9,53 +9,139 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "config.h"
 
 #define E_OK 0
 #define E_NOT_FOUND 1
 #define E_DUP 2
+#define E_DEADLOCK 3
+#define E_READ_ONLY 4
+#define E_TOO_LONG 5
 #define E_FULL_TABLE (-1)
 #define HPAGE_NUM 0
 #define ADDR_NOT_EXIST 0
 
+// Hints of a table opened on a mapping of its file
+#define MMAP_POPULATE 1   // read the whole file in at open
+#define MMAP_SEQUENTIAL 2 // for scans
+#define MMAP_RANDOM 4     // for lookups
+
 typedef uint64_t addr;
 
+/* Key of the trees. Either way the order of keys is the memcmp order
+ * of their encodings by the key_enc functions.
+ */
+#ifdef BYTE_KEY
+typedef struct bkey{
+	uint8_t b[KEY_SIZE];
+} bkey_t;
+#define KEY_CMP(x, y) memcmp((x).b, (y).b, KEY_SIZE)
+#else
+typedef int64_t bkey_t;
+#define KEY_CMP(x, y) (((x) > (y)) - ((x) < (y)))
+#endif
+#define KEY_EQ(x, y) (KEY_CMP(x, y) == 0)
+#define KEY_LT(x, y) (KEY_CMP(x, y) < 0)
+
+/* Key being encoded, field by field
+ */
+typedef struct key_enc{
+	uint8_t b[KEY_SIZE];
+	int len;
+} key_enc;
+
 typedef struct hblock{
-	addr free; // 8
+	addr free; // 8, free list of files from before the maps
 	addr root; // 8
 	uint64_t num_page; // 8
-	uint8_t pad[4072];
+	uint64_t pad0; // 8, zero at the place of page_lsn for write_block()
+	uint64_t fsm_magic; // 8, set once the free space maps are in use
+	uint64_t num_map; // 8
+	addr map[FSM_MAX_MAPS]; // pages of the free space maps
+	uint8_t pad[4048 - 8 * FSM_MAX_MAPS];
 } hblock;
 
 typedef struct record{
-	int64_t k;
+	bkey_t k;
 	char v[VALUE_SIZE];
 } record;
 
+/* Slot of a leaf. The payload is the value itself, or the address
+ * of its first overflow page when vlen > LEAF_INLINE_MAX.
+ */
+typedef struct slot{
+	bkey_t k; // KEY_SIZE
+	uint32_t vlen; // 4, value bytes
+	uint16_t off; // 2, payload offset in l_data
+	uint16_t len; // 2, payload bytes
+} slot;
+
 typedef struct child{
-	int64_t k;
+	bkey_t k;
 	addr v;
+#ifdef ORDER_STATISTIC
+	uint64_t cnt; // records under v
+#endif
 } child;
 
+/* Entry of a narrow internal node. The key keeps its last 4 bytes,
+ * the others are those of i_prefix of the node.
+ */
+typedef struct nchild{
+	uint32_t k; // 4, last key bytes
+	uint32_t pnum; // 4, page number of the child
+#ifdef ORDER_STATISTIC
+	uint64_t cnt; // records under the child
+#endif
+} nchild;
+
+/* Internal node decoded to full entries for a structural change
+ */
+typedef struct wnode{
+	int num_keys;
+	addr leftmost;
+#ifdef ORDER_STATISTIC
+	uint64_t leftmost_cnt;
+#endif
+	child children[NUM_NARROW_KEY + 1];
+} wnode;
+
 typedef struct nblock{
 	addr parent; //8
 	int is_leaf; // 4
 	int num_keys; // 4
-  uint8_t pad1[8]; // 8
+	uint16_t data_off; // 2, start of the leaf payloads in l_data
+	uint16_t dead_bytes; // 2, bytes of removed leaf payloads
+  uint8_t pad1[4]; // 4
   int64_t page_lsn; // 8
-	uint8_t pad2[88]; // 88
+	int32_t i_narrow; // 4, entries are nchild
+	uint8_t pad2[4]; // 4
+	bkey_t i_prefix; // KEY_SIZE, first key of a narrow internal node
+#ifdef ORDER_STATISTIC
+	uint64_t leftmost_cnt; // 8, records under i_leftmost
+	uint8_t pad3[72 - KEY_SIZE];
+#else
+	uint8_t pad3[80 - KEY_SIZE];
+#endif
 	union{
 		addr sib;
 		addr leftmost;
 	}u1;
 	union{
 		child children[NUM_INT_KEY];
-		record recs[NUM_LEAF_REC];
+		nchild nchildren[NUM_NARROW_KEY];
+		slot slots[LEAF_AREA / sizeof(slot)];
+		uint8_t data[LEAF_AREA];
 	}u2;
 #define i_leftmost u1.leftmost
 #define l_sib u1.sib
 #define i_children u2.children
-#define l_recs u2.recs
+#define i_nchildren u2.nchildren
+#define l_slots u2.slots
+#define l_data u2.data
 } nblock;
 
 typedef struct fblock{
@@ -63,6 +149,16 @@ typedef struct fblock{
 	uint8_t pad[4088];
 } fblock;
 
+/* Overflow page of a long value.
+ * page_lsn stays 0 at the place of nblock's for write_block().
+ */
+typedef struct oblock{
+	addr next; // 8
+	uint8_t pad[16]; // 16
+	int64_t page_lsn; // 8
+	uint8_t data[OVF_DATA_SIZE];
+} oblock;
+
 typedef struct npage{
 	nblock *b;
 	int table_id;
@@ -81,6 +177,12 @@ typedef struct fpage{
 	addr offset;
 } fpage;
 
+typedef struct opage{
+	oblock *b;
+	int table_id;
+	addr offset;
+} opage;
+
 typedef struct bmgr{
 	int fd;
 } bmgr;
@@ -104,20 +206,74 @@ typedef struct bufmgr{
 	int tot_pincnt;
 } bufmgr;
 
+/* Extracts the attribute a secondary index orders values by
+ */
+typedef bkey_t (*key_extractor)(const char *value, uint32_t len);
+
+/* Called for each record an index scan finds. A nonzero return
+ * ends the scan.
+ */
+typedef int (*index_cb)(const record *r, void *arg);
+
+/* Bloom filter of the keys of a table.
+ * Deleted keys stay in it until it is rebuilt.
+ */
+typedef struct bloom{
+	bool on;                   // kept for this table
+	uint64_t *bits;            // NULL until it is rebuilt
+	uint64_t nbits;            // a power of two
+	uint64_t nkeys;            // keys added since it was built
+	uint64_t ndeleted;         // keys deleted since it was built
+} bloom;
+
+/* Free space map of a table, FSM_PAGES bits of it per map page.
+ * A bit is set when its page is in use.
+ */
+typedef struct fsm{
+	void *mem;
+	uint64_t *bits;            // aligned to BLOCK_SIZE
+	uint64_t cap;              // map pages the bits have room for
+	uint64_t num_page;         // pages of the file
+	uint64_t low;              // no page below it is free
+	uint64_t num_map;
+	addr map[FSM_MAX_MAPS];    // where the map pages are
+	bool dirty[FSM_MAX_MAPS];  // changed since written
+} fsm;
+
+typedef struct sindex{
+	int table_id;              // slot of the index tree
+	key_extractor extract;
+} sindex;
+
 typedef struct table{
 	struct conn *c;
 	int table_id;
 	bmgr bm;
 	bool is_used;
+	char path[256];
+	int num_index;
+	sindex index[MAX_INDEX];
+	bkey_t compact_next;       // first key of the next compaction step
+	int64_t compact_merges;    // merges since the last defragmentation
+	fsm fs;
+	uint8_t *map;              // read-only mapping of the file, or NULL
+	size_t map_len;
+	page map_pages[MAP_PIN_MAX]; // pages of the mapping pinned now
+#ifdef BLOOM_FILTER
+	bloom bf;
+#endif
 } table;
 
 typedef struct conn{
 	table tbls[MAX_TABLE];
 	bufmgr *bfm;
+	// Short-term latch over the buffer pool and the trees.
+	// It is held for one operation, never across a lock wait.
+	pthread_mutex_t latch;
 } conn;
 
 
-enum log_type {BEGIN, UPDATE, COMMIT, ABORT};
+enum log_type {BEGIN, UPDATE, COMMIT, ABORT, INSERT, DELETE};
 
 typedef struct log{
   int64_t lsn;
@@ -128,10 +284,53 @@ typedef struct log{
   int32_t page_number;
   int32_t offset;
   int32_t data_length;
+  bkey_t key;
   char old_image[VALUE_SIZE];
   char new_image[VALUE_SIZE];
 } log_t;
 
+enum lock_mode {SHARED, EXCLUSIVE};
+
+typedef struct lock_req{
+	int32_t trx_id;
+	enum lock_mode mode;
+	bool granted;
+	struct lock_head *head;
+	struct lock_req *next;     // next request on the same record
+	struct lock_req *trx_next; // next lock of the same transaction
+} lock_req;
+
+typedef struct lock_head{
+	int table_id;
+	bkey_t key;
+	lock_req *queue;           // requests in arrival order
+	pthread_cond_t cond;
+	struct lock_head *next;    // next record in the bucket
+} lock_head;
+
+typedef struct version{
+	int table_id;
+	bkey_t key;
+	int32_t trx_id;            // writer which replaced old_image
+	int64_t commit_no;         // 0 while the writer is running
+	bool absent;               // no record before the writer inserted it
+	char old_image[VALUE_SIZE];
+	struct version *next;      // next older version in the bucket
+	struct version *trx_next;  // next version of the same writer
+} version;
+
+typedef struct trx{
+	int32_t trx_id;
+	int64_t first_lsn;
+	int64_t last_lsn;
+	lock_req *locks;
+	bool read_only;            // reads a snapshot, takes no locks
+	int64_t snapshot;          // commit_no seen by the read view
+	version *versions;         // versions written, not yet committed
+	struct trx *view_next;     // next open read view
+	struct trx *next;          // next running transaction
+} trx_t;
+
 
 //Connection functions
 int open_conn(conn *c, int buf_num);
@@ -139,16 +338,20 @@ int close_conn(conn *c);
 
 //Table functions
 int open_table_low(conn *c, const char *pathname);
+int open_temp_table_low(conn *c, const char *pathname);
+int open_table_mapped_low(conn *c, const char *pathname, int hints);
 void close_table_low(table *t);
 
 //Disk functions
+int open_file_id(conn *c, int table_id, const char *file_path);
 int open_file(conn *c, const char *file_path);
+int open_file_mapped(conn *c, const char *file_path, int hints);
 void close_file(table *t);
 void extend_file(table *t, hpage *hp);
 void read_block(table *t, void *p, addr ad);
-addr alloc_block(table *t);
 void free_block(table *t, void *b);
 void write_block(table *t, void *b, addr ad);
+void write_block_raw(table *t, void *b, addr ad);
 void panic(const char *str) __attribute((noreturn));
 
 // Buffer managing functions
@@ -157,28 +360,117 @@ void push_to_lru(table *t, page *p);
 page *evict_page(table *t);
 page *alloc_page(table *t, addr ad);
 page *get_page(table *t, addr ad);
+page *new_page(table *t, addr ad);
+page *map_page(table *t, addr ad);
 void flush_page(table *t);
+void flush_dirty_pages(conn *c);
 int init_bufmgr(conn *c, int buf_num);
 void close_bufmgr(conn *c);
 
 // Log managing functions
-int open_log_file(int table_id);
-int log_flush(int table_id);
-int log_write(int table_id, log_t *log);
-int begin_transaction(int table_id);
-int commit_transaction(int table_id);
-int abort_transaction(int table_id);
-int close_log_file(int table_id);
-int close_all_log_file();
+int open_log_file(conn *c);
+int log_flush(void);
+int log_flush_to(int64_t lsn);
+int log_checkpoint(void);
+int64_t log_write(log_t *log);
+int log_read(int64_t lsn, log_t *log);
+int64_t log_update(int table_id, bkey_t key, addr page_offset, int offset,
+		const char *old_image, const char *new_image);
+int64_t log_insert(int table_id, bkey_t key, const char *value,
+		uint32_t len);
+int64_t log_delete(int table_id, bkey_t key, const char *value,
+		uint32_t len);
+trx_t *current_trx(void);
+int begin_transaction_low(bool read_only);
+int commit_transaction_low(void);
+int abort_transaction_low(void);
+int close_log_file(void);
+
+// Lock managing functions
+void init_lock_table(void);
+void close_lock_table(void);
+int lock_acquire(trx_t *trx, int table_id, bkey_t key, enum lock_mode mode);
+void lock_release_all(trx_t *trx);
+
+// Version store functions
+void init_version_store(void);
+void close_version_store(void);
+void mvcc_open_view(trx_t *trx);
+void mvcc_close_view(trx_t *trx);
+bool mvcc_has_views(void);
+void mvcc_push(int table_id, bkey_t key, const char *old_image);
+void mvcc_commit(trx_t *trx);
+void mvcc_abort(trx_t *trx);
+bool mvcc_read(trx_t *trx, int table_id, bkey_t key, char *value,
+		bool *found);
+int mvcc_changed_keys(trx_t *trx, int table_id, bkey_t lo, bkey_t hi,
+		bkey_t **keys);
+
+// Record cache functions
+void init_rcache(void);
+void close_rcache(void);
+bool rcache_get(int table_id, bkey_t key, char *v, uint32_t *len);
+void rcache_put(int table_id, bkey_t key, const char *v, uint32_t len);
+void rcache_drop(int table_id, bkey_t key);
+void rcache_drop_table(int table_id);
+
+// Aggregate functions
+int count_range_low(table *t, bkey_t lo, bkey_t hi, trx_t *view,
+		int64_t *count);
+int sum_range_low(table *t, bkey_t lo, bkey_t hi, trx_t *view,
+		int64_t *sum);
+int min_key_low(table *t, trx_t *view, bkey_t *k);
+int max_key_low(table *t, trx_t *view, bkey_t *k);
+int rank_low(table *t, bkey_t k, trx_t *view, int64_t *rank);
+int select_low(table *t, int64_t rank, trx_t *view, record *r);
+int range_keys_low(table *t, bkey_t lo, bkey_t hi, bkey_t **keys);
+
+#ifdef BLOOM_FILTER
+// Bloom filter functions
+void bloom_open(table *t);
+void bloom_close(table *t);
+void bloom_add(table *t, bkey_t k);
+void bloom_remove(table *t, bkey_t k);
+bool bloom_may_contain(table *t, bkey_t k);
+#endif
+
+// Free space map functions
+void fsm_open(table *t);
+void fsm_save(table *t);
+void fsm_close(table *t);
+void fsm_grow(table *t, hpage *hp, uint64_t num_page);
+void fsm_reset(table *t, hpage *hp, uint64_t num_page);
+addr fsm_alloc_run(table *t, int n);
+addr fsm_alloc_near(table *t, addr near);
+void fsm_free(table *t, addr ad);
+
+// Index functions
+int create_index_low(table *t, key_extractor extract);
+void index_update_low(table *t, bkey_t k, const char *old_v,
+		uint32_t old_len, const char *new_v, uint32_t new_len);
+void index_set_low(table *t, bkey_t k, const char *v, uint32_t len);
+int index_scan_low(table *t, int index_id, bkey_t lo, bkey_t hi,
+		trx_t *view, index_cb fn, void *arg);
+void close_indexes(table *t);
 
 
 //Helper functions
-npage *find_leaf(table *t, const int64_t k);
-int find_rec(table *t, npage *np, const int64_t k);
-int find_low(table *t, const int64_t k, record *r);
-int update_low(table *t, const int64_t k, record *r);
-int find_and_modify_rec(table *t, npage *np, const int64_t k, record *r);
+npage *find_leaf(table *t, const bkey_t k);
+int find_rec(table *t, npage *np, const bkey_t k);
+int find_low(table *t, const bkey_t k, record *r);
+int find_value_low(table *t, const bkey_t k, void *buf, uint32_t size,
+		uint32_t *len);
+int update_low(table *t, const bkey_t k, record *r);
+int set_value_low(table *t, const bkey_t k, const char *v, uint32_t len,
+		int64_t lsn);
+int insert_record_low(table *t, bkey_t k, const char *v, uint32_t len,
+		int64_t lsn);
+int delete_record_low(table *t, bkey_t k, int64_t lsn);
 void print_tree(table *t);
+#ifdef ORDER_STATISTIC
+uint64_t node_count(npage *np);
+void add_path_count(table *t, npage *leaf, int64_t delta);
+#endif
 int cut( int length );
 npage *get_root(table *t);
 npage *get_child(table *t, npage *np, int idx);
@@ -190,30 +482,85 @@ npage *alloc_npage(table *t, addr ad);
 hpage *alloc_hpage(table *t);
 fpage *alloc_fpage(table *t, addr ad);
 
+//Key functions
+void key_enc_init(key_enc *e);
+int key_enc_int(key_enc *e, int64_t v, int bytes);
+int key_enc_uint(key_enc *e, uint64_t v, int bytes);
+int key_enc_str(key_enc *e, const char *s, uint32_t len);
+int key_enc_done(const key_enc *e, bkey_t *k);
+int64_t key_dec_int(bkey_t k, int off, int bytes);
+uint64_t key_dec_uint(bkey_t k, int off, int bytes);
+bkey_t key_int(int64_t v);
+bkey_t key_min(void);
+bkey_t key_max(void);
+uint64_t key_hash(bkey_t k);
+void print_key(bkey_t k);
+
+//Internal node functions
+bkey_t node_key(nblock *nb, int i);
+addr node_child(nblock *nb, int idx);
+int node_find_child(nblock *nb, bkey_t k);
+#ifdef ORDER_STATISTIC
+uint64_t get_child_count(npage *np, int idx);
+void set_child_count(npage *np, int idx, uint64_t cnt);
+#endif
+bool node_fits(const child *c, int n);
+int node_capacity(const child *c, int n);
+void node_load(nblock *nb, wnode *w);
+void node_store(nblock *nb, const wnode *w);
+bool node_has_room(nblock *nb, bkey_t k);
+bool node_can_merge(nblock *left, bkey_t k_prime, nblock *right);
+bool node_set_key(nblock *nb, int i, bkey_t k);
+bkey_t shortest_separator(bkey_t lo, bkey_t hi);
+bool node_set_separator(nblock *nb, int i, bkey_t lo, bkey_t hi);
+
+//Leaf functions
+void leaf_init(nblock *nb);
+uint16_t leaf_payload_len(uint32_t vlen);
+uint32_t leaf_used(nblock *nb);
+bool leaf_fits(nblock *nb, uint16_t len);
+int leaf_lower_bound(nblock *nb, bkey_t k);
+void leaf_compact(nblock *nb);
+void leaf_put(nblock *nb, int idx, bkey_t k, const void *payload,
+		uint16_t len, uint32_t vlen);
+void leaf_remove(nblock *nb, int idx);
+void leaf_move(nblock *dst, int di, nblock *src, int si);
+addr write_overflow(table *t, const char *v, uint32_t len);
+void free_overflow(table *t, addr ad);
+uint32_t leaf_read_value(table *t, nblock *nb, int idx, void *buf,
+		uint32_t size);
+addr leaf_overflow(nblock *nb, int idx);
+
 //Insert functions
-npage *make_node(table *t);
-npage *make_leaf(table *t);
+npage *make_node(table *t, addr near);
+npage *make_leaf(table *t, addr near);
 void set_root(table *t, npage *np);
-int insert_into_leaf(table *t, npage *leaf, const record *r);
-int insert_into_new_root(table *t, npage *left, int64_t k, npage *right);
+int insert_into_leaf(table *t, npage *leaf, bkey_t k, const void *payload,
+		uint16_t len, uint32_t vlen);
+int insert_into_new_root(table *t, npage *left, bkey_t k, npage *right);
 int get_left_index(npage *parent, npage *left);
 int insert_into_node(table *t, npage *np, 
-		int left_index, int64_t k, npage *right);
+		int left_index, bkey_t k, npage *right);
 int insert_into_node_after_splitting(table *t, npage *np, int left_index, 
-		int64_t k, npage *right);
-int insert_into_parent(table *t, npage *left, int64_t k, npage *right);
-int insert_into_leaf_after_splitting(table *t, npage *np, record *r);
-int insert_low( table *t, record *r);
+		bkey_t k, npage *right);
+int insert_into_parent(table *t, npage *left, bkey_t k, npage *right);
+int insert_into_leaf_after_splitting(table *t, npage *np, bkey_t k,
+		const void *payload, uint16_t len, uint32_t vlen);
+int insert_low(table *t, bkey_t k, const char *v, uint32_t len);
+int bulk_load_low(table *t, int n, const bkey_t *keys,
+		const char **values, const uint32_t *lens);
 
 //Delete functions
-int remove_entry_from_node(table *t, npage *np, int64_t k, int idx);
+int remove_entry_from_node(table *t, npage *np, bkey_t k, int idx);
 int adjust_root(table *t, npage *root);
-int coalesce_nodes(table *t, npage *np, npage *neighbor, int neighbor_index, int k_prime);
+int coalesce_nodes(table *t, npage *np, npage *neighbor, int neighbor_index, bkey_t k_prime);
 int get_neighbor_index(table *t, npage *np, npage *parent);
 int redistribute_nodes(table *t, npage *np, npage *neighbor, int neighbor_index, 
-		int k_prime_index, int64_t k_prime); 
-int delete_entry(table *t, npage *np, int64_t k, int idx);
-int delete_low(table *t, int64_t k); 
+		int k_prime_index, bkey_t k_prime); 
+int delete_entry(table *t, npage *np, bkey_t k, int idx);
+int delete_low(table *t, bkey_t k); 
+int compact_low(table *t, int budget);
+int defrag_low(table *t);
 
 //Macro
 #define DEC_RET int ret = 0
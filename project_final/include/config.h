@@ -2,13 +2,99 @@
 
 #define DEF_DB_MODE 0664
 //#define NUM_EXTEND_PAGE 32
-#define NUM_LEAF_REC 31
-#define NUM_INT_KEY 248
+// Otherwise the file doubles, by at most MAX_EXTEND_PAGE pages
+#define MAX_EXTEND_PAGE 16384
+// A map page has a bit for each of FSM_PAGES pages, and a file has
+// at most FSM_MAX_MAPS of them, which is 32GB of 4KB pages.
+// A split puts the new node among the FSM_NEAR_PAGES pages after
+// the one it splits when one of them is free.
+#define FSM_PAGES (BLOCK_SIZE * 8)
+#define FSM_MAX_MAPS 256
+#define FSM_NEAR_PAGES 64
+// Pages of a mapped table that can be in use at once
+#define MAP_PIN_MAX 32
+
+// Leaf payload area, after the 128-byte node header
+#define LEAF_AREA (BLOCK_SIZE - 128)
+// Longer values go to overflow pages
+#define LEAF_INLINE_MAX 1024
+#define OVF_DATA_SIZE (BLOCK_SIZE - 32)
+// A node below its merge threshold is merged with a neighbor or
+// refilled from it. Splits leave nodes about half full, so a lower
+// threshold keeps deletes and inserts around one node from
+// splitting and merging it in turn. 0 merges only empty nodes.
+#define LEAF_MERGE_PCT 25
+#define NODE_MERGE_PCT 25
+#define LEAF_MIN_USED (LEAF_AREA * LEAF_MERGE_PCT / 100)
+// Compaction merges two neighboring leaves when one uses fewer bytes,
+// visiting COMPACT_BATCH leaves in a step. The background compactor
+// takes a step every COMPACT_INTERVAL_MS in which nothing else ran.
+#define LEAF_SPARSE_USED (LEAF_AREA / 2)
+#define COMPACT_BATCH 64
+#define COMPACT_INTERVAL_MS 100
+// After a full pass, the compactor defragments a table once its
+// merges since the last defragmentation reach DEFRAG_MERGES.
+#define DEFRAG_MERGES 256
+
+
+// Keep the record count of every subtree in internal nodes
+// for rank and select in O(log n). It changes the file format.
+//#define ORDER_STATISTIC
+
+// Keys are KEY_SIZE bytes compared with memcmp, made by the key
+// encoders from composite and string fields. Otherwise they are
+// int64_t. It changes the file format.
+//#define BYTE_KEY
+
+#ifdef BYTE_KEY
+#define KEY_SIZE 16
+#else
+#define KEY_SIZE 8
+#endif
+
+// Internal entries are a key and a child address, with a record count
+// under ORDER_STATISTIC. A narrow node, whose keys share all but
+// their last 4 bytes, keeps those 4 bytes and a page number.
+#ifdef ORDER_STATISTIC
+#define NUM_INT_KEY ((int)(LEAF_AREA / (KEY_SIZE + 16)))
+#define NUM_NARROW_KEY ((int)(LEAF_AREA / 16))
+#else
+#define NUM_INT_KEY ((int)(LEAF_AREA / (KEY_SIZE + 8)))
+#define NUM_NARROW_KEY ((int)(LEAF_AREA / 8))
+#endif
 #define VALUE_SIZE 120
 #define MAX_TABLE 10
 
-#define LEAF_ORDER 32
-#define INT_ORDER 249
+// Keep a bloom filter of the keys of each table, so that most lookups
+// of missing keys return without reading a page. It is saved in a
+// file next to the table.
+//#define BLOOM_FILTER
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_HASHES 7
+
+// Secondary indexes of a table, each taking a table slot of its own
+#define MAX_INDEX 4
+// Primary keys an index scan sorts and fetches at a time
+#define INDEX_BATCH 256
+// Percent of a page a bulk load fills
+#define BULK_FILL 90
+
+#define LOG_SEG_SIZE (BLOCK_SIZE * 1024)
+#define LOG_SEG_NUM 4
+//#define LOG_COMPRESSION
+
+#define LOCK_PARTITION_NUM 16
+#define LOCK_BUCKET_NUM 1024
+
+#define MVCC_BUCKET_NUM 4096
+#define MVCC_GC_INTERVAL 64
+
+// Hot-record cache, about RCACHE_NUM * (VALUE_SIZE + 32) bytes
+#define RCACHE_NUM 4096
+#define RCACHE_BUCKET_NUM 8192
+
+#define INT_ORDER (NUM_INT_KEY + 1)
+#define NODE_MIN_KEYS (NUM_INT_KEY * NODE_MERGE_PCT / 100)
 
 //#define VERBOSE_TREE
 //#define DEBUG_TREE
@@ -0,0 +1,23 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+/* Minimal LZ4 block format codec.
+ * Output is a plain LZ4 block, readable by any LZ4 decoder,
+ * and the two entry points follow the upstream names.
+ */
+
+#define LZ4_COMPRESSBOUND(isize) ((isize) + ((isize) / 255) + 16)
+
+/* Compress src_size bytes of src into dst.
+ * Returns the compressed size, or 0 when dst is too small.
+ */
+int LZ4_compress_default(const char *src, char *dst, int src_size,
+		int dst_capacity);
+
+/* Decompress a block of compressed_size bytes into dst.
+ * Returns the decompressed size, or a negative value on a corrupted block.
+ */
+int LZ4_decompress_safe(const char *src, char *dst, int compressed_size,
+		int dst_capacity);
+
+#endif /* LZ4_H */
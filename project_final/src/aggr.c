@@ -0,0 +1,395 @@
+#include "bptree.h"
+
+/* Aggregates over key ranges [lo, hi], both ends included.
+ * They are evaluated in the leaf scan loop on the pages of the
+ * buffer pool, so no record is copied out.
+ * With ORDER_STATISTIC, counts, ranks and selects descend by the
+ * subtree counts of internal nodes instead of scanning leaves.
+ * A read view takes the result of the table, and corrects it by the
+ * keys having versions the view does not see.
+ */
+
+/* Decimal integer at the start of a value of len bytes,
+ * 0 if there is none
+ */
+static int64_t value_to_int(const char *v, uint32_t len){
+	int64_t n = 0;
+	uint32_t i = 0;
+	int neg = 0;
+	if (len > 0 && (v[0] == '-' || v[0] == '+')){
+		neg = v[0] == '-';
+		i++;
+	}
+	for (; i < len && v[i] >= '0' && v[i] <= '9'; i++)
+		n = n * 10 + (v[i] - '0');
+	return neg ? -n : n;
+}
+
+/* Next leaf on the right, releasing this one
+ */
+static npage *next_leaf(table *t, npage *np){
+	addr sib = B(np)->l_sib;
+	release_page(t, np);
+	if (sib == ADDR_NOT_EXIST)
+		return NULL;
+	return get_npage(t, sib);
+}
+
+/* Whether the table has a record of k
+ */
+static bool has_record(table *t, bkey_t k){
+	npage *np = find_leaf(t, k);
+	bool ret;
+	if (np == NULL)
+		return false;
+	ret = find_rec(t, np, k) != -1;
+	release_page(t, np);
+	return ret;
+}
+
+/* Whether the view sees a record of k, with its value in v.
+ * in tells whether the table has one.
+ */
+static bool view_record(table *t, trx_t *view, bkey_t k, bool in, char *v){
+	npage *np;
+	bool found = in;
+
+	memset(v, 0, VALUE_SIZE);
+	if (in){
+		np = find_leaf(t, k);
+		leaf_read_value(t, B(np), find_rec(t, np, k), v, VALUE_SIZE);
+		release_page(t, np);
+	}
+	mvcc_read(view, t->table_id, k, v, &found);
+	return found;
+}
+
+/* Records the view sees in [lo, hi] less those the table has
+ */
+static int64_t view_delta(table *t, trx_t *view, bkey_t lo, bkey_t hi){
+	char v[VALUE_SIZE];
+	bkey_t *ks;
+	int64_t delta = 0;
+	bool in;
+	int i, n;
+
+	n = mvcc_changed_keys(view, t->table_id, lo, hi, &ks);
+	for (i = 0; i < n; i++){
+		in = has_record(t, ks[i]);
+		delta += view_record(t, view, ks[i], in, v) - in;
+	}
+	free(ks);
+	return delta;
+}
+
+#ifdef ORDER_STATISTIC
+/* Records whose key is smaller than k, or not greater with eq,
+ * summing the subtree counts left of the path to the leaf of k
+ */
+static int64_t count_less(table *t, bkey_t k, bool eq){
+	npage *np = get_root(t), *next_np;
+	nblock *nb;
+	int64_t cnt = 0;
+	int i, j;
+
+	if (np == NULL)
+		return 0;
+	for (nb = B(np); !nb->is_leaf; nb = B(np)){
+		i = node_find_child(nb, k);
+		for (j = 0; j < i; j++)
+			cnt += get_child_count(np, j);
+		next_np = get_child(t, np, i);
+		release_page(t, np);
+		np = next_np;
+	}
+	i = leaf_lower_bound(nb, k);
+	if (eq && i < nb->num_keys && KEY_EQ(nb->l_slots[i].k, k))
+		i++;
+	cnt += i;
+	release_page(t, np);
+	return cnt;
+}
+
+/* Count the records in [lo, hi] from the subtree counts
+ * on the paths to lo and hi.
+ */
+static int64_t count_tree(table *t, bkey_t lo, bkey_t hi){
+	if (KEY_LT(hi, lo))
+		return 0;
+	return count_less(t, hi, true) - count_less(t, lo, false);
+}
+#else
+/* Count the records in [lo, hi].
+ * Leaves entirely inside the range add num_keys without a look at
+ * their records.
+ */
+static int64_t count_tree(table *t, bkey_t lo, bkey_t hi){
+	npage *np;
+	nblock *nb;
+	int64_t count = 0;
+	int i, end;
+
+	if (KEY_LT(hi, lo) || (np = find_leaf(t, lo)) == NULL)
+		return 0;
+
+	for (i = leaf_lower_bound(B(np), lo); np != NULL; i = 0){
+		nb = B(np);
+		if (nb->num_keys > 0 && !KEY_LT(hi, nb->l_slots[nb->num_keys - 1].k)){
+			count += nb->num_keys - i;
+			np = next_leaf(t, np);
+			continue;
+		}
+		end = leaf_lower_bound(nb, hi);
+		if (end < nb->num_keys && KEY_EQ(nb->l_slots[end].k, hi))
+			end++;
+		if (end > i)
+			count += end - i;
+		release_page(t, np);
+		break;
+	}
+	return count;
+}
+
+/* Records whose key is smaller than k, or not greater with eq
+ */
+static int64_t count_less(table *t, bkey_t k, bool eq){
+	int64_t cnt = count_tree(t, key_min(), k);
+	if (!eq && has_record(t, k))
+		cnt--;
+	return cnt;
+}
+#endif
+
+/* Count the records in [lo, hi]
+ */
+int count_range_low(table *t, bkey_t lo, bkey_t hi, trx_t *view,
+		int64_t *count){
+	*count = count_tree(t, lo, hi);
+	if (view != NULL && !KEY_LT(hi, lo))
+		*count += view_delta(t, view, lo, hi);
+	return E_OK;
+}
+
+/* Sum of the integers the values in [lo, hi] start with.
+ * A read view sees the values of its snapshot, and the records its
+ * snapshot has which the table no longer has.
+ */
+int sum_range_low(table *t, bkey_t lo, bkey_t hi, trx_t *view,
+		int64_t *sum){
+	npage *np;
+	nblock *nb;
+	char v[VALUE_SIZE];
+	bkey_t *ks;
+	bool found;
+	int i, n;
+
+	*sum = 0;
+	if (KEY_LT(hi, lo))
+		return E_OK;
+	if (view != NULL){
+		n = mvcc_changed_keys(view, t->table_id, lo, hi, &ks);
+		for (i = 0; i < n; i++){
+			if (!has_record(t, ks[i]) && view_record(t, view, ks[i], false, v))
+				*sum += value_to_int(v, VALUE_SIZE);
+		}
+		free(ks);
+	}
+	if ((np = find_leaf(t, lo)) == NULL)
+		return E_OK;
+
+	for (i = leaf_lower_bound(B(np), lo); np != NULL; i = 0){
+		nb = B(np);
+		for (; i < nb->num_keys && !KEY_LT(hi, nb->l_slots[i].k); i++){
+			if (view == NULL && nb->l_slots[i].vlen <= LEAF_INLINE_MAX){
+				*sum += value_to_int((char*)nb->l_data + nb->l_slots[i].off,
+						nb->l_slots[i].len);
+				continue;
+			}
+			memset(v, 0, VALUE_SIZE);
+			leaf_read_value(t, nb, i, v, VALUE_SIZE);
+			found = true;
+			if (view != NULL)
+				mvcc_read(view, t->table_id, nb->l_slots[i].k, v, &found);
+			if (found)
+				*sum += value_to_int(v, VALUE_SIZE);
+		}
+		if (i < nb->num_keys){
+			release_page(t, np);
+			break;
+		}
+		np = next_leaf(t, np);
+	}
+	return E_OK;
+}
+
+/* Smallest key: the first record of the leftmost non-empty leaf.
+ * A read view takes the record of rank 0 in its snapshot.
+ */
+int min_key_low(table *t, trx_t *view, bkey_t *k){
+	npage *np;
+	record r;
+
+	if (view != NULL){
+		if (select_low(t, 0, view, &r) != E_OK)
+			return E_NOT_FOUND;
+		*k = r.k;
+		return E_OK;
+	}
+	np = find_leaf(t, key_min());
+	while (np != NULL && B(np)->num_keys == 0)
+		np = next_leaf(t, np);
+	if (np == NULL)
+		return E_NOT_FOUND;
+	*k = B(np)->l_slots[0].k;
+	release_page(t, np);
+	return E_OK;
+}
+
+/* Largest key: the last record of the rightmost leaf.
+ * Only the root can be an empty leaf. A read view takes the last
+ * record of its snapshot by its count.
+ */
+int max_key_low(table *t, trx_t *view, bkey_t *k){
+	npage *np;
+	record r;
+	int64_t n;
+
+	if (view != NULL){
+		count_range_low(t, key_min(), key_max(), view, &n);
+		if (select_low(t, n - 1, view, &r) != E_OK)
+			return E_NOT_FOUND;
+		*k = r.k;
+		return E_OK;
+	}
+	np = find_leaf(t, key_max());
+	if (np == NULL)
+		return E_NOT_FOUND;
+	if (B(np)->num_keys == 0){
+		release_page(t, np);
+		return E_NOT_FOUND;
+	}
+	*k = B(np)->l_slots[B(np)->num_keys - 1].k;
+	release_page(t, np);
+	return E_OK;
+}
+
+/* Number of records whose key is smaller than k.
+ * Returns E_NOT_FOUND when k itself is not in the table.
+ */
+int rank_low(table *t, bkey_t k, trx_t *view, int64_t *rank){
+	char v[VALUE_SIZE];
+	bool in = has_record(t, k), found = in;
+
+	*rank = count_less(t, k, false);
+	if (view != NULL){
+		// The delta counts k too, which is not below itself
+		*rank += view_delta(t, view, key_min(), k);
+		found = view_record(t, view, k, in, v);
+		*rank -= found - in;
+	}
+	return found ? E_OK : E_NOT_FOUND;
+}
+
+/* The record of a rank in the table, counting from 0 in key order
+ */
+static int select_tree(table *t, int64_t rank, record *r){
+	npage *np;
+	nblock *nb;
+#ifdef ORDER_STATISTIC
+	npage *next_np;
+	int i;
+
+	if (rank < 0 || (np = get_root(t)) == NULL)
+		return E_NOT_FOUND;
+	if ((uint64_t)rank >= node_count(np)){
+		release_page(t, np);
+		return E_NOT_FOUND;
+	}
+	for (nb = B(np); !nb->is_leaf; nb = B(np)){
+		for (i = 0; i < nb->num_keys &&
+				(uint64_t)rank >= get_child_count(np, i); i++)
+			rank -= get_child_count(np, i);
+		next_np = get_child(t, np, i);
+		release_page(t, np);
+		np = next_np;
+	}
+#else
+	/* Without subtree counts, skip whole leaves by num_keys */
+	if (rank < 0 || (np = find_leaf(t, key_min())) == NULL)
+		return E_NOT_FOUND;
+	while (rank >= B(np)->num_keys){
+		rank -= B(np)->num_keys;
+		if ((np = next_leaf(t, np)) == NULL)
+			return E_NOT_FOUND;
+	}
+	nb = B(np);
+#endif
+	memset(r, 0, sizeof(record));
+	r->k = nb->l_slots[rank].k;
+	leaf_read_value(t, nb, rank, r->v, VALUE_SIZE);
+	release_page(t, np);
+	return E_OK;
+}
+
+/* The record of a rank, counting from 0 in key order.
+ * For a read view, the keys having versions it does not see split the
+ * table into runs of records it sees as they are. The rank is looked
+ * for among those keys, and otherwise in the run it falls in, where
+ * it is off the rank in the table by the keys before the run.
+ */
+int select_low(table *t, int64_t rank, trx_t *view, record *r){
+	bkey_t *ks;
+	int64_t delta = 0, before;
+	bool in, found;
+	int i, n;
+
+	if (view == NULL)
+		return select_tree(t, rank, r);
+	n = mvcc_changed_keys(view, t->table_id, key_min(), key_max(), &ks);
+	for (i = 0; i < n; i++){
+		before = count_less(t, ks[i], false) + delta;
+		if (rank < before)
+			break;
+		in = has_record(t, ks[i]);
+		found = view_record(t, view, ks[i], in, r->v);
+		if (found && rank == before){
+			r->k = ks[i];
+			free(ks);
+			return E_OK;
+		}
+		delta += found - in;
+	}
+	free(ks);
+	return select_tree(t, rank - delta, r);
+}
+
+/* Keys in [lo, hi] and the first key after hi, if there is one,
+ * in a new array. Returns their number.
+ */
+int range_keys_low(table *t, bkey_t lo, bkey_t hi, bkey_t **keys){
+	npage *np;
+	nblock *nb;
+	int i, n = 0, cap = 64;
+
+	*keys = malloc(cap * sizeof(bkey_t));
+	if ((np = find_leaf(t, lo)) == NULL)
+		return 0;
+	for (i = leaf_lower_bound(B(np), lo); np != NULL; i = 0){
+		nb = B(np);
+		for (; i < nb->num_keys; i++){
+			if (n == cap){
+				cap *= 2;
+				*keys = realloc(*keys, cap * sizeof(bkey_t));
+			}
+			(*keys)[n++] = nb->l_slots[i].k;
+			if (KEY_LT(hi, nb->l_slots[i].k))
+				break;
+		}
+		if (i < nb->num_keys){
+			release_page(t, np);
+			break;
+		}
+		np = next_leaf(t, np);
+	}
+	return n;
+}
@@ -0,0 +1,176 @@
+#include "bptree.h"
+
+#ifdef BLOOM_FILTER
+/* Bloom filters of the keys of tables.
+ * A key that is not in the filter of a table is not in the table, so
+ * a lookup of it returns before the buffer pool. Keys are added on
+ * insert; deleted keys stay until the filter is rebuilt, which happens
+ * at the next lookup after the filter is dropped, when half of its
+ * keys are deleted or it holds more than it was sized for.
+ * The filter is saved in <table>.bloom on close. The file is marked
+ * unclean while the table is open, so after a crash it is rebuilt.
+ */
+
+#define BLOOM_MAGIC 0x424c4f4f4d303031ULL
+
+typedef struct bloom_hdr{
+	uint64_t magic;
+	uint64_t nbits;
+	uint64_t nkeys;
+	uint64_t ndeleted;
+	uint64_t clean;
+} bloom_hdr;
+
+static void bloom_path(table *t, char *path, size_t size){
+	snprintf(path, size, "%s.bloom", t->path);
+}
+
+static void bloom_drop(bloom *bf){
+	free(bf->bits);
+	bf->bits = NULL;
+}
+
+static void bloom_set(bloom *bf, bkey_t k){
+	uint64_t h = key_hash(k), h1 = h, h2 = (h >> 32) | 1, b;
+	int i;
+
+	for (i = 0; i < BLOOM_HASHES; i++, h1 += h2){
+		b = h1 & (bf->nbits - 1);
+		bf->bits[b / 64] |= 1ULL << (b % 64);
+	}
+}
+
+/* Rebuild the filter from the keys in the leaves, sized for twice
+ * as many keys
+ */
+static void bloom_build(table *t){
+	bloom *bf = &t->bf;
+	npage *np;
+	addr sib;
+	uint64_t n = 0;
+	int i, pass;
+
+	for (pass = 0; pass < 2; pass++){
+		if (pass == 1){
+			for (bf->nbits = BLOCK_SIZE * 8;
+					bf->nbits < n * 2 * BLOOM_BITS_PER_KEY; bf->nbits *= 2)
+				;
+			bf->bits = calloc(bf->nbits / 64, sizeof(uint64_t));
+			bf->nkeys = n;
+			bf->ndeleted = 0;
+		}
+		for (np = find_leaf(t, key_min()); np != NULL; ){
+			if (pass == 0)
+				n += B(np)->num_keys;
+			else
+				for (i = 0; i < B(np)->num_keys; i++)
+					bloom_set(bf, B(np)->l_slots[i].k);
+			sib = B(np)->l_sib;
+			release_page(t, np);
+			np = sib == ADDR_NOT_EXIST ? NULL : get_npage(t, sib);
+		}
+	}
+}
+
+/* Write the header of the filter file, with the bits when clean
+ */
+static void bloom_save(table *t, bool clean){
+	bloom *bf = &t->bf;
+	bloom_hdr h;
+	char path[sizeof(t->path) + 8];
+	int fd;
+
+	bloom_path(t, path, sizeof(path));
+	if ((fd = open(path, O_WRONLY | O_CREAT, DEF_DB_MODE)) == -1)
+		return;
+	memset(&h, 0, sizeof(h));
+	h.magic = BLOOM_MAGIC;
+	if (clean && bf->bits != NULL){
+		h.nbits = bf->nbits;
+		h.nkeys = bf->nkeys;
+		h.ndeleted = bf->ndeleted;
+		h.clean = true;
+		if (pwrite(fd, bf->bits, bf->nbits / 8, sizeof(h)) != (ssize_t)(bf->nbits / 8))
+			h.clean = false;
+	}
+	if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h))
+		panic("bloom_save");
+	fsync(fd);
+	close(fd);
+}
+
+/* Load the saved filter of a table, if it was closed cleanly
+ */
+void bloom_open(table *t){
+	bloom *bf = &t->bf;
+	bloom_hdr h;
+	char path[sizeof(t->path) + 8];
+	int fd;
+
+	memset(bf, 0, sizeof(bloom));
+	bf->on = true;
+	bloom_path(t, path, sizeof(path));
+	if ((fd = open(path, O_RDONLY)) != -1){
+		if (pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+				h.magic == BLOOM_MAGIC && h.clean){
+			bf->bits = malloc(h.nbits / 8);
+			if (pread(fd, bf->bits, h.nbits / 8, sizeof(h)) ==
+					(ssize_t)(h.nbits / 8)){
+				bf->nbits = h.nbits;
+				bf->nkeys = h.nkeys;
+				bf->ndeleted = h.ndeleted;
+			}
+			else
+				bloom_drop(bf);
+		}
+		close(fd);
+	}
+	bloom_save(t, false);
+}
+
+/* Save the filter of a table and free it
+ */
+void bloom_close(table *t){
+	if (!t->bf.on)
+		return;
+	bloom_save(t, true);
+	bloom_drop(&t->bf);
+	t->bf.on = false;
+}
+
+void bloom_add(table *t, bkey_t k){
+	bloom *bf = &t->bf;
+
+	if (bf->bits == NULL)
+		return;
+	bloom_set(bf, k);
+	if (++bf->nkeys > bf->nbits / BLOOM_BITS_PER_KEY)
+		bloom_drop(bf);
+}
+
+void bloom_remove(table *t, bkey_t k){
+	bloom *bf = &t->bf;
+
+	if (bf->bits != NULL && ++bf->ndeleted * 2 > bf->nkeys)
+		bloom_drop(bf);
+}
+
+/* Whether k may be in the table. false is certain.
+ */
+bool bloom_may_contain(table *t, bkey_t k){
+	bloom *bf = &t->bf;
+	uint64_t h = key_hash(k), h1 = h, h2 = (h >> 32) | 1, b;
+	int i;
+
+	if (!bf->on)
+		return true;
+	if (bf->bits == NULL)
+		bloom_build(t);
+	for (i = 0; i < BLOOM_HASHES; i++, h1 += h2){
+		b = h1 & (bf->nbits - 1);
+		if (!(bf->bits[b / 64] & 1ULL << (b % 64)))
+			return false;
+	}
+	return true;
+}
+#endif
@@ -1,85 +1,569 @@
 #include "bptree.h"
 
 static conn c;
+static uint64_t num_calls;     // calls which took the latch
+static pthread_t compactor;
+static bool compacting;
+
+#define LATCH() do{\
+	pthread_mutex_lock(&c.latch);\
+	num_calls++;\
+}while(0)
+#define UNLATCH() pthread_mutex_unlock(&c.latch)
+// A table opened on a mapping is read-only
+#define MAPPED(table_id) (c.tbls[table_id].map != NULL)
+// Lock standing for the end of a table, after its last key
+#define END_LOCK(table_id) (MAX_TABLE + (table_id))
+
+void stop_compaction(void);
 
 int init_db(uint64_t num_buf){
 	DEC_RET;
 	RET(open_conn(&c, num_buf));
+	open_log_file(&c);
+	init_lock_table();
+	init_version_store();
+	init_rcache();
 	return ret;
 }
 
 int shutdown_db(){
+	stop_compaction();
 	close_conn(&c);
-  close_all_log_file();
+	close_log_file();
+	close_lock_table();
+	close_version_store();
+	close_rcache();
 	return 0;
 }
 
 int open_table(char *pathname){
-	int table_id = open_table_low(&c, pathname);
-  open_log_file(table_id);
+	int table_id;
+	LATCH();
+	table_id = open_table_low(&c, pathname);
 
 #ifdef VERBOSE_TREE
 	if (table_id >= 0)
 		print_tree(&c.tbls[table_id]);
 #endif
+	UNLATCH();
+	return table_id;
+}
+
+/* Open a table read-only on a mapping of its file, for analytics.
+ * Lookups, aggregates and index builds read its pages in the mapping
+ * instead of the buffer pool, and processes mapping the same file
+ * share the page cache. hints are MMAP_ flags. Writes to the table
+ * fail with E_READ_ONLY, and nothing else may write the file while
+ * it is open this way.
+ */
+int open_table_mapped(char *pathname, int hints){
+	int table_id;
+	LATCH();
+	table_id = open_table_mapped_low(&c, pathname, hints);
+	UNLATCH();
 	return table_id;
 }
 
 int close_table(int table_id){
+	LATCH();
 	close_table_low(&c.tbls[table_id]);
-  close_log_file(table_id);
+	UNLATCH();
 	return 0;
 }
 
-int insert(int table_id, int64_t key, char *value){
-	DEC_RET;
+int begin_transaction(void){
+	int ret;
+	LATCH();
+	ret = begin_transaction_low(false);
+	UNLATCH();
+	return ret;
+}
+
+/* Start a transaction which reads a snapshot of the commits made
+ * before it, without record locks. It cannot write.
+ */
+int begin_read_only_transaction(void){
+	int ret;
+	LATCH();
+	ret = begin_transaction_low(true);
+	UNLATCH();
+	return ret;
+}
+
+int commit_transaction(void){
+	int ret;
+	LATCH();
+	ret = commit_transaction_low();
+	UNLATCH();
+	return ret;
+}
+
+int abort_transaction(void){
+	int ret;
+	LATCH();
+	ret = abort_transaction_low();
+	UNLATCH();
+	return ret;
+}
+
+/* Lock a record for the transaction of this thread.
+ * Work outside a transaction takes no record lock, and a read-only
+ * transaction reads its snapshot instead.
+ * When wait-die kills the transaction, it is rolled back here.
+ */
+static int lock_record(int table_id, bkey_t key, enum lock_mode mode){
+	trx_t *trx = current_trx();
+	if (trx == NULL)
+		return E_OK;
+	if (trx->read_only)
+		return mode == SHARED ? E_OK : E_READ_ONLY;
+	if (lock_acquire(trx, table_id, key, mode) == E_OK)
+		return E_OK;
+	abort_transaction();
+	return E_DEADLOCK;
+}
+
+/* Next-key locking, which keeps the transactions serializable.
+ * A read-write transaction reading a range locks its keys shared,
+ * and the key after them, or the end of the table. An insert or a
+ * delete locks the key after its own exclusive, so it waits for the
+ * readers of a range it would change. The keys are found under the
+ * latch and locked without it, so they are found again until they
+ * are the ones locked.
+ */
+static int lock_range(int table_id, bkey_t lo, bkey_t hi,
+		enum lock_mode mode){
+	trx_t *trx = current_trx();
+	bkey_t *ks = NULL, *found;
+	int i, n = -1, m, ret = E_OK;
+
+	if (trx == NULL || trx->read_only)
+		return E_OK;
+	for (;;){
+		LATCH();
+		m = range_keys_low(&c.tbls[table_id], lo, hi, &found);
+		UNLATCH();
+		if (m == n && memcmp(ks, found, n * sizeof(bkey_t)) == 0)
+			break;
+		free(ks);
+		ks = found;
+		n = m;
+		for (i = 0; i < n && ret == E_OK; i++)
+			ret = lock_record(table_id, ks[i], mode);
+		if (ret == E_OK && (n == 0 || !KEY_LT(hi, ks[n - 1])))
+			ret = lock_record(END_LOCK(table_id), key_min(), mode);
+		if (ret != E_OK)
+			break;
+	}
+	if (found != ks)
+		free(found);
+	free(ks);
+	return ret;
+}
+
+/* Lock the key after key exclusive, or the end of the table
+ */
+static int lock_next(int table_id, bkey_t key){
+	trx_t *trx = current_trx();
+	bkey_t *ks = NULL, *found, next;
+	bool end = false;
+	int n, ret = E_OK;
+
+	if (trx == NULL || trx->read_only)
+		return E_OK;
+	for (;;){
+		LATCH();
+		n = range_keys_low(&c.tbls[table_id], key, key, &found);
+		UNLATCH();
+		if (ks != NULL && (n == 0 || !KEY_LT(key, found[n - 1])) == end &&
+				(end || KEY_EQ(found[n - 1], next)))
+			break;
+		free(ks);
+		ks = found;
+		end = n == 0 || !KEY_LT(key, ks[n - 1]);
+		if (end)
+			ret = lock_record(END_LOCK(table_id), key_min(), EXCLUSIVE);
+		else{
+			next = ks[n - 1];
+			ret = lock_record(table_id, next, EXCLUSIVE);
+		}
+		if (ret != E_OK)
+			break;
+	}
+	if (found != ks)
+		free(found);
+	free(ks);
+	return ret;
+}
+
+/* Insert a value of len bytes. Values longer than LEAF_INLINE_MAX
+ * are kept in overflow pages. update() cannot change such a value.
+ * A transaction logs the value for an abort in a VALUE_SIZE image,
+ * so it cannot insert a longer one.
+ */
+int insert_value(int table_id, bkey_t key, const void *value, uint32_t len){
 	record r;
-	r.k = key;
-	memcpy(r.v, value, VALUE_SIZE);
-	RET(insert_low(&c.tbls[table_id], &r));
+	int64_t lsn;
+	DEC_RET;
+	if (MAPPED(table_id))
+		return E_READ_ONLY;
+	RET(lock_record(table_id, key, EXCLUSIVE));
+	if (len > VALUE_SIZE && current_trx() != NULL)
+		return E_TOO_LONG;
+	RET(lock_next(table_id, key));
+	LATCH();
+	// The insert is logged before the leaf changes
+	if (find_low(&c.tbls[table_id], key, &r) == E_OK)
+		ret = E_DUP;
+	else{
+		lsn = log_insert(table_id, key, value, len);
+		ret = insert_record_low(&c.tbls[table_id], key, value, len, lsn);
+		if (ret == E_OK)
+			mvcc_push(table_id, key, NULL);
+	}
 #ifdef DEBUG_TREE
 	printf("%d\n", c.bfm->tot_pincnt);
 #endif
 #ifdef VERBOSE_TREE
 	print_tree(&c.tbls[table_id]);
 #endif
+	UNLATCH();
 	return ret;
 }
 
-char *find(int table_id, int64_t key){
+/* Insert a string value of up to VALUE_SIZE bytes.
+ * Only its bytes before the terminating zero are stored.
+ */
+int insert(int table_id, bkey_t key, char *value){
+	return insert_value(table_id, key, value, strnlen(value, VALUE_SIZE));
+}
+
+/* Find a value, cut to VALUE_SIZE bytes, in a new buffer.
+ * Returns NULL when the key is not found, or with errno set to
+ * EDEADLK when wait-die rolled the transaction back.
+ */
+char *find(int table_id, bkey_t key){
+	trx_t *trx = current_trx();
 	record r;
-	char *ret = (char *)malloc(sizeof(char)*VALUE_SIZE);
-	if (find_low(&c.tbls[table_id], key, &r) != 0){
+	char *ret;
+	bool found;
+	if (lock_record(table_id, key, SHARED) != E_OK){
+		errno = EDEADLK;
+		return NULL;
+	}
+	LATCH();
+	found = find_low(&c.tbls[table_id], key, &r) == E_OK;
+	if (trx != NULL && trx->read_only)
+		mvcc_read(trx, table_id, key, r.v, &found);
+	if (!found){
+		UNLATCH();
 		return NULL;
 	}
 #ifdef DEBUG_TREE
 	printf("%d\n", c.bfm->tot_pincnt);
 #endif
-	memcpy(ret, r.v, VALUE_SIZE); 
+	UNLATCH();
+	ret = (char *)malloc(sizeof(char)*VALUE_SIZE);
+	memcpy(ret, r.v, VALUE_SIZE);
 	return ret;
 }
 
-int update(int table_id, int64_t key, char* value){
+/* Find a value of any length. Up to size bytes are copied to buf,
+ * and len gets the length of the whole value. Old versions only hold
+ * values of up to VALUE_SIZE bytes.
+ */
+int find_value(int table_id, bkey_t key, void *buf, uint32_t size,
+		uint32_t *len){
+	char v[VALUE_SIZE];
+	trx_t *trx = current_trx();
+	bool found;
+	int ret;
+	if (lock_record(table_id, key, SHARED) != E_OK)
+		return E_DEADLOCK;
+	LATCH();
+	ret = find_value_low(&c.tbls[table_id], key, buf, size, len);
+	found = ret == E_OK;
+	if (trx != NULL && trx->read_only &&
+			mvcc_read(trx, table_id, key, v, &found)){
+		ret = found ? E_OK : E_NOT_FOUND;
+		if (found){
+			*len = strnlen(v, VALUE_SIZE);
+			memcpy(buf, v, *len < size ? *len : size);
+		}
+	}
+	UNLATCH();
+	return ret;
+}
+
+/* Returns 0, E_DEADLOCK when wait-die rolled the transaction back,
+ * or -1 on any other failure.
+ */
+int update(int table_id, bkey_t key, char* value){
 	record r;
-  strcpy(r.v, value);
-	if (update_low(&c.tbls[table_id], key, &r) != 0){
+	int ret;
+	memset(&r, 0, sizeof(record));
+	strncpy(r.v, value, VALUE_SIZE);
+	if (MAPPED(table_id))
 		return -1;
-	}
+	if ((ret = lock_record(table_id, key, EXCLUSIVE)) != E_OK)
+		return ret == E_DEADLOCK ? E_DEADLOCK : -1;
+	LATCH();
+	ret = update_low(&c.tbls[table_id], key, &r);
 #ifdef DEBUG_TREE
 	printf("%d\n", c.bfm->tot_pincnt);
 #endif
-	return 0;
+	UNLATCH();
+	return ret != 0 ? -1 : 0;
 }
 
 
-int delete(int table_id, int64_t key){
+/* Delete a record. A transaction logs its value for an abort in a
+ * VALUE_SIZE image, and read views keep it in a version of that size,
+ * so a longer one cannot be deleted by a transaction, or while a read
+ * view is open.
+ */
+int delete(int table_id, bkey_t key){
+	char v[VALUE_SIZE];
+	uint32_t len;
+	int64_t lsn;
 	DEC_RET;
-	RET(delete_low(&c.tbls[table_id], key));
+	if (MAPPED(table_id))
+		return E_READ_ONLY;
+	RET(lock_record(table_id, key, EXCLUSIVE));
+	RET(lock_next(table_id, key));
+	LATCH();
+	memset(v, 0, VALUE_SIZE);
+	ret = find_value_low(&c.tbls[table_id], key, v, VALUE_SIZE, &len);
+	if (ret == E_OK && len > VALUE_SIZE &&
+			(current_trx() != NULL || mvcc_has_views()))
+		ret = E_TOO_LONG;
+	if (ret == E_OK){
+		lsn = log_delete(table_id, key, v, len);
+		ret = delete_record_low(&c.tbls[table_id], key, lsn);
+		mvcc_push(table_id, key, v);
+	}
 #ifdef DEBUG_TREE
 	printf("%d\n", c.bfm->tot_pincnt);
 #endif
 #ifdef VERBOSE_TREE
 	print_tree(&c.tbls[table_id]);
 #endif
+	UNLATCH();
 	return ret;
 }
+
+/* Aggregates over the keys in [begin_key, end_key].
+ * A read-write transaction locks the range first, and a read-only
+ * transaction counts and sums the records of its snapshot.
+ */
+int count_range(int table_id, bkey_t begin_key, bkey_t end_key,
+		int64_t *count){
+	trx_t *trx = current_trx();
+	int ret;
+	RET(lock_range(table_id, begin_key, end_key, SHARED));
+	LATCH();
+	ret = count_range_low(&c.tbls[table_id], begin_key, end_key,
+			trx != NULL && trx->read_only ? trx : NULL, count);
+	UNLATCH();
+	return ret;
+}
+
+/* Sum of the integers the values start with, like atoll()
+ */
+int sum_range(int table_id, bkey_t begin_key, bkey_t end_key,
+		int64_t *sum){
+	trx_t *trx = current_trx();
+	int ret;
+	RET(lock_range(table_id, begin_key, end_key, SHARED));
+	LATCH();
+	ret = sum_range_low(&c.tbls[table_id], begin_key, end_key,
+			trx != NULL && trx->read_only ? trx : NULL, sum);
+	UNLATCH();
+	return ret;
+}
+
+int min_key(int table_id, bkey_t *key){
+	trx_t *trx = current_trx();
+	int ret;
+	RET(lock_range(table_id, key_min(), key_min(), SHARED));
+	LATCH();
+	ret = min_key_low(&c.tbls[table_id],
+			trx != NULL && trx->read_only ? trx : NULL, key);
+	UNLATCH();
+	return ret;
+}
+
+int max_key(int table_id, bkey_t *key){
+	trx_t *trx = current_trx();
+	int ret;
+	RET(lock_range(table_id, key_max(), key_max(), SHARED));
+	LATCH();
+	ret = max_key_low(&c.tbls[table_id],
+			trx != NULL && trx->read_only ? trx : NULL, key);
+	UNLATCH();
+	return ret;
+}
+
+/* Position of a key in key order, counting from 0.
+ * The rank is set even when the key is not found.
+ */
+int rank_key(int table_id, bkey_t key, int64_t *rank){
+	trx_t *trx = current_trx();
+	int ret;
+	RET(lock_range(table_id, key_min(), key, SHARED));
+	LATCH();
+	ret = rank_low(&c.tbls[table_id], key,
+			trx != NULL && trx->read_only ? trx : NULL, rank);
+	UNLATCH();
+	return ret;
+}
+
+/* Record at a rank, like OFFSET rank LIMIT 1.
+ * value takes VALUE_SIZE bytes. A read-write transaction locks the
+ * keys up to the one found, and looks again until it stays the same.
+ */
+int select_rank(int table_id, int64_t rank, bkey_t *key, char *value){
+	trx_t *trx = current_trx();
+	bkey_t k, locked;
+	bool have = false;
+	record r;
+	int ret;
+	for (;;){
+		LATCH();
+		ret = select_low(&c.tbls[table_id], rank,
+				trx != NULL && trx->read_only ? trx : NULL, &r);
+		UNLATCH();
+		k = ret == E_OK ? r.k : key_max();
+		if (trx == NULL || trx->read_only || (have && KEY_EQ(k, locked)))
+			break;
+		if (lock_range(table_id, key_min(), k, SHARED) != E_OK)
+			return E_DEADLOCK;
+		locked = k;
+		have = true;
+	}
+	if (ret != E_OK)
+		return ret;
+	*key = r.k;
+	memcpy(value, r.v, VALUE_SIZE);
+	return E_OK;
+}
+
+/* Build a secondary index of the attribute extract() takes from the
+ * values of a table, kept up to date by the writes that follow.
+ * Returns the index id, or E_FULL_TABLE.
+ */
+int create_index(int table_id, key_extractor extract){
+	int ret;
+	LATCH();
+	ret = create_index_low(&c.tbls[table_id], extract);
+	UNLATCH();
+	return ret;
+}
+
+/* Pass the records whose attribute is in [begin_attr, end_attr] to fn,
+ * in batches sorted by key. fn runs under the latch, so it cannot call
+ * the API. The attribute says nothing of the keys a write could add,
+ * so a read-write transaction locks the whole table shared.
+ */
+int index_range(int table_id, int index_id, bkey_t begin_attr,
+		bkey_t end_attr, index_cb fn, void *arg){
+	trx_t *trx = current_trx();
+	int ret;
+	RET(lock_range(table_id, key_min(), key_max(), SHARED));
+	LATCH();
+	ret = index_scan_low(&c.tbls[table_id], index_id, begin_attr, end_attr,
+			trx != NULL && trx->read_only ? trx : NULL, fn, arg);
+	UNLATCH();
+	return ret;
+}
+
+int index_find(int table_id, int index_id, bkey_t attr, index_cb fn,
+		void *arg){
+	return index_range(table_id, index_id, attr, attr, fn, arg);
+}
+
+/* Take a compaction step of budget leaves on a table.
+ * Returns the number of leaves merged.
+ */
+int compact_table(int table_id, int budget){
+	int ret;
+	if (MAPPED(table_id))
+		return 0;
+	LATCH();
+	ret = compact_low(&c.tbls[table_id], budget);
+	UNLATCH();
+	return ret;
+}
+
+/* Pack sparse leaves of a table, put its pages in key order and
+ * shrink its file. Other calls wait until it is done.
+ * Returns the number of pages cut from the file.
+ */
+int defrag_table(int table_id){
+	int ret;
+	if (MAPPED(table_id))
+		return 0;
+	LATCH();
+	ret = defrag_low(&c.tbls[table_id]);
+	UNLATCH();
+	return ret;
+}
+
+/* Compactor thread. Every COMPACT_INTERVAL_MS in which no other call
+ * took the latch, it takes a compaction step on each open table, and
+ * defragments a table whose pass ended after DEFRAG_MERGES merges.
+ */
+static void *compact_main(void *arg){
+	table *t;
+	uint64_t seen = 0;
+	int i;
+
+	pthread_mutex_lock(&c.latch);
+	while (compacting){
+		pthread_mutex_unlock(&c.latch);
+		usleep(COMPACT_INTERVAL_MS * 1000);
+		pthread_mutex_lock(&c.latch);
+		if (compacting && num_calls == seen){
+			for (i = 0; i < MAX_TABLE; i++){
+				t = &c.tbls[i];
+				if (!t->is_used || t->map != NULL)
+					continue;
+				compact_low(t, COMPACT_BATCH);
+				if (KEY_EQ(t->compact_next, key_min()) &&
+						t->compact_merges >= DEFRAG_MERGES)
+					defrag_low(t);
+			}
+		}
+		seen = num_calls;
+	}
+	pthread_mutex_unlock(&c.latch);
+	return arg;
+}
+
+/* Start merging sparse leaves in the background while the
+ * database is idle
+ */
+int start_compaction(void){
+	int ret = 0;
+	LATCH();
+	if (!compacting){
+		compacting = true;
+		ret = pthread_create(&compactor, NULL, compact_main, NULL);
+		if (ret != 0)
+			compacting = false;
+	}
+	UNLATCH();
+	return ret;
+}
+
+void stop_compaction(void){
+	bool running;
+	LATCH();
+	running = compacting;
+	compacting = false;
+	UNLATCH();
+	if (running)
+		pthread_join(compactor, NULL);
+}
+
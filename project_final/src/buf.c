@@ -86,11 +86,14 @@ page *alloc_page(table *t, addr ad){
 
 /* Get an address-specific page from buffer pool.
  * if it doesn't exist, Load it from disk to buffer. 
+ * A mapped table has its pages in the mapping instead.
  */
 page *get_page(table *t, addr ad){
 	bufmgr *bfm = t->c->bfm;
 	page *freepage = NULL;
 	int i;
+	if (t->map != NULL)
+		return map_page(t, ad);
 	for (i = 0; i < bfm->num_buf; i++){
 		if (bfm->pages[i].table_id == t->table_id &&
 				bfm->pages[i].offset == ad && bfm->pages[i].is_used){
@@ -106,23 +109,71 @@ page *get_page(table *t, addr ad){
 	return freepage;
 }
 
-/* Flush all buffer pages which belong to the table.
+/* Get a frame for a page allocated now, zeroed and dirty.
+ * The page is not read from disk.
+ */
+page *new_page(table *t, addr ad){
+	bufmgr *bfm = t->c->bfm;
+	page *p = NULL;
+	int i;
+	for (i = 0; i < bfm->num_buf; i++){
+		if (bfm->pages[i].table_id == t->table_id &&
+				bfm->pages[i].offset == ad && bfm->pages[i].is_used){
+			p = &bfm->pages[i];
+			p->pincnt++;
+			bfm->tot_pincnt++;
+			update_lru(t, p);
+			break;
+		}
+	}
+	if (p == NULL)
+		p = alloc_page(t, ad);
+	memset(p->b, 0, BLOCK_SIZE);
+	p->is_dirty = true;
+	return p;
+}
+
+/* Flush all buffer pages which belong to the table,
+ * and its free space maps.
  */
 void flush_page(table *t){
 	bufmgr *bfm = t->c->bfm;
 	page *p = bfm->lru_head;
 	page *next;
+	fsm_save(t);
 	while(p != NULL){
 		next = p->lru_next;
 		if (p->table_id == t->table_id){
 			if (p->is_dirty)
 				write_page(t, p);
 			pop_from_lru(t, p);
+			// The frame is free again, and its table id may be reused
+			p->is_used = false;
+			p->is_dirty = false;
 		}
 		p = next;
 	}
 }
 
+/* Write back every dirty page of the connection
+ * but keep them in the buffer pool.
+ */
+void flush_dirty_pages(conn *c){
+	bufmgr *bfm = c->bfm;
+	page *p;
+	int i;
+	for (i = 0; i < MAX_TABLE; i++)
+		if (c->tbls[i].is_used)
+			fsm_save(&c->tbls[i]);
+	for (i = 0; i < bfm->num_buf; i++){
+		p = &bfm->pages[i];
+		if (p->is_used && p->is_dirty){
+			write_page(&c->tbls[p->table_id], p);
+			p->is_dirty = false;
+		}
+	}
+}
+
 /* Intialize buffer manager
  */
 int init_bufmgr(conn *c, int buf_num){
@@ -5,12 +5,18 @@
 int open_conn(conn *c, int buf_num){
 	DEC_RET;
 	RET(init_bufmgr(c, buf_num));
+	pthread_mutex_init(&c->latch, NULL);
 	return E_OK;
 }
 
 /* Close the connection
  */
 int close_conn(conn *c){
+	int i;
+	for (i = 0; i < MAX_TABLE; i++)
+		if (c->tbls[i].is_used)
+			fsm_save(&c->tbls[i]);
 	close_bufmgr(c);
+	pthread_mutex_destroy(&c->latch);
 	return E_OK;
 }
@@ -0,0 +1,189 @@
+#include "bptree.h"
+
+/* Defragmentation.
+ * The pages in use are renumbered so that the internal nodes come
+ * first in breadth-first order, then the leaves in key order, then the
+ * overflow pages in the order of their records, and the file is cut
+ * after them. Every pointer is rewritten by the new numbers, and the
+ * pages are moved along the cycles of the renumbering with two page
+ * buffers, each read and written once. Free pages are dropped, and
+ * the free space maps go after the last page.
+ * It runs under the latch like any call, so other calls wait for it.
+ * Structural changes are not logged, so a crash in the middle of it
+ * leaves the file broken, as it would in a split.
+ */
+
+enum page_kind {KIND_FREE, KIND_NODE, KIND_LEAF, KIND_OVERFLOW};
+
+#define MAP(newpn, a) ((addr)(newpn)[(a) / BLOCK_SIZE] * BLOCK_SIZE)
+
+/* Rewrite the page addresses in a page by the new numbers
+ */
+static void remap_page(void *b, uint8_t kind, const uint32_t *newpn){
+	nblock *nb = b;
+	oblock *ob = b;
+	addr ad;
+	int i;
+
+	if (kind == KIND_OVERFLOW){
+		if (ob->next != ADDR_NOT_EXIST)
+			ob->next = MAP(newpn, ob->next);
+		return;
+	}
+	if (nb->parent != ADDR_NOT_EXIST)
+		nb->parent = MAP(newpn, nb->parent);
+	if (kind == KIND_NODE){
+		nb->i_leftmost = MAP(newpn, nb->i_leftmost);
+		for (i = 0; i < nb->num_keys; i++){
+			if (nb->i_narrow)
+				nb->i_nchildren[i].pnum = newpn[nb->i_nchildren[i].pnum];
+			else
+				nb->i_children[i].v = MAP(newpn, nb->i_children[i].v);
+		}
+		return;
+	}
+	if (nb->l_sib != ADDR_NOT_EXIST)
+		nb->l_sib = MAP(newpn, nb->l_sib);
+	for (i = 0; i < nb->num_keys; i++){
+		if ((ad = leaf_overflow(nb, i)) == ADDR_NOT_EXIST)
+			continue;
+		ad = MAP(newpn, ad);
+		memcpy(nb->l_data + nb->l_slots[i].off, &ad, sizeof(addr));
+	}
+}
+
+/* Number the pages of the tree in their new order.
+ * Returns the number of pages in use, header excluded.
+ */
+static uint32_t number_pages(table *t, addr root, uint8_t *kind,
+		uint32_t *newpn, uint64_t num_page){
+	addr *queue = malloc(num_page * sizeof(addr)), ad, sib;
+	npage *np;
+	opage *op;
+	nblock *nb;
+	uint64_t head = 0, tail = 0, end;
+	uint32_t n = 0;
+	int i, height = 0, level;
+
+	// Levels of internal nodes, on the leftmost path
+	for (ad = root; ; height++){
+		np = get_npage(t, ad);
+		if (B(np)->is_leaf){
+			release_page(t, np);
+			break;
+		}
+		ad = node_child(B(np), 0);
+		release_page(t, np);
+	}
+
+	// Internal nodes, breadth first
+	queue[tail++] = root;
+	for (level = 0; level < height; level++){
+		for (end = tail; head < end; head++){
+			np = get_npage(t, queue[head]);
+			nb = B(np);
+			kind[np->offset / BLOCK_SIZE] = KIND_NODE;
+			newpn[np->offset / BLOCK_SIZE] = ++n;
+			for (i = 0; level + 1 < height && i <= nb->num_keys; i++)
+				queue[tail++] = node_child(nb, i);
+			release_page(t, np);
+		}
+	}
+
+	// Leaves along the sibling chain
+	for (np = find_leaf(t, key_min()); np != NULL; ){
+		kind[np->offset / BLOCK_SIZE] = KIND_LEAF;
+		newpn[np->offset / BLOCK_SIZE] = ++n;
+		sib = B(np)->l_sib;
+		release_page(t, np);
+		np = sib == ADDR_NOT_EXIST ? NULL : get_npage(t, sib);
+	}
+
+	// Overflow chains, in the order of their records
+	for (np = find_leaf(t, key_min()); np != NULL; ){
+		nb = B(np);
+		for (i = 0; i < nb->num_keys; i++){
+			for (ad = leaf_overflow(nb, i); ad != ADDR_NOT_EXIST; ){
+				kind[ad / BLOCK_SIZE] = KIND_OVERFLOW;
+				newpn[ad / BLOCK_SIZE] = ++n;
+				op = (opage *)get_page(t, ad);
+				ad = B(op)->next;
+				release_page(t, op);
+			}
+		}
+		sib = nb->l_sib;
+		release_page(t, np);
+		np = sib == ADDR_NOT_EXIST ? NULL : get_npage(t, sib);
+	}
+	free(queue);
+	return n;
+}
+
+/* Pack sparse leaves, put the pages in order and cut the file
+ * after them. Returns the number of pages cut.
+ */
+int defrag_low(table *t){
+	hpage *hp;
+	addr root;
+	uint64_t num_page, p;
+	uint32_t n = 0, cur, q, *newpn;
+	uint8_t *kind, *done, *mem, *a, *b, *tmp;
+
+	t->compact_next = key_min();
+	compact_low(t, INT32_MAX);
+	t->compact_merges = 0;
+
+	hp = get_hpage(t);
+	root = B(hp)->root;
+	num_page = B(hp)->num_page;
+	release_page(t, hp);
+
+	kind = calloc(num_page, 1);
+	done = calloc(num_page, 1);
+	newpn = calloc(num_page, sizeof(uint32_t));
+	if (root != ADDR_NOT_EXIST)
+		n = number_pages(t, root, kind, newpn, num_page);
+
+	// From here the pages bypass the buffer pool
+	flush_page(t);
+	mem = malloc(BLOCK_SIZE * 3);
+	a = (uint8_t *)ALIGN_UP((uintptr_t)mem, BLOCK_SIZE);
+	b = a + BLOCK_SIZE;
+	for (p = 1; p < num_page; p++){
+		if (kind[p] == KIND_FREE || done[p])
+			continue;
+		cur = p;
+		read_block(t, a, (addr)cur * BLOCK_SIZE);
+		for (;;){
+			done[cur] = true;
+			remap_page(a, kind[cur], newpn);
+			q = newpn[cur];
+			if (q == cur || kind[q] == KIND_FREE || done[q]){
+				write_block(t, a, (addr)q * BLOCK_SIZE);
+				break;
+			}
+			read_block(t, b, (addr)q * BLOCK_SIZE);
+			write_block(t, a, (addr)q * BLOCK_SIZE);
+			tmp = a;
+			a = b;
+			b = tmp;
+			cur = q;
+		}
+	}
+	free(mem);
+
+	hp = get_hpage(t);
+	set_dirty(hp);
+	B(hp)->root = root == ADDR_NOT_EXIST ? ADDR_NOT_EXIST : MAP(newpn, root);
+	fsm_reset(t, hp, n + 1);
+	n = B(hp)->num_page;
+	release_page(t, hp);
+	flush_page(t);
+	if (ftruncate(t->bm.fd, (off_t)n * BLOCK_SIZE) != 0)
+		panic("defrag");
+
+	free(kind);
+	free(done);
+	free(newpn);
+	return num_page - n;
+}
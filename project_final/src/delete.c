@@ -1,31 +1,37 @@
 #include "bptree.h"
 
-int remove_entry_from_node(table *t, npage *np, int64_t k, int idx){
+int remove_entry_from_node(table *t, npage *np, bkey_t k, int idx){
 	nblock *nb = B(np);
+	wnode w;
 	int i;
 
+	// A leaf record goes with its overflow pages.
+	if (nb->is_leaf){
+		i = leaf_lower_bound(nb, k);
+		if (leaf_overflow(nb, i) != ADDR_NOT_EXIST)
+			free_overflow(t, leaf_overflow(nb, i));
+		leaf_remove(nb, i);
+		return E_OK;
+	}
+
 	// Remove the key and shift other keys accordingly.
+	node_load(nb, &w);
 	i = 0;
-	while (k != (nb->is_leaf ? nb->l_recs[i].k : nb->i_children[i].k))
+	while (!KEY_EQ(k, w.children[i].k))
 		i++;
 
-	if (!nb->is_leaf && idx == 0){
-		nb->i_leftmost = nb->i_children[0].v;
-	}
-	for (++i; i < nb->num_keys; i++){
-		if (nb->is_leaf)
-			nb->l_recs[i-1] = nb->l_recs[i];
-		else{
-			nb->i_children[i-1] = nb->i_children[i];
-		}
+	if (idx == 0){
+		w.leftmost = w.children[0].v;
+#ifdef ORDER_STATISTIC
+		w.leftmost_cnt = w.children[0].cnt;
+#endif
 	}
-	if (nb->is_leaf)
-		memset(&nb->l_recs[i-1], 0, sizeof(record));
-	else
-		memset(&nb->i_children[i-1], 0, sizeof(child));
+	memmove(&w.children[i], &w.children[i+1],
+			(w.num_keys - i - 1) * sizeof(child));
 
 	// One key fewer.
-	nb->num_keys--;
+	w.num_keys--;
+	node_store(nb, &w);
 
 	return E_OK;
 }
@@ -78,10 +84,11 @@ int adjust_root(table *t, npage *root) {
  * can accept the additional entries
  * without exceeding the maximum.
  */
-int coalesce_nodes(table *t, npage *np, npage *neighbor, int neighbor_index, int k_prime) {
-	int i, j, neighbor_insertion_index, n_end;
+int coalesce_nodes(table *t, npage *np, npage *neighbor, int neighbor_index, bkey_t k_prime) {
+	int i, j, neighbor_insertion_index;
 	nblock *nb;
 	npage *tmp, *parent;
+	wnode w;
 
 	/* Swap neighbor with node if node is on the
 	 * extreme left and neighbor is to its right.
@@ -112,17 +119,22 @@ int coalesce_nodes(table *t, npage *np, npage *neighbor, int neighbor_index, int
 		/* Append k_prime.
 		 */
 
-		B(neighbor)->i_children[neighbor_insertion_index].k = k_prime;
-		B(neighbor)->i_children[neighbor_insertion_index].v = nb->i_leftmost;
-		B(neighbor)->num_keys++;
-
-		n_end = nb->num_keys;
-
-		for (i = neighbor_insertion_index + 1, j = 0; j < n_end; i++, j++) {
-			B(neighbor)->i_children[i] = nb->i_children[j];
-			B(neighbor)->num_keys++;
-			nb->num_keys--;
+		node_load(B(neighbor), &w);
+		w.children[neighbor_insertion_index].k = k_prime;
+		w.children[neighbor_insertion_index].v = nb->i_leftmost;
+#ifdef ORDER_STATISTIC
+		w.children[neighbor_insertion_index].cnt = nb->leftmost_cnt;
+#endif
+
+		for (i = neighbor_insertion_index + 1, j = 0; j < nb->num_keys; i++, j++) {
+			w.children[i].k = node_key(nb, j);
+			w.children[i].v = node_child(nb, j + 1);
+#ifdef ORDER_STATISTIC
+			w.children[i].cnt = get_child_count(np, j + 1);
+#endif
 		}
+		w.num_keys = i;
+		node_store(B(neighbor), &w);
 
 		/* All children must now point up to the same parent.
 		 */
@@ -142,15 +154,20 @@ int coalesce_nodes(table *t, npage *np, npage *neighbor, int neighbor_index, int
 	 */
 
 	else {
-		for (i = neighbor_insertion_index, j = 0; j < nb->num_keys; i++, j++) {
-			B(neighbor)->l_recs[i] = nb->l_recs[j];
-			B(neighbor)->num_keys++;
-		}
+		while (nb->num_keys > 0)
+			leaf_move(B(neighbor), B(neighbor)->num_keys, nb, 0);
 		B(neighbor)->l_sib = nb->l_sib;
+		// The records carry the log position of their updates along
+		if (nb->page_lsn > B(neighbor)->page_lsn)
+			B(neighbor)->page_lsn = nb->page_lsn;
 	}
 
 	parent = get_parent(t, np);
 	set_dirty(parent);
+#ifdef ORDER_STATISTIC
+	set_child_count(parent, neighbor_index == -1 ? 0 : neighbor_index,
+			node_count(neighbor));
+#endif
 	free_block(t, np);
 	delete_entry(t, parent, k_prime, neighbor_index == -1 ? 1 : neighbor_index+1);
 	release_page(t, parent);
@@ -175,7 +192,7 @@ int get_neighbor_index(table *t, npage *np, npage *parent) {
 	if (B(parent)->i_leftmost == np->offset)
 		return -1;
 	for (i = 0; i < B(parent)->num_keys; i++)
-		if (B(parent)->i_children[i].v == np->offset)
+		if (node_child(B(parent), i + 1) == np->offset)
 			return i;
 
 	// Error state.
@@ -189,44 +206,64 @@ int get_neighbor_index(table *t, npage *np, npage *parent) {
  * maximum
  */
 int redistribute_nodes(table *t, npage *np, npage *neighbor, int neighbor_index, 
-		int k_prime_index, int64_t k_prime) {  
-	int i;
+		int k_prime_index, bkey_t k_prime) {  
 	nblock *nb = B(np);
+	nblock *nbr = B(neighbor);
 	npage *parent;
 	npage *tmp;
+	wnode w, nw;
+	bool moved;
+
+	/* The parent takes the new key between the two nodes first.
+	 * When a narrow parent cannot hold it, the node is left
+	 * below the minimum.
+	 */
+	parent = get_parent(t, np);
+	if (nb->is_leaf)
+		moved = neighbor_index != -1 ?
+			node_set_separator(B(parent), k_prime_index,
+					nbr->l_slots[nbr->num_keys - 2].k,
+					nbr->l_slots[nbr->num_keys - 1].k) :
+			node_set_separator(B(parent), k_prime_index,
+					nbr->l_slots[0].k, nbr->l_slots[1].k);
+	else
+		moved = node_set_key(B(parent), k_prime_index, neighbor_index != -1 ?
+				node_key(nbr, nbr->num_keys - 1) : node_key(nbr, 0));
+	if (!moved){
+		release_page(t, parent);
+		return E_OK;
+	}
+	set_dirty(parent);
 
 	/* Case: n has a neighbor to the left. 
 	 * Pull the neighbor's last key-pointer pair over
 	 * from the neighbor's right end to n's left end.
 	 */
-	parent = get_parent(t, np);
-	set_dirty(parent);
 
 	if (neighbor_index != -1) {
-		for (i = nb->num_keys; i > 0; i--) {
-			if (nb->is_leaf)
-				nb->l_recs[i] = nb->l_recs[i - 1];
-			else
-				nb->i_children[i] = nb->i_children[i - 1];
-		}
 		if (!nb->is_leaf) {
-			nb->i_children[0].v = nb->i_leftmost;
-			nb->i_leftmost = B(neighbor)->i_children[B(neighbor)->num_keys-1].v;
+			node_load(nb, &w);
+			node_load(nbr, &nw);
+			memmove(&w.children[1], &w.children[0], w.num_keys * sizeof(child));
+			w.children[0].k = k_prime;
+			w.children[0].v = w.leftmost;
+			w.leftmost = nw.children[nw.num_keys - 1].v;
+#ifdef ORDER_STATISTIC
+			w.children[0].cnt = w.leftmost_cnt;
+			w.leftmost_cnt = nw.children[nw.num_keys - 1].cnt;
+#endif
+			w.num_keys++;
+			nw.num_keys--;
+			node_store(nb, &w);
+			node_store(nbr, &nw);
+
 			tmp = get_child(t, np, 0);
 			set_dirty(tmp);
 			B(tmp)->parent = np->offset;
 			release_page(t, tmp);
-			nb->i_children[0].k = k_prime;
-			B(parent)->i_children[k_prime_index].k = 
-				B(neighbor)->i_children[B(neighbor)->num_keys - 1].k;
-
-			memset(&B(neighbor)->i_children[B(neighbor)->num_keys - 1], 0, sizeof(child));
-		}
-		else {
-			nb->l_recs[0] = B(neighbor)->l_recs[B(neighbor)->num_keys - 1];
-			memset(&B(neighbor)->l_recs[B(neighbor)->num_keys - 1], 0, sizeof(record));
-			B(parent)->i_children[k_prime_index].k = nb->l_recs[0].k;
 		}
+		else
+			leaf_move(nb, 0, nbr, nbr->num_keys - 1);
 	}
 
 	/* Case: n is the leftmost child.
@@ -236,36 +273,44 @@ int redistribute_nodes(table *t, npage *np, npage *neighbor, int neighbor_index,
 	 */
 
 	else {  
-		if (nb->is_leaf) {
-			nb->l_recs[nb->num_keys] = B(neighbor)->l_recs[0];
-			B(parent)->i_children[k_prime_index].k = B(neighbor)->l_recs[1].k;
-		}
+		if (nb->is_leaf)
+			leaf_move(nb, nb->num_keys, nbr, 0);
 		else {
-			nb->i_children[nb->num_keys].k = k_prime;
-			nb->i_children[nb->num_keys].v = B(neighbor)->i_leftmost;
-			tmp = get_child(t, np, nb->num_keys + 1);
+			node_load(nb, &w);
+			node_load(nbr, &nw);
+			w.children[w.num_keys].k = k_prime;
+			w.children[w.num_keys].v = nw.leftmost;
+			nw.leftmost = nw.children[0].v;
+#ifdef ORDER_STATISTIC
+			w.children[w.num_keys].cnt = nw.leftmost_cnt;
+			nw.leftmost_cnt = nw.children[0].cnt;
+#endif
+			memmove(&nw.children[0], &nw.children[1],
+					(nw.num_keys - 1) * sizeof(child));
+			w.num_keys++;
+			nw.num_keys--;
+			node_store(nb, &w);
+			node_store(nbr, &nw);
+
+			tmp = get_child(t, np, nb->num_keys);
 			set_dirty(tmp);
 			B(tmp)->parent = np->offset;
 			release_page(t, tmp);
-			B(parent)->i_children[k_prime_index].k = B(neighbor)->i_children[0].k;
-
-			B(neighbor)->i_leftmost = B(neighbor)->i_children[0].v;
-		}
-		for (i = 0; i < B(neighbor)->num_keys - 1; i++) {
-			if (B(neighbor)->is_leaf)
-				B(neighbor)->l_recs[i] = B(neighbor)->l_recs[i + 1];
-			else
-				B(neighbor)->i_children[i] = B(neighbor)->i_children[i + 1];
 		}
 	}
+	if (nb->is_leaf && nbr->page_lsn > nb->page_lsn)
+		nb->page_lsn = nbr->page_lsn;
 
-	/* n now has one more key and one more pointer;
-	 * the neighbor has one fewer of each.
-	 */
-
-	nb->num_keys++;
-	B(neighbor)->num_keys--;
-
+#ifdef ORDER_STATISTIC
+	if (neighbor_index == -1){
+		set_child_count(parent, 0, node_count(np));
+		set_child_count(parent, 1, node_count(neighbor));
+	}
+	else{
+		set_child_count(parent, neighbor_index, node_count(neighbor));
+		set_child_count(parent, neighbor_index + 1, node_count(np));
+	}
+#endif
 	release_page(t, parent);
 
 	return E_OK;
@@ -276,15 +321,15 @@ int redistribute_nodes(table *t, npage *np, npage *neighbor, int neighbor_index,
  * from the leaf, and then makes all appropriate
  * changes to preserve the B+ tree properties.
  */
-int delete_entry(table *t, npage *np, int64_t k, int idx){
+int delete_entry(table *t, npage *np, bkey_t k, int idx){
 	DEC_RET;
 	npage *parent;
 	nblock *nb = B(np);
 	int min_keys;
 	npage *neighbor;
 	int neighbor_index;
-	int k_prime_index, k_prime;
-	int capacity;
+	int k_prime_index;
+	bkey_t k_prime;
 
 	// Remove key and pointer from node.
 
@@ -305,13 +350,15 @@ int delete_entry(table *t, npage *np, int64_t k, int idx){
 	 * to be preserved after deletion.
 	 */
 
-	min_keys = nb->is_leaf ? cut(LEAF_ORDER - 1) : cut(INT_ORDER) - 1;
+	min_keys = NODE_MIN_KEYS > 0 ? NODE_MIN_KEYS : 1;
 
 	/* Case:  node stays at or above minimum.
 	 * (The simple case.)
+	 * A leaf is measured in bytes, and an empty one always goes.
 	 */
 
-	if (nb->num_keys >= min_keys)
+	if (nb->is_leaf ? nb->num_keys > 0 && leaf_used(nb) >= LEAF_MIN_USED
+			: nb->num_keys >= min_keys)
 		return E_OK;
 
 	/* Case:  node falls below minimum.
@@ -329,17 +376,18 @@ int delete_entry(table *t, npage *np, int64_t k, int idx){
 	parent = get_parent(t, np);
 	neighbor_index = get_neighbor_index(t, np, parent);
 	k_prime_index = neighbor_index == -1 ? 0 : neighbor_index;
-	k_prime = B(parent)->i_children[k_prime_index].k;
+	k_prime = node_key(B(parent), k_prime_index);
 	neighbor = (neighbor_index == -1) ? get_child(t, parent, 1) : 
 		get_child(t, parent, neighbor_index);
 	set_dirty(neighbor);
 
 	release_page(t, parent);
-	capacity = nb->is_leaf ? LEAF_ORDER : INT_ORDER - 1;
 
 	/* Coalescence. */
 
-	if (B(neighbor)->num_keys + nb->num_keys < capacity){
+	if (nb->is_leaf ? leaf_used(B(neighbor)) + leaf_used(nb) <= LEAF_AREA
+			: neighbor_index == -1 ? node_can_merge(nb, k_prime, B(neighbor))
+			: node_can_merge(B(neighbor), k_prime, nb)){
 		ret = coalesce_nodes(t, np, neighbor, neighbor_index, k_prime);
 	}
 
@@ -354,17 +402,21 @@ int delete_entry(table *t, npage *np, int64_t k, int idx){
 
 /* Master internal deletion function.
  */
-int delete_low(table *t, int64_t k) {
+int delete_low(table *t, bkey_t k) {
 	DEC_RET;
 	npage *key_leaf;
 	record r;
 	int idx;
 
 	RET(find_low(t, k, &r));
+	rcache_drop(t->table_id, k);
 
 	key_leaf = find_leaf(t, k);
 	if (key_leaf != NULL) {
 		set_dirty(key_leaf);
+#ifdef ORDER_STATISTIC
+		add_path_count(t, key_leaf, -1);
+#endif
 		idx = find_rec(t, key_leaf, k);
 		delete_entry(t, key_leaf, k, idx);
 		release_page(t, key_leaf);
@@ -372,3 +424,56 @@ int delete_low(table *t, int64_t k) {
 	}
 	return E_OK;
 }
+
+/* Merges sparse neighboring leaves, like a delete would with a higher
+ * threshold, so that deletes can leave leaves sparse without a merge
+ * each time. Starting at the leaf of compact_next, it visits at most
+ * budget leaves to the right, and a leaf takes the records of its
+ * right sibling under the same parent when one of them uses fewer
+ * than LEAF_SPARSE_USED bytes and both fit in BULK_FILL percent of a
+ * leaf. At the last leaf it starts over from the smallest key.
+ * Returns the number of merges.
+ */
+int compact_low(table *t, int budget){
+	npage *np, *right, *parent;
+	nblock *nb;
+	bkey_t k_prime;
+	addr sib;
+	int merges = 0, neighbor_index;
+
+	if ((np = find_leaf(t, t->compact_next)) == NULL)
+		return 0;
+	nb = B(np);
+	while (budget-- > 0){
+		if ((sib = nb->l_sib) == ADDR_NOT_EXIST){
+			release_page(t, np);
+			t->compact_next = key_min();
+			return merges;
+		}
+		right = get_npage(t, sib);
+		if (nb->parent != B(right)->parent ||
+				(leaf_used(nb) >= LEAF_SPARSE_USED &&
+				 leaf_used(B(right)) >= LEAF_SPARSE_USED) ||
+				leaf_used(nb) + leaf_used(B(right)) > LEAF_AREA * BULK_FILL / 100){
+			release_page(t, np);
+			np = right;
+			nb = B(np);
+			continue;
+		}
+
+		// The right leaf goes into this one, which stays pinned
+		parent = get_parent(t, right);
+		neighbor_index = get_neighbor_index(t, right, parent);
+		k_prime = node_key(B(parent), neighbor_index);
+		release_page(t, parent);
+		set_dirty(np);
+		set_dirty(right);
+		coalesce_nodes(t, right, np, neighbor_index, k_prime);
+		release_page(t, right);
+		merges++;
+		t->compact_merges++;
+	}
+	t->compact_next = nb->num_keys > 0 ? nb->l_slots[0].k : key_min();
+	release_page(t, np);
+	return merges;
+}
@@ -1,9 +1,23 @@
 #include "bptree.h"
 
-/* Open new file and return table id
+/* Open a file as the table of table_id
  */
-int open_file(conn *c, const char *file_path){
+int open_file_id(conn *c, int table_id, const char *file_path){
 	int f = O_RDWR| O_CREAT | O_DIRECT | O_SYNC;
+
+	if (table_id < 0 || table_id >= MAX_TABLE || c->tbls[table_id].is_used)
+		return E_FULL_TABLE;
+	c->tbls[table_id].c = c;
+	c->tbls[table_id].table_id = table_id;
+	c->tbls[table_id].bm.fd = open(file_path, f, DEF_DB_MODE);
+	c->tbls[table_id].is_used = true;
+	strncpy(c->tbls[table_id].path, file_path, sizeof(c->tbls[table_id].path) - 1);
+	return table_id;
+}
+
+/* Table id of a file, from its name DATA<id>
+ */
+static int file_table_id(const char *file_path){
 	int i;
 
   // ****** Parsing file name start ******
@@ -37,18 +51,10 @@ int open_file(conn *c, const char *file_path){
   // DATA
   i += 4;
 
-  int table_id = atoi(&file_path[i]);
+  return atoi(&file_path[i]);
 
   // ****** Parsing file name end ******
 
-  if (!c->tbls[table_id].is_used) {
-    c->tbls[table_id].c = c;
-    c->tbls[table_id].table_id = table_id;
-    c->tbls[table_id].bm.fd = open(file_path, f, DEF_DB_MODE);
-    c->tbls[table_id].is_used = true;
-    return table_id;
-  }
-
   /** for (i = 0; i < MAX_TABLE; i++){
     *   if (!c->tbls[i].is_used){
     *     c->tbls[i].c = c;
@@ -65,35 +71,87 @@ err:
   return E_FULL_TABLE;
 }
 
+/* Open new file and return table id
+ */
+int open_file(conn *c, const char *file_path){
+  return open_file_id(c, file_table_id(file_path), file_path);
+}
+
+/* Open a file read-only and map it, as the table of its name.
+ * hints are MMAP_ flags.
+ */
+int open_file_mapped(conn *c, const char *file_path, int hints){
+  int table_id = file_table_id(file_path);
+  int flags = MAP_SHARED;
+  struct stat st;
+  table *t;
+  void *map;
+  int fd;
+
+  if (table_id < 0 || table_id >= MAX_TABLE || c->tbls[table_id].is_used)
+    return E_FULL_TABLE;
+  if ((fd = open(file_path, O_RDONLY)) == -1)
+    return E_FULL_TABLE;
+  if (fstat(fd, &st) == -1 || st.st_size < (off_t)BLOCK_SIZE){
+    close(fd);
+    return E_FULL_TABLE;
+  }
+  if (hints & MMAP_POPULATE)
+    flags |= MAP_POPULATE;
+  if ((map = mmap(NULL, st.st_size, PROT_READ, flags, fd, 0)) == MAP_FAILED){
+    close(fd);
+    return E_FULL_TABLE;
+  }
+  if (hints & MMAP_SEQUENTIAL)
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+  if (hints & MMAP_RANDOM)
+    madvise(map, st.st_size, MADV_RANDOM);
+
+  t = &c->tbls[table_id];
+  t->c = c;
+  t->table_id = table_id;
+  t->bm.fd = fd;
+  t->is_used = true;
+  strncpy(t->path, file_path, sizeof(t->path) - 1);
+  t->map = map;
+  t->map_len = st.st_size;
+  return table_id;
+}
+
 /* Close the file
 */
 void close_file(table *t){
+  fsm_close(t);
+  if (t->map != NULL)
+    munmap(t->map, t->map_len);
   close(t->bm.fd);
   memset(t, 0, sizeof(table));
 }
 
-/* Extend the file
+/* Extend the file. The new pages are free in the maps and
+ * are not written until they are allocated. fallocate() reserves
+ * their blocks without writing them, where the file system can.
 */
 void extend_file(table *t, hpage *hp){
   hblock *hb = B(hp);
-  int new_num_page;
-  int sz;
-  uint8_t buf[BLOCK_SIZE * 2];
-  fblock *blk = (fblock*) ALIGN_UP((uintptr_t) buf, BLOCK_SIZE);
-  hb->free = hb->num_page * BLOCK_SIZE;
-  memset(blk, 0, BLOCK_SIZE);
+  uint64_t old_num_page = hb->num_page;
+  uint64_t new_num_page;
+
 #ifdef NUM_EXTEND_PAGE
   new_num_page = hb->num_page + NUM_EXTEND_PAGE;
 #else
   new_num_page = hb->num_page * 2;
+  if (new_num_page > hb->num_page + MAX_EXTEND_PAGE)
+    new_num_page = hb->num_page + MAX_EXTEND_PAGE;
 #endif /* NUM_EXTEND_PAGE */
-  for (sz = hb->num_page + 1; sz < new_num_page; sz++){
-    blk->next = sz * BLOCK_SIZE;
-    write_block(t, blk, (sz - 1) * BLOCK_SIZE);
+  fsm_grow(t, hp, new_num_page);
+  if (fallocate(t->bm.fd, 0, old_num_page * BLOCK_SIZE,
+        (hb->num_page - old_num_page) * BLOCK_SIZE) == 0)
+    return;
+  if ((errno != EOPNOTSUPP && errno != ENOSYS) ||
+      ftruncate(t->bm.fd, hb->num_page * BLOCK_SIZE) != 0){
+    panic("extend_file");
   }
-  blk->next = ADDR_NOT_EXIST;
-  write_block(t, blk, (sz - 1) * BLOCK_SIZE);
-  hb->num_page = new_num_page;
 }
 
 /* Read one block from file
@@ -110,50 +168,54 @@ void read_block(table *t, void *p, addr ad){
   }
 }
 
-/* Allocate one block from file.
- * If the file is full, extend the file.
- */
-addr alloc_block(table *t){
-  hpage *hp = get_hpage(t);
-  addr ad;
-  fpage *fp;
-  set_dirty(hp);
-
-  if (B(hp)->free == ADDR_NOT_EXIST){
-    extend_file(t, hp);
-  }
-  ad = B(hp)->free;
-  fp = get_fpage(t, ad);
-  set_dirty(fp);
-  release_page(t, fp);
-
-  B(hp)->free = B(fp)->next;
-  release_page(t, hp);
-  return ad;
-}
-
 /* Free the block from file for reuse.
+ * A free page is not read again, so its frame is not written.
 */
 void free_block(table *t, void *b){
-  hpage *hp = get_hpage(t);
-  hblock *hb = B(hp);
   fpage *fp = (fpage*)b;
-  fblock *fb = B(fp);
 
-  memset(fb, 0, BLOCK_SIZE);
-  fb->next = hb->free;
-  set_dirty(fp);
+  fsm_free(t, fp->offset);
+  ((page*)fp)->is_dirty = false;
+}
 
-  hb->free = fp->offset;
-  set_dirty(hp);
-  release_page(t, hp);
+/* A page of a mapped table, in the mapping. Its descriptor is
+ * taken until the page is released.
+ */
+page *map_page(table *t, addr ad){
+  page *p;
+  int i;
+
+  if (ad + BLOCK_SIZE > t->map_len)
+    panic("map_page");
+  for (i = 0; i < MAP_PIN_MAX; i++){
+    p = &t->map_pages[i];
+    if (p->pincnt == 0){
+      p->b = t->map + ad;
+      p->table_id = t->table_id;
+      p->offset = ad;
+      p->pincnt++;
+      t->c->bfm->tot_pincnt++;
+      return p;
+    }
+  }
+  panic("map_page");
 }
 
 /* Write one block to file
 */
 void write_block(table *t, void *b, addr ad){
+  // WAL: the log must be durable up to page_lsn before the page.
+  // Header blocks keep zero at that position.
+  log_flush_to(((nblock*)b)->page_lsn);
+  write_block_raw(t, b, ad);
+}
+
+/* Write one block which has no page_lsn, like a map page
+*/
+void write_block_raw(table *t, void *b, addr ad){
   int fd = t->bm.fd;
   int nr;
+
   if (!ALIGNED(ad)){
     ad = ALIGN_DOWN(ad, BLOCK_SIZE);
   }
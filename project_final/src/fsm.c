@@ -0,0 +1,228 @@
+#include "bptree.h"
+
+/* Free space maps.
+ * A table keeps a bit per page of its file, set when the page is in
+ * use, in map pages of FSM_PAGES bits each. The header lists the map
+ * pages, which are pages of the file like the others. The maps are
+ * read at open and kept in memory, so an allocation looks at no page;
+ * a changed map page is written when the pages of its table are
+ * flushed. Map pages have no page_lsn, so they are written without
+ * the log.
+ *
+ * A file from before the maps has its free pages in a list from the
+ * header. It is read once at open, and the list is not used again.
+ */
+
+#define FSM_MAGIC 0x46534d3030303031ULL
+#define FSM_WORDS (FSM_PAGES / 64)
+
+#define IS_USED(f, pn) ((f)->bits[(pn) / 64] & 1ULL << ((pn) % 64))
+
+static uint64_t maps_for(uint64_t num_page){
+	return (num_page + FSM_PAGES - 1) / FSM_PAGES;
+}
+
+/* Make room in memory for the maps of num_page pages.
+ * New bits are clear.
+ */
+static void fsm_resize(fsm *f, uint64_t num_page){
+	uint64_t cap = maps_for(num_page);
+	void *mem;
+	uint64_t *bits;
+
+	if (cap > FSM_MAX_MAPS)
+		panic("fsm: file too large");
+	if (cap > f->cap){
+		cap = cap < f->cap * 2 ? f->cap * 2 : cap;
+		cap = cap > FSM_MAX_MAPS ? FSM_MAX_MAPS : cap;
+		mem = malloc((cap + 1) * BLOCK_SIZE);
+		bits = (uint64_t *)ALIGN_UP((uintptr_t)mem, BLOCK_SIZE);
+		memset(bits, 0, cap * BLOCK_SIZE);
+		if (f->bits != NULL)
+			memcpy(bits, f->bits, f->cap * BLOCK_SIZE);
+		free(f->mem);
+		f->mem = mem;
+		f->bits = bits;
+		f->cap = cap;
+	}
+	f->num_page = num_page;
+}
+
+/* Set or clear the bits of n pages from pn
+ */
+static void fsm_set(fsm *f, uint64_t pn, int n, bool used){
+	for (; n > 0; n--, pn++){
+		if (used)
+			f->bits[pn / 64] |= 1ULL << (pn % 64);
+		else
+			f->bits[pn / 64] &= ~(1ULL << (pn % 64));
+		f->dirty[pn / FSM_PAGES] = true;
+	}
+}
+
+/* First run of n free pages in [from, to), 0 if there is none
+ */
+static uint64_t fsm_find(fsm *f, uint64_t from, uint64_t to, int n){
+	uint64_t pn, run = 0;
+
+	for (pn = from; pn < to; pn++){
+		if (pn % 64 == 0 && f->bits[pn / 64] == ~0ULL){
+			run = 0;
+			pn += 63;
+			continue;
+		}
+		if (IS_USED(f, pn))
+			run = 0;
+		else if (++run == (uint64_t)n)
+			return pn - n + 1;
+	}
+	return 0;
+}
+
+/* Give the pages of the file the map pages they need, taking free
+ * pages or else pages after the last one, which the caller adds to
+ * the file. Sets num_page of the header.
+ */
+static void fsm_add_maps(fsm *f, hblock *hb){
+	uint64_t pn;
+
+	while (f->num_map < maps_for(f->num_page)){
+		if ((pn = fsm_find(f, f->low, f->num_page, 1)) == 0){
+			pn = f->num_page;
+			fsm_resize(f, pn + 1);
+		}
+		fsm_set(f, pn, 1, true);
+		f->map[f->num_map] = pn * BLOCK_SIZE;
+		f->dirty[f->num_map++] = true;
+	}
+	hb->pad0 = 0;
+	hb->fsm_magic = FSM_MAGIC;
+	hb->num_map = f->num_map;
+	memcpy(hb->map, f->map, f->num_map * sizeof(addr));
+	hb->num_page = f->num_page;
+}
+
+/* Load the maps of a table, or build them from the free list
+ * of an older file
+ */
+void fsm_open(table *t){
+	fsm *f = &t->fs;
+	hpage *hp = get_hpage(t);
+	hblock *hb = B(hp);
+	uint8_t mem[BLOCK_SIZE * 2];
+	fblock *fb = (fblock *)ALIGN_UP((uintptr_t)mem, BLOCK_SIZE);
+	addr ad;
+	uint64_t i;
+
+	memset(f, 0, sizeof(fsm));
+	fsm_resize(f, hb->num_page);
+	f->low = 1;
+	if (hb->fsm_magic == FSM_MAGIC){
+		f->num_map = hb->num_map;
+		memcpy(f->map, hb->map, f->num_map * sizeof(addr));
+		for (i = 0; i < f->num_map; i++)
+			read_block(t, f->bits + i * FSM_WORDS, f->map[i]);
+		release_page(t, hp);
+		return;
+	}
+
+	fsm_set(f, 0, hb->num_page, true);
+	for (ad = hb->free; ad != ADDR_NOT_EXIST; ad = fb->next){
+		read_block(t, fb, ad);
+		fsm_set(f, ad / BLOCK_SIZE, 1, false);
+	}
+	set_dirty(hp);
+	hb->free = ADDR_NOT_EXIST;
+	fsm_add_maps(f, hb);
+	if (ftruncate(t->bm.fd, hb->num_page * BLOCK_SIZE) != 0)
+		panic("fsm_open");
+	release_page(t, hp);
+}
+
+/* Write the changed map pages of a table
+ */
+void fsm_save(table *t){
+	fsm *f = &t->fs;
+	uint64_t i;
+
+	for (i = 0; i < f->num_map; i++){
+		if (f->dirty[i]){
+			write_block_raw(t, f->bits + i * FSM_WORDS, f->map[i]);
+			f->dirty[i] = false;
+		}
+	}
+}
+
+void fsm_close(table *t){
+	free(t->fs.mem);
+	memset(&t->fs, 0, sizeof(fsm));
+}
+
+/* Add the pages from the end of the file to num_page to the maps,
+ * free. The header pinned by the caller gets the new size, which may
+ * be larger for new map pages.
+ */
+void fsm_grow(table *t, hpage *hp, uint64_t num_page){
+	fsm_resize(&t->fs, num_page);
+	fsm_add_maps(&t->fs, B(hp));
+}
+
+/* After a defragmentation, the pages below num_page are all in use
+ * and the others are gone. The maps go after them.
+ */
+void fsm_reset(table *t, hpage *hp, uint64_t num_page){
+	fsm *f = &t->fs;
+
+	memset(f->bits, 0, f->cap * BLOCK_SIZE);
+	f->num_map = 0;
+	f->low = 1;
+	fsm_resize(f, num_page);
+	fsm_set(f, 0, num_page, true);
+	fsm_add_maps(f, B(hp));
+}
+
+/* Take n contiguous free pages, from the lowest run,
+ * extending the file if there is none. Returns the first.
+ */
+addr fsm_alloc_run(table *t, int n){
+	fsm *f = &t->fs;
+	hpage *hp;
+	uint64_t pn;
+
+	while ((pn = fsm_find(f, f->low, f->num_page, n)) == 0){
+		hp = get_hpage(t);
+		set_dirty(hp);
+		extend_file(t, hp);
+		release_page(t, hp);
+	}
+	fsm_set(f, pn, n, true);
+	if (pn == f->low)
+		f->low = pn + n;
+	return pn * BLOCK_SIZE;
+}
+
+/* Take a free page among the FSM_NEAR_PAGES after near,
+ * or else the lowest one
+ */
+addr fsm_alloc_near(table *t, addr near){
+	fsm *f = &t->fs;
+	uint64_t from = near / BLOCK_SIZE + 1, to, pn;
+
+	if (near != ADDR_NOT_EXIST){
+		to = from + FSM_NEAR_PAGES < f->num_page ?
+			from + FSM_NEAR_PAGES : f->num_page;
+		if ((pn = fsm_find(f, from, to, 1)) != 0){
+			fsm_set(f, pn, 1, true);
+			return pn * BLOCK_SIZE;
+		}
+	}
+	return fsm_alloc_run(t, 1);
+}
+
+void fsm_free(table *t, addr ad){
+	fsm *f = &t->fs;
+
+	fsm_set(f, ad / BLOCK_SIZE, 1, false);
+	if (ad / BLOCK_SIZE < f->low)
+		f->low = ad / BLOCK_SIZE;
+}
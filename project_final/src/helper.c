@@ -5,7 +5,7 @@
  * if the verbose flag is set.
  * Returns the leaf containing the given key.
  */
-npage *find_leaf(table *t, const int64_t k) {
+npage *find_leaf(table *t, const bkey_t k) {
 	hpage *hp = get_hpage(t);
 	npage *np;
 	npage *next_np;
@@ -21,11 +21,7 @@ npage *find_leaf(table *t, const int64_t k) {
 	np = get_root(t);
 	nb = B(np);
 	while (!nb->is_leaf) {
-		i = 0;
-		while (i < nb->num_keys) {
-			if (k >= nb->i_children[i].k) i++;
-			else break;
-		}
+		i = node_find_child(nb, k);
 		next_np = get_child(t, np, i);
 		release_page(t, np);
 		np = next_np;
@@ -34,91 +30,202 @@ npage *find_leaf(table *t, const int64_t k) {
 	return np;
 }
 
-int find_rec(table *t, npage *np, const int64_t k){
+int find_rec(table *t, npage *np, const bkey_t k){
 	nblock *nb = B(np);
-	int i;
-	for (i = 0; i < nb->num_keys; i++){
-		if (nb->l_recs[i].k == k) return i;
-	}
+	int i = leaf_lower_bound(nb, k);
+	if (i < nb->num_keys && KEY_EQ(nb->l_slots[i].k, k))
+		return i;
 	return -1;
 }
 
+/* Finds the record to which a key refers.
+ * The value is cut at VALUE_SIZE bytes and padded with zeros.
+ */
+int find_low(table *t, const bkey_t k, record *r){
+	npage *np;
+	uint32_t len;
+	int idx;
 
-int find_and_modify_rec(table *t, npage *np, const int64_t k, record *r){
-	nblock *nb = B(np);
-	int i;
-	for (i = 0; i < nb->num_keys; i++){
-		if (nb->l_recs[i].k == k){
-      strcpy(nb->l_recs[i].v, r->v);
-      return i;
-    }
+#ifdef BLOOM_FILTER
+	if (!bloom_may_contain(t, k))
+		return E_NOT_FOUND;
+#endif
+	if (rcache_get(t->table_id, k, r->v, &len)){
+		r->k = k;
+		return E_OK;
 	}
-	return -1;
-}
-
+	if ((np = find_leaf(t, k)) == NULL)
+		return E_NOT_FOUND;
 
+	idx = find_rec(t, np, k);
+	if (idx == -1){
+		release_page(t, np);
+		return E_NOT_FOUND;
+	}
+	memset(r, 0, sizeof(record));
+	r->k = k;
+	len = leaf_read_value(t, B(np), idx, r->v, VALUE_SIZE);
+	release_page(t, np);
+	rcache_put(t->table_id, k, r->v, len);
+	return E_OK;
+}
 
-/* Finds and returns the record to which
- * a key refers.
+/* Finds a value of any length.
+ * Up to size bytes are copied to buf, and len gets the whole length.
  */
-int find_low(table *t, const int64_t k, record *r){
-	hpage *hp = get_hpage(t);
-	hblock *hb = B(hp);
+int find_value_low(table *t, const bkey_t k, void *buf, uint32_t size,
+		uint32_t *len){
+	char v[VALUE_SIZE];
 	npage *np;
-	nblock *nb;
 	int idx;
 
-	if (hb->root == ADDR_NOT_EXIST){
-		release_page(t, hp);
+#ifdef BLOOM_FILTER
+	if (!bloom_may_contain(t, k))
 		return E_NOT_FOUND;
+#endif
+	if (rcache_get(t->table_id, k, v, len)){
+		memcpy(buf, v, *len < size ? *len : size);
+		return E_OK;
 	}
-	release_page(t, hp);
 	if ((np = find_leaf(t, k)) == NULL)
-		panic("find"); 
+		return E_NOT_FOUND;
 
-	nb = B(np);
-	
 	idx = find_rec(t, np, k);
 	if (idx == -1){
 		release_page(t, np);
 		return E_NOT_FOUND;
 	}
-	memcpy(r, &nb->l_recs[idx], sizeof(record));
+	*len = leaf_read_value(t, B(np), idx, buf, size);
 	release_page(t, np);
+	if (*len <= size)
+		rcache_put(t->table_id, k, buf, *len);
 	return E_OK;
 }
 
-/* Updates and returns the record to which
- * a key refers.
+/* Makes a nonzero lsn the page_lsn of the leaf k belongs in,
+ * so that the leaf is not written before the log up to lsn
  */
-int update_low(table *t, const int64_t k, record *r){
-	hpage *hp = get_hpage(t);
-	hblock *hb = B(hp);
+static void stamp_leaf(table *t, const bkey_t k, int64_t lsn){
+	npage *np;
+
+	if (lsn == 0 || (np = find_leaf(t, k)) == NULL)
+		return;
+	set_dirty(np);
+	if (lsn > B(np)->page_lsn)
+		B(np)->page_lsn = lsn;
+	release_page(t, np);
+}
+
+/* Replaces the value of a record without logging it.
+ * The value is rewritten in its leaf when it fits there, otherwise
+ * the record is deleted and inserted again, which may split a leaf.
+ * A nonzero lsn becomes the page_lsn of the leaf holding the record.
+ */
+int set_value_low(table *t, const bkey_t k, const char *v, uint32_t len,
+		int64_t lsn){
+	DEC_RET;
 	npage *np;
 	nblock *nb;
 	int idx;
 
-	if (hb->root == ADDR_NOT_EXIST){
-		release_page(t, hp);
-		return E_NOT_FOUND;
-	}
-	release_page(t, hp);
+	rcache_drop(t->table_id, k);
 	if ((np = find_leaf(t, k)) == NULL)
-		panic("find"); 
-
-  set_dirty(np);
+		return E_NOT_FOUND;
 	nb = B(np);
-	
-	idx = find_and_modify_rec(t, np, k, r);
-	if (idx == -1){
+	if ((idx = find_rec(t, np, k)) == -1){
 		release_page(t, np);
 		return E_NOT_FOUND;
 	}
-	memcpy(r, &nb->l_recs[idx], sizeof(record));
+
+	if (len <= LEAF_INLINE_MAX && leaf_overflow(nb, idx) == ADDR_NOT_EXIST &&
+			leaf_used(nb) - nb->l_slots[idx].len + len <= LEAF_AREA){
+		set_dirty(np);
+		leaf_remove(nb, idx);
+		leaf_put(nb, idx, k, v, len, len);
+		if (lsn > nb->page_lsn)
+			nb->page_lsn = lsn;
+		release_page(t, np);
+		return E_OK;
+	}
 	release_page(t, np);
+
+	RET(delete_low(t, k));
+	RET(insert_low(t, k, v, len));
+	stamp_leaf(t, k, lsn);
+	return E_OK;
+}
+
+/* Inserts a record without logging it, and adds it to the indexes
+ * and the bloom filter. The undo of a delete uses it too.
+ * A nonzero lsn, of the insert logged before, becomes the page_lsn
+ * of the leaf holding the record.
+ */
+int insert_record_low(table *t, bkey_t k, const char *v, uint32_t len,
+		int64_t lsn){
+	DEC_RET;
+	RET(insert_low(t, k, v, len));
+	stamp_leaf(t, k, lsn);
+	index_update_low(t, k, NULL, 0, v, len);
+#ifdef BLOOM_FILTER
+	bloom_add(t, k);
+#endif
 	return E_OK;
 }
 
+/* Deletes a record without logging it, and removes it from the
+ * indexes and the bloom filter. The undo of an insert uses it too.
+ * A nonzero lsn, of the delete logged before, becomes the page_lsn
+ * of the leaf the record was removed from, or merged into.
+ */
+int delete_record_low(table *t, bkey_t k, int64_t lsn){
+	DEC_RET;
+	index_set_low(t, k, NULL, 0);
+	RET(delete_low(t, k));
+	stamp_leaf(t, k, lsn);
+#ifdef BLOOM_FILTER
+	bloom_remove(t, k);
+#endif
+	return E_OK;
+}
+
+/* Updates the record to which a key refers.
+ * The old and new values are logged in VALUE_SIZE images,
+ * so a value longer than that cannot be updated.
+ */
+int update_low(table *t, const bkey_t k, record *r){
+	char old_image[VALUE_SIZE];
+	npage *np;
+	int64_t lsn;
+	uint32_t len;
+	int idx;
+
+#ifdef BLOOM_FILTER
+	if (!bloom_may_contain(t, k))
+		return E_NOT_FOUND;
+#endif
+	if ((np = find_leaf(t, k)) == NULL)
+		return E_NOT_FOUND;
+	if ((idx = find_rec(t, np, k)) == -1){
+		release_page(t, np);
+		return E_NOT_FOUND;
+	}
+	if (B(np)->l_slots[idx].vlen > VALUE_SIZE){
+		release_page(t, np);
+		return E_TOO_LONG;
+	}
+	memset(old_image, 0, VALUE_SIZE);
+	leaf_read_value(t, B(np), idx, old_image, VALUE_SIZE);
+	lsn = log_update(t->table_id, k, np->offset,
+			(char*)B(np)->l_data + B(np)->l_slots[idx].off - (char*)B(np),
+			old_image, r->v);
+	len = B(np)->l_slots[idx].vlen;
+	release_page(t, np);
+
+	mvcc_push(t->table_id, k, old_image);
+	index_update_low(t, k, old_image, len, r->v, strnlen(r->v, VALUE_SIZE));
+	return set_value_low(t, k, r->v, strnlen(r->v, VALUE_SIZE), lsn);
+}
+
 
 
 /* Prints the B+ tree in the command
@@ -153,8 +260,10 @@ void print_tree(table *t) {
 		}
 		np = queue[head++];
 		if (B(np)->is_leaf){
-			for (i = 0; i < B(np)->num_keys; i++)
-				printf("%ld ",B(np)->l_recs[i].k);
+			for (i = 0; i < B(np)->num_keys; i++){
+				print_key(B(np)->l_slots[i].k);
+				printf(" ");
+			}
 		}
 		else{
 			queue[tail] = get_child(t, np, 0);
@@ -163,7 +272,8 @@ void print_tree(table *t) {
 
 			depth[tail++] = last_depth + 1;
 			for (i = 0; i < B(np)->num_keys; i++){
-				printf("%ld ",B(np)->i_children[i].k);
+				print_key(node_key(B(np), i));
+				printf(" ");
 #ifdef DEBUG_TREE
 				fflush(stdout);
 #endif
@@ -182,6 +292,41 @@ void print_tree(table *t) {
 	free(depth);
 }
 
+#ifdef ORDER_STATISTIC
+/* Records in the subtree of a node
+ */
+uint64_t node_count(npage *np){
+	nblock *nb = B(np);
+	uint64_t cnt;
+	int i;
+
+	if (nb->is_leaf)
+		return nb->num_keys;
+	cnt = 0;
+	for (i = 0; i <= nb->num_keys; i++)
+		cnt += get_child_count(np, i);
+	return cnt;
+}
+
+/* Add delta to the counts on the path from a leaf up to the root
+ */
+void add_path_count(table *t, npage *leaf, int64_t delta){
+	npage *np = leaf, *parent;
+	int idx;
+
+	while ((parent = get_parent(t, np)) != NULL){
+		idx = get_left_index(parent, np);
+		set_dirty(parent);
+		set_child_count(parent, idx, get_child_count(parent, idx) + delta);
+		if (np != leaf)
+			release_page(t, np);
+		np = parent;
+	}
+	if (np != leaf)
+		release_page(t, np);
+}
+#endif
+
 /* Finds the appropriate place to
  * split a node that is too big into two.
  */
@@ -212,20 +357,11 @@ npage *get_root(table *t){
 /* Get a child page from the parent page
  */
 npage *get_child(table *t, npage *np, int idx){
-	nblock *nb = B(np);
-	if (idx == 0){
-		if (nb->i_leftmost == ADDR_NOT_EXIST)
-			return NULL;
-
-		return get_npage(t, nb->i_leftmost);
-	}
-	else{
-		idx--;
-		if (nb->i_children[idx].v == ADDR_NOT_EXIST)
-			return NULL;
+	addr ad = node_child(B(np), idx);
+	if (ad == ADDR_NOT_EXIST)
+		return NULL;
 
-		return get_npage(t, nb->i_children[idx].v);
-	}
+	return get_npage(t, ad);
 }
 
 /* Get the parent page from the child page
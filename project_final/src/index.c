@@ -0,0 +1,354 @@
+#include "bptree.h"
+
+/* Secondary indexes.
+ * An index is a tree in a table slot of its own, mapping an attribute
+ * extracted from the values to the array of primary keys having it,
+ * sorted. Keys are of a fixed size, so an attribute and a primary key
+ * cannot make one key; the array is a value of any length instead,
+ * rewritten when it changes, so an attribute shared by many records
+ * makes their writes slower.
+ * create_index() builds an index by bulk loading a scan of the table,
+ * and insert, update, delete and the undo of an abort keep it up to
+ * date. Indexes are not persistent: their files go with the table.
+ */
+
+typedef struct ipair{
+	bkey_t a;
+	bkey_t k;
+} ipair;
+
+static int ipair_cmp(const void *x, const void *y){
+	const ipair *p = x, *q = y;
+	int r = KEY_CMP(p->a, q->a);
+	return r != 0 ? r : KEY_CMP(p->k, q->k);
+}
+
+static int bkey_cmp(const void *x, const void *y){
+	return KEY_CMP(*(const bkey_t *)x, *(const bkey_t *)y);
+}
+
+static table *index_table(table *t, int index_id){
+	return &t->c->tbls[t->index[index_id].table_id];
+}
+
+/* Whole value of a key in a new buffer, NULL if there is none
+ */
+static char *read_value(table *t, bkey_t k, uint32_t *len){
+	char *buf, c;
+
+	if (find_value_low(t, k, &c, 0, len) != E_OK)
+		return NULL;
+	buf = malloc(*len + 1);
+	find_value_low(t, k, buf, *len, len);
+	return buf;
+}
+
+/* Add k to the keys of attribute a
+ */
+static void posting_add(table *it, bkey_t a, bkey_t k){
+	bkey_t *ks;
+	uint32_t len;
+	int n, lo = 0, hi, mid;
+
+	if ((ks = (bkey_t *)read_value(it, a, &len)) == NULL){
+		insert_low(it, a, (const char *)&k, sizeof(bkey_t));
+		return;
+	}
+	n = len / sizeof(bkey_t);
+	for (hi = n; lo < hi; ){
+		mid = (lo + hi) / 2;
+		if (KEY_LT(ks[mid], k))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == n || !KEY_EQ(ks[lo], k)){
+		ks = realloc(ks, len + sizeof(bkey_t));
+		memmove(ks + lo + 1, ks + lo, (n - lo) * sizeof(bkey_t));
+		ks[lo] = k;
+		set_value_low(it, a, (const char *)ks, len + sizeof(bkey_t), 0);
+	}
+	free(ks);
+}
+
+/* Remove k from the keys of attribute a, and a with its last key
+ */
+static void posting_remove(table *it, bkey_t a, bkey_t k){
+	bkey_t *ks, *p;
+	uint32_t len;
+	int n;
+
+	if ((ks = (bkey_t *)read_value(it, a, &len)) == NULL)
+		return;
+	n = len / sizeof(bkey_t);
+	p = bsearch(&k, ks, n, sizeof(bkey_t), bkey_cmp);
+	if (p != NULL && n == 1)
+		delete_low(it, a);
+	else if (p != NULL){
+		memmove(p, p + 1, (ks + n - p - 1) * sizeof(bkey_t));
+		set_value_low(it, a, (const char *)ks, len - sizeof(bkey_t), 0);
+	}
+	free(ks);
+}
+
+/* Build an index of the attribute extract() takes from the values,
+ * from a scan of the leaves. Returns the index id.
+ */
+int create_index_low(table *t, key_extractor extract){
+	npage *np;
+	nblock *nb;
+	ipair *pairs = NULL;
+	bkey_t *keys, *pks;
+	const char **values;
+	uint32_t *lens, size = VALUE_SIZE;
+	char path[sizeof(t->path) + 16], *v = malloc(size);
+	int64_t n = 0, cap = 0, g = 0, i, j;
+	addr sib;
+	int tid;
+
+	if (t->num_index == MAX_INDEX)
+		return E_FULL_TABLE;
+	snprintf(path, sizeof(path), "%s.idx%d", t->path, t->num_index);
+	if ((tid = open_temp_table_low(t->c, path)) < 0)
+		return E_FULL_TABLE;
+
+	for (np = find_leaf(t, key_min()); np != NULL; ){
+		nb = B(np);
+		for (i = 0; i < nb->num_keys; i++){
+			if (nb->l_slots[i].vlen > size){
+				size = nb->l_slots[i].vlen;
+				v = realloc(v, size);
+			}
+			if (n == cap){
+				cap = cap ? cap * 2 : 1024;
+				pairs = realloc(pairs, cap * sizeof(ipair));
+			}
+			leaf_read_value(t, nb, i, v, size);
+			pairs[n].a = extract(v, nb->l_slots[i].vlen);
+			pairs[n++].k = nb->l_slots[i].k;
+		}
+		sib = nb->l_sib;
+		release_page(t, np);
+		np = sib == ADDR_NOT_EXIST ? NULL : get_npage(t, sib);
+	}
+	free(v);
+
+	// Group the sorted pairs into one record per attribute
+	qsort(pairs, n, sizeof(ipair), ipair_cmp);
+	keys = malloc((n + 1) * sizeof(bkey_t));
+	pks = malloc((n + 1) * sizeof(bkey_t));
+	values = malloc((n + 1) * sizeof(char *));
+	lens = malloc((n + 1) * sizeof(uint32_t));
+	for (i = 0; i < n; i = j){
+		for (j = i; j < n && KEY_EQ(pairs[j].a, pairs[i].a); j++)
+			pks[j] = pairs[j].k;
+		keys[g] = pairs[i].a;
+		values[g] = (const char *)(pks + i);
+		lens[g++] = (j - i) * sizeof(bkey_t);
+	}
+	bulk_load_low(&t->c->tbls[tid], g, keys, values, lens);
+	free(pairs);
+	free(keys);
+	free(pks);
+	free(values);
+	free(lens);
+
+	t->index[t->num_index].table_id = tid;
+	t->index[t->num_index].extract = extract;
+	return t->num_index++;
+}
+
+/* Move the index entries of k from the attributes of its old value
+ * to those of its new one. A NULL value is no record.
+ */
+void index_update_low(table *t, bkey_t k, const char *old_v,
+		uint32_t old_len, const char *new_v, uint32_t new_len){
+	bkey_t a_old, a_new;
+	int i;
+
+	for (i = 0; i < t->num_index; i++){
+		if (old_v != NULL)
+			a_old = t->index[i].extract(old_v, old_len);
+		if (new_v != NULL)
+			a_new = t->index[i].extract(new_v, new_len);
+		if (old_v != NULL && new_v != NULL && KEY_EQ(a_old, a_new))
+			continue;
+		if (old_v != NULL)
+			posting_remove(index_table(t, i), a_old, k);
+		if (new_v != NULL)
+			posting_add(index_table(t, i), a_new, k);
+	}
+}
+
+/* Like index_update_low() from the value k has now,
+ * before it is set to v
+ */
+void index_set_low(table *t, bkey_t k, const char *v, uint32_t len){
+	char *old_v;
+	uint32_t old_len;
+
+	if (t->num_index == 0)
+		return;
+	old_v = read_value(t, k, &old_len);
+	index_update_low(t, k, old_v, old_len, v, len);
+	free(old_v);
+}
+
+/* Whether the attribute of index index_id in a value is in [lo, hi]
+ */
+static bool attr_in(table *t, int index_id, const char *v, uint32_t len,
+		bkey_t lo, bkey_t hi){
+	bkey_t a = t->index[index_id].extract(v, len);
+	return !KEY_LT(a, lo) && !KEY_LT(hi, a);
+}
+
+/* Fetch the records of n primary keys, sorted here, and pass them to fn.
+ * Neighbouring keys are found in the leaf of the one before them.
+ * A read view gets the values of its snapshot, and skips those which
+ * it does not see or which are out of [lo, hi].
+ */
+static int index_fetch(table *t, int index_id, bkey_t *ks, int n,
+		bkey_t lo, bkey_t hi, trx_t *view, index_cb fn, void *arg){
+	npage *np = NULL;
+	nblock *nb;
+	record r;
+	bool found;
+	int i, idx, ret = 0;
+
+	qsort(ks, n, sizeof(bkey_t), bkey_cmp);
+	for (i = 0; i < n && ret == 0; i++){
+		if (np != NULL && (B(np)->num_keys == 0 ||
+					KEY_LT(B(np)->l_slots[B(np)->num_keys - 1].k, ks[i]))){
+			release_page(t, np);
+			np = NULL;
+		}
+		if (np == NULL && (np = find_leaf(t, ks[i])) == NULL)
+			break;
+		nb = B(np);
+		idx = leaf_lower_bound(nb, ks[i]);
+		if (idx == nb->num_keys || !KEY_EQ(nb->l_slots[idx].k, ks[i]))
+			continue;
+
+		memset(&r, 0, sizeof(record));
+		r.k = ks[i];
+		leaf_read_value(t, nb, idx, r.v, VALUE_SIZE);
+		if (view != NULL){
+			found = true;
+			mvcc_read(view, t->table_id, r.k, r.v, &found);
+			if (!found || !attr_in(t, index_id, r.v, strnlen(r.v, VALUE_SIZE),
+						lo, hi))
+				continue;
+		}
+		ret = fn(&r, arg);
+	}
+	if (np != NULL)
+		release_page(t, np);
+	return ret;
+}
+
+/* Pass to fn the records a read view sees in [lo, hi] which the index
+ * does not have there: those it sees with another value, or which
+ * were deleted since its snapshot.
+ */
+static int index_fetch_changed(table *t, int index_id, bkey_t lo,
+		bkey_t hi, trx_t *view, index_cb fn, void *arg){
+	record r;
+	bkey_t *ks;
+	char *v;
+	uint32_t len;
+	bool found, in_index;
+	int i, n, ret = 0;
+
+	n = mvcc_changed_keys(view, t->table_id, key_min(), key_max(), &ks);
+	for (i = 0; i < n && ret == 0; i++){
+		memset(&r, 0, sizeof(record));
+		r.k = ks[i];
+		v = read_value(t, ks[i], &len);
+		found = v != NULL;
+		in_index = found && attr_in(t, index_id, v, len, lo, hi);
+		if (found)
+			memcpy(r.v, v, len < VALUE_SIZE ? len : VALUE_SIZE);
+		free(v);
+		if (in_index || !mvcc_read(view, t->table_id, r.k, r.v, &found))
+			continue;
+		if (found &&
+				attr_in(t, index_id, r.v, strnlen(r.v, VALUE_SIZE), lo, hi))
+			ret = fn(&r, arg);
+	}
+	free(ks);
+	return ret;
+}
+
+/* Pass the records whose attribute is in [lo, hi] to fn, in batches
+ * of about INDEX_BATCH sorted by primary key, so the base leaves are
+ * read in order. Values are cut to VALUE_SIZE bytes. A read view gets
+ * the records only its snapshot has in the range after the others.
+ * Returns the first nonzero return of fn, which ends the scan.
+ */
+int index_scan_low(table *t, int index_id, bkey_t lo, bkey_t hi,
+		trx_t *view, index_cb fn, void *arg){
+	table *it;
+	npage *np;
+	nblock *nb;
+	bkey_t *batch;
+	addr sib;
+	int i, n = 0, cap = INDEX_BATCH, ret = 0;
+	uint32_t len;
+
+	if (index_id < 0 || index_id >= t->num_index)
+		return E_NOT_FOUND;
+	it = index_table(t, index_id);
+	if (KEY_LT(hi, lo) || (np = find_leaf(it, lo)) == NULL)
+		return E_OK;
+
+	batch = malloc(cap * sizeof(bkey_t));
+	for (i = leaf_lower_bound(B(np), lo); np != NULL && ret == 0; i = 0){
+		nb = B(np);
+		for (; i < nb->num_keys && !KEY_LT(hi, nb->l_slots[i].k); i++){
+			len = nb->l_slots[i].vlen;
+			if (n + len / sizeof(bkey_t) > (uint32_t)cap){
+				cap = n + len / sizeof(bkey_t) + INDEX_BATCH;
+				batch = realloc(batch, cap * sizeof(bkey_t));
+			}
+			leaf_read_value(it, nb, i, batch + n, len);
+			n += len / sizeof(bkey_t);
+			if (n >= INDEX_BATCH){
+				if ((ret = index_fetch(t, index_id, batch, n, lo, hi, view,
+								fn, arg)) != 0)
+					break;
+				n = 0;
+			}
+		}
+		if (ret != 0 || i < nb->num_keys){
+			release_page(it, np);
+			break;
+		}
+		sib = nb->l_sib;
+		release_page(it, np);
+		np = sib == ADDR_NOT_EXIST ? NULL : get_npage(it, sib);
+	}
+	if (ret == 0 && n > 0)
+		ret = index_fetch(t, index_id, batch, n, lo, hi, view, fn, arg);
+	free(batch);
+	if (ret == 0 && view != NULL)
+		ret = index_fetch_changed(t, index_id, lo, hi, view, fn, arg);
+	return ret;
+}
+
+/* Close the indexes of a table and remove their files
+ */
+void close_indexes(table *t){
+	char path[sizeof(t->path)];
+	table *it;
+	int i;
+
+	for (i = 0; i < t->num_index; i++){
+		it = index_table(t, i);
+		strcpy(path, it->path);
+		rcache_drop_table(it->table_id);
+		flush_page(it);
+		close_file(it);
+		unlink(path);
+	}
+	t->num_index = 0;
+}
@@ -2,33 +2,37 @@
 
 /* Creates a new general node, which can be adapted
  * to serve as either a leaf or an internal node.
+ * It goes close after the page at near if there is room.
  */
-npage *make_node(table *t){
+npage *make_node(table *t, addr near){
 	npage *np;
 	nblock *nb;
 
-	np = get_npage(t, alloc_block(t));
+	np = (npage *)new_page(t, fsm_alloc_near(t, near));
 	nb = B(np);
 
 	nb->is_leaf = false;
 	nb->num_keys = 0;
 	nb->parent = ADDR_NOT_EXIST;
 	nb->i_leftmost = ADDR_NOT_EXIST;
+	nb->i_narrow = false;
+	memset(&nb->i_prefix, 0, sizeof(bkey_t));
 	return np;
 }
 
 /* Creates a new leaf by creating a node
  * and then adapting it appropriately.
  */
-npage *make_leaf(table *t){
+npage *make_leaf(table *t, addr near){
 	npage *np;
 	nblock *nb;
 
-	np = make_node(t);
+	np = make_node(t, near);
 	nb = B(np);
 
 	nb->is_leaf = true;
 	nb->l_sib = ADDR_NOT_EXIST;
+	leaf_init(nb);
 
 	return np;
 }
@@ -52,32 +56,25 @@ void set_root(table *t, npage *np){
 /* Inserts a new pointer to a record and its corresponding
  * key into a leaf.
  */
-int insert_into_leaf(table *t, npage *leaf, const record *r){
+int insert_into_leaf(table *t, npage *leaf, bkey_t k, const void *payload,
+		uint16_t len, uint32_t vlen){
 	nblock *nb = B(leaf);
-	int i, j;
-
-	for (i = 0; i < nb->num_keys; i++){
-		if (r->k < nb->l_recs[i].k) break;
-	}
-	nb->num_keys++;
-	for (j = nb->num_keys-1; j > i; j--){
-		nb->l_recs[j] = nb->l_recs[j-1];
-	}
-	nb->l_recs[i] = *r;
+	leaf_put(nb, leaf_lower_bound(nb, k), k, payload, len, vlen);
 	return E_OK;
 }
 
 /* First insertion:
  * start a new tree.
  */
-int start_new_tree(table *t, record *r) {
+int start_new_tree(table *t, bkey_t k, const void *payload,
+		uint16_t len, uint32_t vlen) {
 	hpage *hp = get_hpage(t);
 	hblock *hb = B(hp);
 	npage *root;
 	set_dirty(hp);
-	root = make_leaf(t);
+	root = make_leaf(t, ADDR_NOT_EXIST);
 	set_dirty(root);
-	insert_into_leaf(t, root, r);
+	insert_into_leaf(t, root, k, payload, len, vlen);
 	B(root)->parent = ADDR_NOT_EXIST;
 	hb->root = root->offset;
 
@@ -90,14 +87,20 @@ int start_new_tree(table *t, record *r) {
  * and inserts the appropriate key into
  * the new root.
  */
-int insert_into_new_root(table *t, npage *left, int64_t k, npage *right) {
-	npage *root = make_node(t);
+int insert_into_new_root(table *t, npage *left, bkey_t k, npage *right) {
+	npage *root = make_node(t, ADDR_NOT_EXIST);
 	nblock *nb = B(root);
+	wnode w;
 	set_dirty(root);
-	nb->i_children[0].k = k;
-	nb->i_leftmost = left->offset;
-	nb->i_children[0].v = right->offset;
-	nb->num_keys++;
+	w.num_keys = 1;
+	w.children[0].k = k;
+	w.leftmost = left->offset;
+	w.children[0].v = right->offset;
+#ifdef ORDER_STATISTIC
+	w.leftmost_cnt = node_count(left);
+	w.children[0].cnt = node_count(right);
+#endif
+	node_store(nb, &w);
 	nb->parent = ADDR_NOT_EXIST;
 	B(left)->parent = root->offset;
 	B(right)->parent = root->offset;
@@ -118,7 +121,7 @@ int get_left_index(npage *parent, npage *left) {
 		return 0;
 
 	while (left_index < B(parent)->num_keys && 
-			B(parent)->i_children[left_index].v != left->offset)
+			node_child(B(parent), left_index + 1) != left->offset)
 		left_index++;
 
 	if (left_index >= B(parent)->num_keys)
@@ -127,21 +130,32 @@ int get_left_index(npage *parent, npage *left) {
 	return left_index+1;
 }
 
+/* Puts a new key and pointer to a node
+ * into a decoded node after left_index.
+ */
+static void wnode_insert(wnode *w, int left_index, bkey_t k, npage *right){
+	memmove(&w->children[left_index + 1], &w->children[left_index],
+			(w->num_keys - left_index) * sizeof(child));
+	w->children[left_index].k = k;
+	w->children[left_index].v = right->offset;
+#ifdef ORDER_STATISTIC
+	w->children[left_index].cnt = node_count(right);
+#endif
+	w->num_keys++;
+}
+
 /* Inserts a new key and pointer to a node
  * into a node into which these can fit
  * without violating the B+ tree properties.
  */
 int insert_into_node(table *t, npage *np, 
-		int left_index, int64_t k, npage *right) {
+		int left_index, bkey_t k, npage *right) {
 	nblock *nb = B(np);
-	int i;
+	wnode w;
 
-	for (i = nb->num_keys; i > left_index; i--) {
-		nb->i_children[i] = nb->i_children[i-1];
-	}
-	nb->i_children[left_index].k = k;
-	nb->i_children[left_index].v = right->offset;
-	nb->num_keys++;
+	node_load(nb, &w);
+	wnode_insert(&w, left_index, k, right);
+	node_store(nb, &w);
 	B(right)->parent = np->offset;
 
 	return E_OK;
@@ -152,67 +166,56 @@ int insert_into_node(table *t, npage *np,
  * the order, and causing the node to split into two.
  */
 int insert_into_node_after_splitting(table *t, npage *np, int left_index, 
-		int64_t k, npage *right) {
+		bkey_t k, npage *right) {
 	DEC_RET;
 	nblock *nb = B(np);
-	npage *new_np;
+	npage *new_np, *tmp;
 	nblock *new_nb;
-	child temp_children[NUM_INT_KEY+1];
-	npage *temp_np[NUM_INT_KEY+1];
-	int insertion_index, split, i;
-	int64_t new_key;
+	wnode w, half;
+	int split, i, d;
+	bkey_t new_key;
 
-	new_np = make_node(t);
+	new_np = make_node(t, np->offset);
 	new_nb = B(new_np);
 	set_dirty(new_np);
 
-	insertion_index = 0;
-	split = cut(INT_ORDER);
+	//Put all key-link pairs in a decoded node including the new key-link pair
+	node_load(nb, &w);
+	wnode_insert(&w, left_index, k, right);
 
-	//Put all key-link pairs in temporary array including new key-link pair
-	while (insertion_index < nb->num_keys && nb->i_children[insertion_index].k < k){
-		temp_children[insertion_index] = nb->i_children[insertion_index];
-		temp_np[insertion_index] = get_child(t, np, insertion_index+1);
-		set_dirty(temp_np[insertion_index]);
-		insertion_index++;
-	}
-	temp_children[insertion_index].k = k;
-	temp_children[insertion_index].v = right->offset;
-	temp_np[insertion_index] = right;
-
-	for (i = insertion_index+1; i < INT_ORDER; i++){
-		temp_children[i] = nb->i_children[i-1];
-		temp_np[i] = get_child(t, np, i);
-		set_dirty(temp_np[i]);
-	}
-
-	new_key = temp_children[split-1].k;
-	new_nb->i_leftmost = temp_children[split-1].v;
-
-	B(temp_np[split-1])->parent = new_np->offset;
-	if (temp_np[split-1] != right){
-		release_page(t, temp_np[split-1]);
-	}
-
-	for (i = split; i <= nb->num_keys; i++){
-		new_nb->i_children[i - split] = temp_children[i];
-		B(temp_np[i])->parent = new_np->offset;
-		if (temp_np[i] != right){
-			release_page(t, temp_np[i]);
-		}
-		memset(&nb->i_children[i-1], 0, sizeof(child));
+	/* Split near the middle, where both halves fit their pages.
+	 * A half whose keys share a prefix may take more keys.
+	 */
+	for (d = 0; d < w.num_keys; d++){
+		split = cut(w.num_keys) + (d % 2 ? (d + 1) / 2 : -(d / 2));
+		if (split >= 1 && split <= w.num_keys &&
+				node_fits(w.children, split - 1) &&
+				node_fits(w.children + split, w.num_keys - split))
+			break;
 	}
-	new_nb->num_keys = i - split;
+	if (d == w.num_keys)
+		panic("insert_into_node_after_splitting");
+
+	new_key = w.children[split-1].k;
+	half.num_keys = w.num_keys - split;
+	half.leftmost = w.children[split-1].v;
+#ifdef ORDER_STATISTIC
+	half.leftmost_cnt = w.children[split-1].cnt;
+#endif
+	memcpy(half.children, w.children + split, half.num_keys * sizeof(child));
+	node_store(new_nb, &half);
+	w.num_keys = split - 1;
+	node_store(nb, &w);
+	new_nb->parent = nb->parent;
 
-	for (i = 0; i < split-1; i++){
-		nb->i_children[i] = temp_children[i];
-		B(temp_np[i])->parent = np->offset;
-		if (temp_np[i] != right){
-			release_page(t, temp_np[i]);
-		}
+	// The children of the new node point up to it, one page at a time
+	B(right)->parent = np->offset;
+	for (i = 0; i <= new_nb->num_keys; i++){
+		tmp = get_child(t, new_np, i);
+		set_dirty(tmp);
+		B(tmp)->parent = new_np->offset;
+		release_page(t, tmp);
 	}
-	nb->num_keys = i;
-	new_nb->parent = nb->parent;
 
 	ret = insert_into_parent(t, np, new_key, new_np);
 	release_page(t, new_np);
@@ -221,7 +224,7 @@ int insert_into_node_after_splitting(table *t, npage *np, int left_index,
 
 /* Inserts a new node (leaf or internal node) into the B+ tree.
  */
-int insert_into_parent(table *t, npage *left, int64_t k, npage *right) {
+int insert_into_parent(table *t, npage *left, bkey_t k, npage *right) {
 	DEC_RET;
 	int left_index;
 	npage *parent;
@@ -243,11 +246,14 @@ int insert_into_parent(table *t, npage *left, int64_t k, npage *right) {
 	 */
 
 	left_index = get_left_index(parent, left);
+#ifdef ORDER_STATISTIC
+	set_child_count(parent, left_index, node_count(left));
+#endif
 
 	/* Simple case: the new key fits into the node. 
 	 */
 
-	if (B(parent)->num_keys < INT_ORDER- 1){
+	if (node_has_room(B(parent), k)){
 		ret = insert_into_node(t, parent, left_index, k, right);
 		release_page(t, parent);
 		return ret;
@@ -264,54 +270,65 @@ int insert_into_parent(table *t, npage *left, int64_t k, npage *right) {
 
 /* Inserts a new key and pointer
  * to a new record into a leaf so as to exceed
- * the tree's order, causing the leaf to be split
- * in half.
+ * the page, causing the leaf to be split
+ * in half by bytes.
  */
-int insert_into_leaf_after_splitting(table *t, npage *np, record *r) {
+int insert_into_leaf_after_splitting(table *t, npage *np, bkey_t k,
+		const void *payload, uint16_t len, uint32_t vlen) {
 	DEC_RET;
 	nblock *nb = B(np);
 	npage *new_np;
 	nblock *new_nb;
-	record *temp_recs[NUM_LEAF_REC+1];
-	int insertion_index, split, i;
-	int64_t new_key;
-
-	new_np = make_leaf(t);
+	nblock old;
+	slot temp_slots[LEAF_AREA / sizeof(slot) + 1];
+	const uint8_t *temp_payloads[LEAF_AREA / sizeof(slot) + 1];
+	int insertion_index, split, num_recs, i, j;
+	uint32_t total, used;
+	bkey_t new_key;
+
+	new_np = make_leaf(t, np->offset);
 	new_nb = B(new_np);
 	set_dirty(new_np);
 
-	insertion_index = 0;
-	split = cut(LEAF_ORDER-1);
-
-	while (insertion_index < nb->num_keys && nb->l_recs[insertion_index].k < r->k){
-		temp_recs[insertion_index] = &nb->l_recs[insertion_index];
-		insertion_index++;
+	// Put all records in temporary arrays including the new record
+	memcpy(&old, nb, sizeof(nblock));
+	insertion_index = leaf_lower_bound(&old, k);
+	num_recs = old.num_keys + 1;
+	total = 0;
+	for (i = 0, j = 0; i < num_recs; i++){
+		if (i == insertion_index){
+			temp_slots[i].k = k;
+			temp_slots[i].vlen = vlen;
+			temp_slots[i].len = len;
+			temp_payloads[i] = payload;
+		}
+		else{
+			temp_slots[i] = old.l_slots[j];
+			temp_payloads[i] = old.l_data + old.l_slots[j].off;
+			j++;
+		}
+		total += sizeof(slot) + temp_slots[i].len;
 	}
-	temp_recs[insertion_index] = r;
 
-	for (i = insertion_index+1; i < LEAF_ORDER; i++){
-		temp_recs[i] = &nb->l_recs[i-1];
-	}
+	// The left half takes the first records making half of the bytes
+	used = 0;
+	for (split = 0; split < num_recs - 1 && used * 2 < total; split++)
+		used += sizeof(slot) + temp_slots[split].len;
+	if (split == 0)
+		split = 1;
 
-	new_key = temp_recs[split]->k;
+	// The shortest key between the halves goes up
+	new_key = shortest_separator(temp_slots[split-1].k, temp_slots[split].k);
 	new_nb->l_sib = nb->l_sib;
 	nb->l_sib = new_np->offset;
 
-	for (i = split; i <= nb->num_keys; i++){
-		new_nb->l_recs[i - split] = *temp_recs[i];
+	leaf_init(nb);
+	memset(nb->l_data, 0, LEAF_AREA);
+	for (i = 0; i < num_recs; i++){
+		leaf_put(i < split ? nb : new_nb, i < split ? i : i - split,
+				temp_slots[i].k, temp_payloads[i], temp_slots[i].len,
+				temp_slots[i].vlen);
 	}
-
-	new_nb->num_keys = i - split;
-
-	for (i = split-1; i >= 0; i--){
-		if (temp_recs[i] != &nb->l_recs[i])
-			nb->l_recs[i] = *temp_recs[i];
-	}
-
-	for (i = split; i < nb->num_keys; i++)
-		memset(&nb->l_recs[i], 0, sizeof(child));
-
-	nb->num_keys = split;
 	new_nb->parent = nb->parent;
 
 	ret = insert_into_parent(t, np, new_key, new_np);
@@ -325,18 +342,28 @@ int insert_into_leaf_after_splitting(table *t, npage *np, record *r) {
  * however necessary to maintain the B+ tree
  * properties.
  */
-int insert_low( table *t, record *r) {
+int insert_low(table *t, bkey_t k, const char *v, uint32_t len) {
 	DEC_RET;
 	hpage *hp;
 	record dup;
 	npage *leaf;
+	addr ovf;
+	const void *payload = v;
+	uint16_t plen = leaf_payload_len(len);
 
 	/* The current implementation ignores
 	 * duplicates.
 	 */
 
-	if (find_low(t, r->k, &dup) == E_OK)
+	if (find_low(t, k, &dup) == E_OK)
 		return E_DUP;
+	rcache_drop(t->table_id, k);
+
+	// A long value is written out first, and the leaf keeps its address
+	if (len > LEAF_INLINE_MAX){
+		ovf = write_overflow(t, v, len);
+		payload = &ovf;
+	}
 
 	/* Case: the tree does not exist yet.
 	 * Start a new tree.
@@ -345,7 +372,7 @@ int insert_low( table *t, record *r) {
 	hp = get_hpage(t);
 	if (B(hp)->root == ADDR_NOT_EXIST){
 		release_page(t, hp);
-		return start_new_tree(t, r);
+		return start_new_tree(t, k, payload, plen, len);
 	}
 	release_page(t, hp);
 
@@ -354,16 +381,19 @@ int insert_low( table *t, record *r) {
 	 * (Rest of function body.)
 	 */
 
-	if ((leaf = find_leaf(t, r->k)) == NULL)
+	if ((leaf = find_leaf(t, k)) == NULL)
 		panic("insert"); 
 
 	set_dirty(leaf);
+#ifdef ORDER_STATISTIC
+	add_path_count(t, leaf, 1);
+#endif
 
 	/* Case: leaf has room for key and pointer.
 	 */
 
-	if (B(leaf)->num_keys < LEAF_ORDER - 1) {
-		insert_into_leaf(t, leaf, r);
+	if (leaf_fits(B(leaf), plen)) {
+		insert_into_leaf(t, leaf, k, payload, plen, len);
 		release_page(t, leaf);
 		return E_OK;
 	}
@@ -371,8 +401,159 @@ int insert_low( table *t, record *r) {
 	/* Case:  leaf must be split.
 	 */
 
-	ret = insert_into_leaf_after_splitting(t, leaf, r);
+	ret = insert_into_leaf_after_splitting(t, leaf, k, payload, plen, len);
 	release_page(t, leaf);
 
 	return ret;
 }
+
+/* Builds one level of a bulk loaded tree over the m children in ents,
+ * whose keys separate each child from the one before it; the key of
+ * the first is not used. The children are grouped into nodes filled
+ * to BULK_FILL percent, and the last node takes keys from the one
+ * before it if it is underfull. The entries of the new nodes replace
+ * those of the children in ents, and their number is returned.
+ */
+static int bulk_load_level(table *t, child *ents, int m){
+	npage *np, *tmp;
+	wnode w;
+	int *starts = malloc((m + 1) * sizeof(int));
+	int s, e, g, i, j, split;
+	bkey_t k;
+
+	for (s = 0, g = 0; s < m; s = e){
+		for (e = s + 1; e < m &&
+				e - s <= node_capacity(ents + s + 1, e - s) * BULK_FILL / 100; e++)
+			;
+		starts[g++] = s;
+	}
+	starts[g] = m;
+
+	if (g > 1 && m - starts[g - 1] - 1 < cut(INT_ORDER) - 1){
+		s = starts[g - 2];
+		for (split = (s + m) / 2; split < starts[g - 1]; split++)
+			if (node_fits(ents + s + 1, split - s - 1) &&
+					node_fits(ents + split + 1, m - split - 1))
+				break;
+		starts[g - 1] = split;
+	}
+
+	for (i = 0; i < g; i++){
+		s = starts[i];
+		e = starts[i + 1];
+		np = make_node(t, i > 0 ? ents[i - 1].v : ADDR_NOT_EXIST);
+		set_dirty(np);
+		k = ents[s].k;
+		w.num_keys = e - s - 1;
+		w.leftmost = ents[s].v;
+#ifdef ORDER_STATISTIC
+		w.leftmost_cnt = ents[s].cnt;
+#endif
+		memcpy(w.children, ents + s + 1, w.num_keys * sizeof(child));
+		node_store(B(np), &w);
+
+		for (j = 0; j <= w.num_keys; j++){
+			tmp = get_child(t, np, j);
+			set_dirty(tmp);
+			B(tmp)->parent = np->offset;
+			release_page(t, tmp);
+		}
+
+		// i <= s, so the entries still to be grouped are kept
+		ents[i].k = k;
+		ents[i].v = np->offset;
+#ifdef ORDER_STATISTIC
+		ents[i].cnt = node_count(np);
+#endif
+		release_page(t, np);
+	}
+	free(starts);
+	return g;
+}
+
+/* Builds the tree of an empty table from n records sorted by their
+ * unique keys, bottom up. Leaves are filled to BULK_FILL percent
+ * and chained as they are written, then each level of internal
+ * nodes is built over the one below.
+ */
+int bulk_load_low(table *t, int n, const bkey_t *keys,
+		const char **values, const uint32_t *lens){
+	hpage *hp;
+	npage *leaf = NULL, *prev = NULL, *np;
+	nblock *nb;
+	child *ents;
+	addr ovf;
+	const void *payload;
+	uint16_t plen;
+	int i, m = 0;
+
+	hp = get_hpage(t);
+	if (B(hp)->root != ADDR_NOT_EXIST){
+		release_page(t, hp);
+		return E_DUP;
+	}
+	release_page(t, hp);
+	if (n == 0)
+		return E_OK;
+
+	ents = malloc(n * sizeof(child));
+	for (i = 0; i < n; i++){
+		plen = leaf_payload_len(lens[i]);
+		if (leaf == NULL || leaf_used(B(leaf)) + sizeof(slot) + plen >
+				LEAF_AREA * BULK_FILL / 100){
+			np = make_leaf(t, leaf != NULL ? leaf->offset : ADDR_NOT_EXIST);
+			set_dirty(np);
+			if (leaf != NULL){
+				nb = B(leaf);
+				nb->l_sib = np->offset;
+#ifdef ORDER_STATISTIC
+				ents[m - 1].cnt = nb->num_keys;
+#endif
+				if (prev != NULL)
+					release_page(t, prev);
+				prev = leaf;
+				ents[m].k = shortest_separator(nb->l_slots[nb->num_keys - 1].k,
+						keys[i]);
+			}
+			else
+				ents[m].k = keys[i];
+			ents[m++].v = np->offset;
+			leaf = np;
+		}
+
+		payload = values[i];
+		if (lens[i] > LEAF_INLINE_MAX){
+			ovf = write_overflow(t, values[i], lens[i]);
+			payload = &ovf;
+		}
+		leaf_put(B(leaf), B(leaf)->num_keys, keys[i], payload, plen, lens[i]);
+	}
+
+	// The last leaf takes records from the one before it if underfull
+	if (prev != NULL){
+		nb = B(prev);
+		while (leaf_used(B(leaf)) < LEAF_MIN_USED && nb->num_keys > 1)
+			leaf_move(B(leaf), 0, nb, nb->num_keys - 1);
+		ents[m - 1].k = shortest_separator(nb->l_slots[nb->num_keys - 1].k,
+				B(leaf)->l_slots[0].k);
+#ifdef ORDER_STATISTIC
+		ents[m - 2].cnt = B(prev)->num_keys;
+#endif
+		release_page(t, prev);
+	}
+#ifdef ORDER_STATISTIC
+	ents[m - 1].cnt = B(leaf)->num_keys;
+#endif
+	release_page(t, leaf);
+
+
+	while (m > 1)
+		m = bulk_load_level(t, ents, m);
+
+	hp = get_hpage(t);
+	set_dirty(hp);
+	B(hp)->root = ents[0].v;
+	release_page(t, hp);
+	free(ents);
+	return E_OK;
+}
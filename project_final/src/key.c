@@ -0,0 +1,177 @@
+#include "bptree.h"
+
+/* Keys.
+ * A key is encoded field by field into bytes whose memcmp order is
+ * the order of the fields, so a composite key sorts like a tuple
+ * and a range of leading fields is a key range. Integers are stored
+ * big-endian, signed ones with the sign bit flipped. Strings have
+ * each zero byte escaped as 0x00 0xff and end with 0x00 0x00.
+ * With BYTE_KEY the encoding padded with zeros is the key. Otherwise
+ * it is packed into an int64_t of the same order, so it has to fit
+ * in 8 bytes.
+ */
+
+#define SIGN_BIT (1ULL << 63)
+
+void key_enc_init(key_enc *e){
+	memset(e, 0, sizeof(key_enc));
+}
+
+static int key_put(key_enc *e, const uint8_t *b, int n){
+	if (e->len + n > KEY_SIZE)
+		return E_TOO_LONG;
+	memcpy(e->b + e->len, b, n);
+	e->len += n;
+	return E_OK;
+}
+
+/* Unsigned field of bytes bytes, 1 to 8
+ */
+int key_enc_uint(key_enc *e, uint64_t v, int bytes){
+	uint8_t b[8];
+	int i;
+
+	if (bytes < 8 && v >> (bytes * 8) != 0)
+		return E_TOO_LONG;
+	for (i = bytes - 1; i >= 0; i--, v >>= 8)
+		b[i] = v & 0xff;
+	return key_put(e, b, bytes);
+}
+
+/* Signed field of bytes bytes, 1 to 8
+ */
+int key_enc_int(key_enc *e, int64_t v, int bytes){
+	int64_t half = bytes < 8 ? (int64_t)1 << (bytes * 8 - 1) : 0;
+
+	if (bytes < 8 && (v < -half || v >= half))
+		return E_TOO_LONG;
+	if (bytes < 8)
+		return key_enc_uint(e, (uint64_t)(v + half), bytes);
+	return key_enc_uint(e, (uint64_t)v ^ SIGN_BIT, 8);
+}
+
+/* String field of len bytes
+ */
+int key_enc_str(key_enc *e, const char *s, uint32_t len){
+	static const uint8_t zero[2] = {0x00, 0xff}, end[2] = {0x00, 0x00};
+	uint32_t i;
+
+	for (i = 0; i < len; i++){
+		if (s[i] == 0){
+			if (key_put(e, zero, 2) != E_OK)
+				return E_TOO_LONG;
+		}
+		else if (key_put(e, (const uint8_t *)s + i, 1) != E_OK)
+			return E_TOO_LONG;
+	}
+	return key_put(e, end, 2);
+}
+
+int key_enc_done(const key_enc *e, bkey_t *k){
+#ifdef BYTE_KEY
+	memcpy(k->b, e->b, KEY_SIZE);
+#else
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < KEY_SIZE; i++)
+		v = v << 8 | e->b[i];
+	*k = (int64_t)(v ^ SIGN_BIT);
+#endif
+	return E_OK;
+}
+
+/* Encoded bytes of a key
+ */
+static void key_bytes(bkey_t k, uint8_t *b){
+#ifdef BYTE_KEY
+	memcpy(b, k.b, KEY_SIZE);
+#else
+	uint64_t v = (uint64_t)k ^ SIGN_BIT;
+	int i;
+
+	for (i = KEY_SIZE - 1; i >= 0; i--, v >>= 8)
+		b[i] = v & 0xff;
+#endif
+}
+
+/* Unsigned field of bytes bytes at byte off of a key
+ */
+uint64_t key_dec_uint(bkey_t k, int off, int bytes){
+	uint8_t b[KEY_SIZE];
+	uint64_t v = 0;
+	int i;
+
+	key_bytes(k, b);
+	for (i = off; i < off + bytes && i < KEY_SIZE; i++)
+		v = v << 8 | b[i];
+	return v;
+}
+
+int64_t key_dec_int(bkey_t k, int off, int bytes){
+	uint64_t v = key_dec_uint(k, off, bytes);
+
+	if (bytes < 8)
+		return (int64_t)v - ((int64_t)1 << (bytes * 8 - 1));
+	return (int64_t)(v ^ SIGN_BIT);
+}
+
+/* Key of a single int64_t field
+ */
+bkey_t key_int(int64_t v){
+#ifdef BYTE_KEY
+	key_enc e;
+	bkey_t k;
+
+	key_enc_init(&e);
+	key_enc_int(&e, v, 8);
+	key_enc_done(&e, &k);
+	return k;
+#else
+	return v;
+#endif
+}
+
+bkey_t key_min(void){
+#ifdef BYTE_KEY
+	bkey_t k;
+	memset(k.b, 0, KEY_SIZE);
+	return k;
+#else
+	return INT64_MIN;
+#endif
+}
+
+bkey_t key_max(void){
+#ifdef BYTE_KEY
+	bkey_t k;
+	memset(k.b, 0xff, KEY_SIZE);
+	return k;
+#else
+	return INT64_MAX;
+#endif
+}
+
+uint64_t key_hash(bkey_t k){
+#ifdef BYTE_KEY
+	uint64_t h = 0;
+	int i;
+
+	for (i = 0; i < KEY_SIZE; i++)
+		h = (h ^ k.b[i]) * 0x100000001b3ULL;
+	return h * 0x9e3779b97f4a7c15ULL;
+#else
+	return (uint64_t)k * 0x9e3779b97f4a7c15ULL;
+#endif
+}
+
+void print_key(bkey_t k){
+#ifdef BYTE_KEY
+	int i;
+
+	for (i = 0; i < KEY_SIZE; i++)
+		printf("%02x", k.b[i]);
+#else
+	printf("%ld", k);
+#endif
+}
@@ -0,0 +1,195 @@
+#include "bptree.h"
+
+/* Slotted leaf pages.
+ * The slot directory grows up from the start of l_data, sorted by key,
+ * and the payloads grow down from its end. A removed payload stays
+ * as a hole counted in dead_bytes until the leaf is compacted.
+ * Values longer than LEAF_INLINE_MAX live in a chain of overflow
+ * pages, and the payload is the address of the first one.
+ */
+
+/* Initialize an empty leaf
+ */
+void leaf_init(nblock *nb){
+	nb->num_keys = 0;
+	nb->data_off = LEAF_AREA;
+	nb->dead_bytes = 0;
+}
+
+/* Payload bytes of a value
+ */
+uint16_t leaf_payload_len(uint32_t vlen){
+	return vlen > LEAF_INLINE_MAX ? sizeof(addr) : vlen;
+}
+
+/* Bytes in use, holes excluded
+ */
+uint32_t leaf_used(nblock *nb){
+	return nb->num_keys * sizeof(slot) + LEAF_AREA - nb->data_off
+		- nb->dead_bytes;
+}
+
+/* Whether a record with a payload of len bytes fits,
+ * possibly after compaction
+ */
+bool leaf_fits(nblock *nb, uint16_t len){
+	return leaf_used(nb) + sizeof(slot) + len <= LEAF_AREA;
+}
+
+/* Index of the first slot whose key is not smaller than k
+ */
+int leaf_lower_bound(nblock *nb, bkey_t k){
+	int lo = 0, hi = nb->num_keys, mid;
+	while (lo < hi){
+		mid = (lo + hi) / 2;
+		if (KEY_LT(nb->l_slots[mid].k, k))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Pack the payloads at the end of l_data to merge the holes
+ */
+void leaf_compact(nblock *nb){
+	uint8_t tmp[LEAF_AREA];
+	uint16_t off = LEAF_AREA;
+	int i;
+
+	for (i = 0; i < nb->num_keys; i++){
+		off -= nb->l_slots[i].len;
+		memcpy(tmp + off, nb->l_data + nb->l_slots[i].off, nb->l_slots[i].len);
+		nb->l_slots[i].off = off;
+	}
+	memcpy(nb->l_data + off, tmp + off, LEAF_AREA - off);
+	nb->data_off = off;
+	nb->dead_bytes = 0;
+}
+
+/* Put a record at slot idx. The caller checks leaf_fits().
+ */
+void leaf_put(nblock *nb, int idx, bkey_t k, const void *payload,
+		uint16_t len, uint32_t vlen){
+	slot *s;
+
+	if (nb->data_off < len + (nb->num_keys + 1) * sizeof(slot))
+		leaf_compact(nb);
+
+	memmove(&nb->l_slots[idx + 1], &nb->l_slots[idx],
+			(nb->num_keys - idx) * sizeof(slot));
+	nb->data_off -= len;
+	memcpy(nb->l_data + nb->data_off, payload, len);
+
+	s = &nb->l_slots[idx];
+	s->k = k;
+	s->vlen = vlen;
+	s->off = nb->data_off;
+	s->len = len;
+	nb->num_keys++;
+}
+
+/* Take slot idx out of the leaf. Its overflow pages are kept.
+ */
+void leaf_remove(nblock *nb, int idx){
+	slot *s = &nb->l_slots[idx];
+
+	if (s->off == nb->data_off)
+		nb->data_off += s->len;
+	else
+		nb->dead_bytes += s->len;
+	memmove(s, s + 1, (nb->num_keys - idx - 1) * sizeof(slot));
+	nb->num_keys--;
+	memset(&nb->l_slots[nb->num_keys], 0, sizeof(slot));
+}
+
+/* Move slot si of src to slot di of dst
+ */
+void leaf_move(nblock *dst, int di, nblock *src, int si){
+	slot s = src->l_slots[si];
+	leaf_put(dst, di, s.k, src->l_data + s.off, s.len, s.vlen);
+	leaf_remove(src, si);
+}
+
+/* Write a long value to a new chain of overflow pages,
+ * on a run of contiguous pages
+ */
+addr write_overflow(table *t, const char *v, uint32_t len){
+	addr head = ADDR_NOT_EXIST, ad = ADDR_NOT_EXIST;
+	opage *op, *prev = NULL;
+	uint32_t n;
+
+	if (len > 0)
+		ad = fsm_alloc_run(t, (len + OVF_DATA_SIZE - 1) / OVF_DATA_SIZE);
+	for (; len > 0; ad += BLOCK_SIZE){
+		op = (opage *)new_page(t, ad);
+		n = len < OVF_DATA_SIZE ? len : OVF_DATA_SIZE;
+		memcpy(B(op)->data, v, n);
+		v += n;
+		len -= n;
+
+		if (prev == NULL)
+			head = ad;
+		else{
+			B(prev)->next = ad;
+			release_page(t, prev);
+		}
+		prev = op;
+	}
+	if (prev != NULL)
+		release_page(t, prev);
+	return head;
+}
+
+/* Free a chain of overflow pages
+ */
+void free_overflow(table *t, addr ad){
+	opage *op;
+
+	while (ad != ADDR_NOT_EXIST){
+		op = (opage *)get_page(t, ad);
+		ad = B(op)->next;
+		free_block(t, op);
+		release_page(t, op);
+	}
+}
+
+/* Copy up to size bytes of the value in slot idx to buf.
+ * Returns the length of the whole value.
+ */
+uint32_t leaf_read_value(table *t, nblock *nb, int idx, void *buf,
+		uint32_t size){
+	slot *s = &nb->l_slots[idx];
+	uint8_t *dst = buf;
+	opage *op;
+	addr ad;
+	uint32_t left, n;
+
+	left = s->vlen < size ? s->vlen : size;
+	if (s->vlen <= LEAF_INLINE_MAX){
+		memcpy(dst, nb->l_data + s->off, left);
+		return s->vlen;
+	}
+
+	memcpy(&ad, nb->l_data + s->off, sizeof(addr));
+	while (left > 0){
+		op = (opage *)get_page(t, ad);
+		n = left < OVF_DATA_SIZE ? left : OVF_DATA_SIZE;
+		memcpy(dst, B(op)->data, n);
+		ad = B(op)->next;
+		release_page(t, op);
+		dst += n;
+		left -= n;
+	}
+	return s->vlen;
+}
+
+/* Overflow chain of slot idx, or ADDR_NOT_EXIST for an inline value
+ */
+addr leaf_overflow(nblock *nb, int idx){
+	addr ad;
+	if (nb->l_slots[idx].vlen <= LEAF_INLINE_MAX)
+		return ADDR_NOT_EXIST;
+	memcpy(&ad, nb->l_data + nb->l_slots[idx].off, sizeof(addr));
+	return ad;
+}
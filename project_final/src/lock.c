@@ -0,0 +1,227 @@
+#include "bptree.h"
+
+/* Record locks keyed by (table_id, key).
+ * The lock table is split into partitions, each with its own mutex,
+ * so transactions on different records do not contend on one mutex.
+ * Deadlocks are prevented by wait-die: an older transaction may wait
+ * for a younger one, a younger one is killed instead of waiting.
+ */
+typedef struct lock_part{
+	pthread_mutex_t mutex;
+	lock_head *buckets[LOCK_BUCKET_NUM];
+} lock_part;
+
+static lock_part lock_table[LOCK_PARTITION_NUM];
+
+static uint64_t lock_hash(int table_id, bkey_t key){
+	uint64_t h = key_hash(key);
+	return h ^ (h >> 29) ^ (uint64_t)table_id;
+}
+
+static bool is_compatible(enum lock_mode a, enum lock_mode b){
+	return a == SHARED && b == SHARED;
+}
+
+/* Find the lock head of the record, creating it if needed
+ */
+static lock_head *get_lock_head(lock_part *part, uint64_t h, int table_id,
+		bkey_t key){
+	lock_head **bucket = &part->buckets[(h / LOCK_PARTITION_NUM) % LOCK_BUCKET_NUM];
+	lock_head *head;
+
+	for (head = *bucket; head != NULL; head = head->next){
+		if (head->table_id == table_id && KEY_EQ(head->key, key))
+			return head;
+	}
+
+	head = (lock_head*)calloc(1, sizeof(lock_head));
+	head->table_id = table_id;
+	head->key = key;
+	pthread_cond_init(&head->cond, NULL);
+	head->next = *bucket;
+	*bucket = head;
+	return head;
+}
+
+/* Unlink and free a lock head which has no request left
+ */
+static void put_lock_head(lock_part *part, lock_head *head){
+	uint64_t h = lock_hash(head->table_id, head->key);
+	lock_head **pp = &part->buckets[(h / LOCK_PARTITION_NUM) % LOCK_BUCKET_NUM];
+
+	while (*pp != head)
+		pp = &(*pp)->next;
+	*pp = head->next;
+	pthread_cond_destroy(&head->cond);
+	free(head);
+}
+
+/* True when req can be granted: no request of another transaction
+ * ahead of it conflicts. An upgrade only looks at granted requests.
+ */
+static bool can_grant(lock_req *req, bool upgrade){
+	lock_req *r;
+	for (r = req->head->queue; r != NULL; r = r->next){
+		if (r == req){
+			if (!upgrade)
+				break;
+			continue;
+		}
+		if (r->trx_id == req->trx_id)
+			continue;
+		if (upgrade && !r->granted)
+			continue;
+		if (!is_compatible(r->mode, req->mode))
+			return false;
+	}
+	return true;
+}
+
+/* Wait-die: req may wait only if it is older than every
+ * conflicting request ahead of it.
+ */
+static bool may_wait(lock_req *req, bool upgrade){
+	lock_req *r;
+	for (r = req->head->queue; r != NULL; r = r->next){
+		if (r == req){
+			if (!upgrade)
+				break;
+			continue;
+		}
+		if (r->trx_id == req->trx_id)
+			continue;
+		if (upgrade && !r->granted)
+			continue;
+		if (!is_compatible(r->mode, req->mode) && r->trx_id < req->trx_id)
+			return false;
+	}
+	return true;
+}
+
+static void remove_req(lock_req *req){
+	lock_req **pp = &req->head->queue;
+	while (*pp != req)
+		pp = &(*pp)->next;
+	*pp = req->next;
+}
+
+/* Acquire a lock on (table_id, key) for trx, waiting if needed.
+ * Locks are held until the transaction ends.
+ * Returns E_DEADLOCK when wait-die kills the transaction.
+ */
+int lock_acquire(trx_t *trx, int table_id, bkey_t key, enum lock_mode mode){
+	uint64_t h = lock_hash(table_id, key);
+	lock_part *part = &lock_table[h % LOCK_PARTITION_NUM];
+	lock_head *head;
+	lock_req *req, **tail;
+	bool upgrade = false;
+
+	pthread_mutex_lock(&part->mutex);
+	head = get_lock_head(part, h, table_id, key);
+
+	// Already held in a mode that is strong enough?
+	for (req = head->queue; req != NULL; req = req->next){
+		if (req->trx_id == trx->trx_id)
+			break;
+	}
+	if (req != NULL){
+		if (req->mode == EXCLUSIVE || mode == SHARED){
+			pthread_mutex_unlock(&part->mutex);
+			return E_OK;
+		}
+		// S -> X upgrade keeps its place in the queue
+		upgrade = true;
+		req->mode = EXCLUSIVE;
+	}
+	else{
+		req = (lock_req*)calloc(1, sizeof(lock_req));
+		req->trx_id = trx->trx_id;
+		req->mode = mode;
+		req->head = head;
+		for (tail = &head->queue; *tail != NULL; tail = &(*tail)->next);
+		*tail = req;
+	}
+
+	while (!can_grant(req, upgrade)){
+		if (!may_wait(req, upgrade)){
+			if (upgrade)
+				req->mode = SHARED;
+			else{
+				remove_req(req);
+				free(req);
+				if (head->queue == NULL)
+					put_lock_head(part, head);
+				else
+					pthread_cond_broadcast(&head->cond);
+			}
+			pthread_mutex_unlock(&part->mutex);
+			return E_DEADLOCK;
+		}
+		pthread_cond_wait(&head->cond, &part->mutex);
+	}
+
+	if (!upgrade){
+		req->granted = true;
+		req->trx_next = trx->locks;
+		trx->locks = req;
+	}
+	pthread_mutex_unlock(&part->mutex);
+	return E_OK;
+}
+
+/* Release every lock of trx and wake up the waiters
+ */
+void lock_release_all(trx_t *trx){
+	lock_req *req = trx->locks;
+	lock_req *next;
+	lock_head *head;
+	lock_part *part;
+
+	while (req != NULL){
+		next = req->trx_next;
+		head = req->head;
+		part = &lock_table[lock_hash(head->table_id, head->key) % LOCK_PARTITION_NUM];
+
+		pthread_mutex_lock(&part->mutex);
+		remove_req(req);
+		if (head->queue == NULL)
+			put_lock_head(part, head);
+		else
+			pthread_cond_broadcast(&head->cond);
+		pthread_mutex_unlock(&part->mutex);
+
+		free(req);
+		req = next;
+	}
+	trx->locks = NULL;
+}
+
+void init_lock_table(void){
+	int i;
+	memset(lock_table, 0, sizeof(lock_table));
+	for (i = 0; i < LOCK_PARTITION_NUM; i++)
+		pthread_mutex_init(&lock_table[i].mutex, NULL);
+}
+
+/* Free lock heads left behind and the partition mutexes
+ */
+void close_lock_table(void){
+	lock_head *head, *next;
+	lock_req *req, *rnext;
+	int i, j;
+	for (i = 0; i < LOCK_PARTITION_NUM; i++){
+		for (j = 0; j < LOCK_BUCKET_NUM; j++){
+			for (head = lock_table[i].buckets[j]; head != NULL; head = next){
+				next = head->next;
+				for (req = head->queue; req != NULL; req = rnext){
+					rnext = req->next;
+					free(req);
+				}
+				pthread_cond_destroy(&head->cond);
+				free(head);
+			}
+			lock_table[i].buckets[j] = NULL;
+		}
+		pthread_mutex_destroy(&lock_table[i].mutex);
+	}
+}
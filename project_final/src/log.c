@@ -1,154 +1,713 @@
 #include "bptree.h"
+#include "lz4.h"
+
+/* One write-ahead log is shared by every table of the connection.
+ * An LSN is the end offset of a record in the log stream, so 0 means
+ * "no record" and every record lives at [lsn - LOG_SIZE, lsn).
+ *
+ * The stream is stored in LOG_SEG_NUM preallocated segment files of
+ * LOG_SEG_SIZE bytes which are used round-robin. A byte at lsn is kept
+ * in segment (lsn / LOG_SEG_SIZE) % LOG_SEG_NUM. A segment is reused
+ * once a checkpoint has written every page that needs its records.
+ *
+ * With LOG_COMPRESSION each flush writes one LZ4-compressed frame
+ * instead, and positions in the segments no longer equal LSNs.
+ */
+#define LOG_SEG_PATH "./LOG_"
+#define LOG_CTL_PATH "./LOG_CTL"
+#define LOG_BUF_SIZE (BLOCK_SIZE * 5)
+#define LOG_CAPACITY ((int64_t)LOG_SEG_SIZE * LOG_SEG_NUM)
+
+typedef struct log_ctl{
+  int64_t checkpoint_lsn;
+  int64_t checkpoint_pos;
+  int32_t next_trx_id;
+} log_ctl;
+
+static conn *log_conn;
+static int log_seg_fd[LOG_SEG_NUM];
+static int log_ctl_fd = -1;
+static int8_t *log_buf_mem;
+static int8_t *log_buf; // aligned for O_DIRECT
+static int log_cur_idx;
+
+// LSN of log_buf[0]. It is always block aligned, because the last
+// partial block stays in the buffer and is rewritten by the next flush.
+static int64_t log_buf_start;
+
+static int64_t global_lsn;  // LSN of the last record
+static int64_t flushed_lsn; // log is durable up to here
+static int64_t checkpoint_lsn; // records before it are not needed
+static int64_t checkpoint_pos; // where checkpoint_lsn is in the segments
+
+static int32_t global_trx_id;
+static trx_t *active_trx;                 // running transactions
+static _Thread_local trx_t *cur_trx;      // transaction of this thread
 
-int log_fd[MAX_TABLE];
-int8_t *log_buf[MAX_TABLE];
-int log_buf_size;
-int log_cur_idx[MAX_TABLE]; // it will be used as a LSN.
+const int LOG_SIZE = sizeof(log_t);
 
-off_t global_lsn[MAX_TABLE];
+/* Read or write block-aligned bytes of the log stream,
+ * splitting the I/O at segment boundaries.
+ */
+static void log_pio(bool is_write, void *buf, int64_t len, int64_t lsn){
+  int64_t seg_off, n;
+  int fd, nr;
+
+  while (len > 0){
+    fd = log_seg_fd[(lsn / LOG_SEG_SIZE) % LOG_SEG_NUM];
+    seg_off = lsn % LOG_SEG_SIZE;
+    n = LOG_SEG_SIZE - seg_off;
+    if (n > len)
+      n = len;
+    if (is_write)
+      nr = pwrite(fd, buf, n, seg_off);
+    else
+      nr = pread(fd, buf, n, seg_off);
+    if (nr != n)
+      panic(is_write ? "log pwrite" : "log pread");
+    buf = (int8_t*)buf + n;
+    len -= n;
+    lsn += n;
+  }
+}
 
-const int LOG_SIZE = sizeof(log_t);
+/* Open a segment file, filling it with zeros when it is new.
+ * Later writes only overwrite allocated blocks, so O_DSYNC is
+ * enough and no file metadata is journaled on a log flush.
+ */
+static int open_log_segment(int n){
+  char path[32];
+  uint8_t *mem, *zero;
+  int64_t sz;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s%d", LOG_SEG_PATH, n);
+  fd = open(path, O_RDWR | O_CREAT | O_DIRECT | O_DSYNC, DEF_DB_MODE);
+  if (fd < 0)
+    panic("open_log_segment");
+
+  sz = lseek(fd, 0, SEEK_END);
+  if (sz < LOG_SEG_SIZE){
+    mem = (uint8_t*)calloc(1, BLOCK_SIZE * 65);
+    zero = (uint8_t*)ALIGN_UP((uintptr_t)mem, BLOCK_SIZE);
+    for (sz = ALIGN_DOWN(sz, BLOCK_SIZE); sz < LOG_SEG_SIZE;
+        sz += BLOCK_SIZE * 64){
+      if (pwrite(fd, zero, BLOCK_SIZE * 64, sz) != BLOCK_SIZE * 64)
+        panic("open_log_segment");
+    }
+    free(mem);
+  }
+  return fd;
+}
 
-int open_log_file(int table_id){
-  char log_file_name[10] = "./LOG";
-  log_file_name[5] = table_id + '0';
-  log_file_name[6] = '\0';
+static void read_log_ctl(log_ctl *ctl){
+  uint8_t mem[BLOCK_SIZE * 2];
+  uint8_t *blk = (uint8_t*)ALIGN_UP((uintptr_t)mem, BLOCK_SIZE);
 
-	int f = O_RDWR| O_CREAT | O_DIRECT | O_SYNC;
-  log_fd[table_id] = open(log_file_name, f, DEF_DB_MODE);
+  memset(ctl, 0, sizeof(*ctl));
+  if (pread(log_ctl_fd, blk, BLOCK_SIZE, 0) == BLOCK_SIZE)
+    memcpy(ctl, blk, sizeof(*ctl));
+}
 
-  log_buf_size = 4096 * 5;
-  log_buf[table_id] = (int8_t*)calloc(sizeof(*log_buf), log_buf_size);
-  log_cur_idx[table_id] = 0;
+static void write_log_ctl(void){
+  uint8_t mem[BLOCK_SIZE * 2];
+  uint8_t *blk = (uint8_t*)ALIGN_UP((uintptr_t)mem, BLOCK_SIZE);
+  log_ctl ctl;
+
+  memset(blk, 0, BLOCK_SIZE);
+  memset(&ctl, 0, sizeof(ctl));
+  ctl.checkpoint_lsn = checkpoint_lsn;
+  ctl.checkpoint_pos = checkpoint_pos;
+  ctl.next_trx_id = global_trx_id + 1;
+  memcpy(blk, &ctl, sizeof(ctl));
+  if (pwrite(log_ctl_fd, blk, BLOCK_SIZE, 0) != BLOCK_SIZE)
+    panic("write_log_ctl");
+}
 
-  global_lsn[table_id] = lseek(log_fd[table_id], 0, SEEK_CUR);
-  return 0;
+/* Oldest LSN which must survive segment reuse.
+ * Running transactions keep their records for abort.
+ */
+static int64_t log_reuse_lsn(void){
+  int64_t lsn = checkpoint_lsn;
+  trx_t *trx;
+  for (trx = active_trx; trx != NULL; trx = trx->next){
+    if (!trx->read_only && trx->first_lsn - LOG_SIZE < lsn)
+      lsn = trx->first_lsn - LOG_SIZE;
+  }
+  return lsn;
+}
+
+#ifdef LOG_COMPRESSION
+/* A frame is a header followed by the LSN range
+ * [start_lsn, start_lsn + raw_len), compressed unless that did not
+ * help, and padded to a block. Records never straddle two frames.
+ * Frames after the last checkpoint are indexed in memory.
+ */
+#define LOG_FRAME_MAGIC 0x464d474c
+#define LOG_FRAME_HDR ((int)sizeof(log_frame))
+#define LOG_FRAME_MAX \
+  ALIGN_UP(LOG_FRAME_HDR + LZ4_COMPRESSBOUND(LOG_BUF_SIZE), BLOCK_SIZE)
+#define LOG_MAX_FRAME_NUM (LOG_CAPACITY / BLOCK_SIZE)
+
+typedef struct log_frame{
+  uint32_t magic;
+  int32_t is_compressed;
+  int32_t raw_len;
+  int32_t stored_len;
+  int64_t start_lsn;
+} log_frame;
+
+typedef struct frame_idx{
+  int64_t lsn;
+  int64_t pos;
+} frame_idx;
+
+static int8_t *frame_buf_mem;
+static int8_t *frame_buf; // aligned, LOG_FRAME_MAX bytes
+static char *frame_raw;   // the last decompressed frame
+static int64_t frame_raw_lsn = -1;
+static int frame_raw_len;
+static frame_idx *frames;
+static int num_frames;
+static int64_t log_pos; // where the next frame goes
+
+/* Read the frame at pos and decompress it into frame_raw.
+ * Returns its length in the segments, or 0 if pos does not hold
+ * the frame starting at start_lsn.
+ */
+static int read_frame(int64_t pos, int64_t start_lsn){
+  log_frame *hdr = (log_frame*)frame_buf;
+  int len;
+
+  frame_raw_lsn = -1;
+  log_pio(false, frame_buf, BLOCK_SIZE, pos);
+  if (hdr->magic != LOG_FRAME_MAGIC || hdr->start_lsn != start_lsn ||
+      hdr->raw_len <= 0 || hdr->raw_len > LOG_BUF_SIZE ||
+      hdr->stored_len <= 0 ||
+      hdr->stored_len > LZ4_COMPRESSBOUND(LOG_BUF_SIZE))
+    return 0;
+
+  len = ALIGN_UP(LOG_FRAME_HDR + hdr->stored_len, BLOCK_SIZE);
+  if (len > BLOCK_SIZE)
+    log_pio(false, frame_buf + BLOCK_SIZE, len - BLOCK_SIZE,
+        pos + BLOCK_SIZE);
+
+  if (hdr->is_compressed){
+    if (LZ4_decompress_safe((char*)frame_buf + LOG_FRAME_HDR, frame_raw,
+          hdr->stored_len, LOG_BUF_SIZE) != hdr->raw_len)
+      return 0;
+  }
+  else
+    memcpy(frame_raw, frame_buf + LOG_FRAME_HDR, hdr->raw_len);
+
+  frame_raw_lsn = start_lsn;
+  frame_raw_len = hdr->raw_len;
+  return len;
 }
 
-int log_flush(int table_id) {
-  // only append
-  if (lseek(log_fd[table_id], 0, SEEK_END) < 0) {
-    panic("lseek() error");
+/* Compress the log buffer into one frame and write it at log_pos
+ */
+static void write_frame(void){
+  log_frame *hdr = (log_frame*)frame_buf;
+  int n, len;
+
+  if (num_frames == LOG_MAX_FRAME_NUM)
+    panic("write_frame");
+
+  memset(hdr, 0, LOG_FRAME_HDR);
+  hdr->magic = LOG_FRAME_MAGIC;
+  hdr->start_lsn = log_buf_start;
+  hdr->raw_len = log_cur_idx;
+  n = LZ4_compress_default((char*)log_buf, (char*)frame_buf + LOG_FRAME_HDR,
+      log_cur_idx, LZ4_COMPRESSBOUND(LOG_BUF_SIZE));
+  if (n > 0 && n < log_cur_idx){
+    hdr->is_compressed = true;
+    hdr->stored_len = n;
   }
-  if (write(log_fd[table_id], log_buf[table_id],
-        log_cur_idx[table_id]) < 0) {
-    panic("write() error");
+  else{
+    memcpy(frame_buf + LOG_FRAME_HDR, log_buf, log_cur_idx);
+    hdr->stored_len = log_cur_idx;
   }
 
-  // reinitialize
-  memset(log_buf[table_id], 0, log_buf_size);
-  log_cur_idx[table_id] = 0;
+  len = ALIGN_UP(LOG_FRAME_HDR + hdr->stored_len, BLOCK_SIZE);
+  memset(frame_buf + LOG_FRAME_HDR + hdr->stored_len, 0,
+      len - LOG_FRAME_HDR - hdr->stored_len);
+  log_pio(true, frame_buf, len, log_pos);
 
-  return 0;
+  frames[num_frames].lsn = log_buf_start;
+  frames[num_frames].pos = log_pos;
+  num_frames++;
+  log_pos += len;
 }
 
-int log_write(int table_id, log_t *log) {
-  if (log_cur_idx[table_id] + LOG_SIZE >= log_buf_size) {
-    log_flush(table_id);
+/* Index of the frame holding lsn, or -1 if it is not indexed
+ */
+static int find_frame(int64_t lsn){
+  int lo = 0, hi = num_frames - 1, mid, ret = -1;
+  while (lo <= hi){
+    mid = (lo + hi) / 2;
+    if (frames[mid].lsn <= lsn){
+      ret = mid;
+      lo = mid + 1;
+    }
+    else
+      hi = mid - 1;
   }
+  return ret;
+}
 
-  off_t prev_lsn = global_lsn[table_id];
-  off_t lsn = prev_lsn + LOG_SIZE;
+/* Drop the frames which end before the reuse point
+ */
+static void trim_frames(void){
+  int i = find_frame(log_reuse_lsn());
+  if (i <= 0)
+    return;
+  memmove(frames, frames + i, (num_frames - i) * sizeof(frame_idx));
+  num_frames -= i;
+}
 
-  log->prev_lsn = prev_lsn;
-  log->lsn = lsn;
+/* Segment position which must not be overwritten yet
+ */
+static int64_t log_reuse_pos(void){
+  int64_t lsn = log_reuse_lsn();
+  int i;
+  if (lsn >= log_buf_start)
+    return log_pos;
+  i = find_frame(lsn);
+  return i < 0 ? log_pos : frames[i].pos;
+}
 
-  memcpy(log_buf[table_id] + log_cur_idx[table_id], log, LOG_SIZE);
-  log_cur_idx[table_id] += LOG_SIZE;
+/* True when the next two frames could overwrite live log: the one of
+ * the records in the buffer, which a checkpoint writes before it frees
+ * anything, and the one of the record being added.
+ */
+static bool log_is_full(void){
+  return log_pos + 2 * LOG_FRAME_MAX - log_reuse_pos() > LOG_CAPACITY;
+}
 
+/* Find the end of the log by decompressing the frames written
+ * after the last checkpoint.
+ */
+static void scan_log_end(void){
+  int64_t lsn = checkpoint_lsn;
+  int64_t pos = checkpoint_pos;
+  log_t log;
+  int len, i;
+
+  num_frames = 0;
+  while (pos - checkpoint_pos < LOG_CAPACITY &&
+      (len = read_frame(pos, lsn)) > 0){
+    for (i = 0; i + LOG_SIZE <= frame_raw_len; i += LOG_SIZE){
+      memcpy(&log, frame_raw + i, LOG_SIZE);
+      if (log.trx_id > global_trx_id)
+        global_trx_id = log.trx_id;
+    }
+    frames[num_frames].lsn = lsn;
+    frames[num_frames].pos = pos;
+    num_frames++;
+    lsn += frame_raw_len;
+    pos += len;
+  }
+  global_lsn = flushed_lsn = lsn;
+  log_pos = pos;
+}
 
-  global_lsn[table_id] = lsn;
-  return 0;
+#else
+
+/* Read len bytes of the log stream at off into dst.
+ * O_DIRECT needs aligned reads, so go through a bounce buffer.
+ */
+static void read_log_bytes(int64_t off, void *dst, int len){
+  uint8_t mem[BLOCK_SIZE * 3];
+  uint8_t *bounce = (uint8_t*)ALIGN_UP((uintptr_t)mem, BLOCK_SIZE);
+  int64_t start = ALIGN_DOWN(off, BLOCK_SIZE);
+
+  log_pio(false, bounce, BLOCK_SIZE * 2, start);
+  memcpy(dst, bounce + (off - start), len);
+}
+
+/* True when the next flush could overwrite live log
+ */
+static bool log_is_full(void){
+  return ALIGN_UP(global_lsn + LOG_SIZE, BLOCK_SIZE) -
+    ALIGN_DOWN(log_reuse_lsn(), BLOCK_SIZE) > LOG_CAPACITY;
 }
 
-int log_read(int table_id, int prev_lsn, log_t *log) {
-  lseek(log_fd[table_id], prev_lsn, SEEK_SET);
-  if (read(log_fd[table_id], log, sizeof(*log)) < 0) {
-    panic("read() error");
+/* Find the end of the log by following records from the last
+ * checkpoint until one does not carry its own LSN.
+ * Records left over from a recycled segment carry an older LSN.
+ */
+static void scan_log_end(void){
+  log_t log;
+  int64_t off = checkpoint_lsn;
+
+  while (off + LOG_SIZE - checkpoint_lsn <= LOG_CAPACITY){
+    read_log_bytes(off, &log, LOG_SIZE);
+    if (log.lsn != off + LOG_SIZE)
+      break;
+    if (log.trx_id > global_trx_id)
+      global_trx_id = log.trx_id;
+    off += LOG_SIZE;
   }
+  global_lsn = flushed_lsn = off;
+}
+#endif /* LOG_COMPRESSION */
+
+int open_log_file(conn *c){
+  log_ctl ctl;
+  int i;
+
+  log_conn = c;
+  for (i = 0; i < LOG_SEG_NUM; i++)
+    log_seg_fd[i] = open_log_segment(i);
+  log_ctl_fd = open(LOG_CTL_PATH, O_RDWR | O_CREAT | O_DIRECT | O_DSYNC,
+      DEF_DB_MODE);
+  if (log_ctl_fd < 0)
+    panic("open_log_file");
+
+  log_buf_mem = (int8_t*)calloc(1, LOG_BUF_SIZE + BLOCK_SIZE);
+  log_buf = (int8_t*)ALIGN_UP((uintptr_t)log_buf_mem, BLOCK_SIZE);
+#ifdef LOG_COMPRESSION
+  frame_buf_mem = (int8_t*)calloc(1, LOG_FRAME_MAX + BLOCK_SIZE);
+  frame_buf = (int8_t*)ALIGN_UP((uintptr_t)frame_buf_mem, BLOCK_SIZE);
+  frame_raw = (char*)malloc(LOG_BUF_SIZE);
+  frames = (frame_idx*)malloc(LOG_MAX_FRAME_NUM * sizeof(frame_idx));
+#endif
+
+  read_log_ctl(&ctl);
+  checkpoint_lsn = ctl.checkpoint_lsn;
+  checkpoint_pos = ctl.checkpoint_pos;
+  global_trx_id = ctl.next_trx_id > 0 ? ctl.next_trx_id - 1 : 0;
+  active_trx = NULL;
+  scan_log_end();
+
+#ifdef LOG_COMPRESSION
+  log_buf_start = global_lsn;
+#else
+  // Keep the partial last block so that the next flush rewrites it.
+  log_buf_start = ALIGN_DOWN(global_lsn, BLOCK_SIZE);
+#endif
+  log_cur_idx = global_lsn - log_buf_start;
+  if (log_cur_idx > 0)
+    log_pio(false, log_buf, BLOCK_SIZE, log_buf_start);
+  memset(log_buf + log_cur_idx, 0, LOG_BUF_SIZE - log_cur_idx);
   return 0;
 }
 
+/* Write the whole log buffer with a single synchronous write.
+ */
+int log_flush(void){
+#ifndef LOG_COMPRESSION
+  int len, tail;
+#endif
+
+  if (log_buf_start + log_cur_idx == flushed_lsn)
+    return 0;
+
+#ifdef LOG_COMPRESSION
+  write_frame();
+  flushed_lsn = global_lsn;
+  log_buf_start = global_lsn;
+  log_cur_idx = 0;
+#else
+  len = ALIGN_UP(log_cur_idx, BLOCK_SIZE);
+  log_pio(true, log_buf, len, log_buf_start);
+  flushed_lsn = log_buf_start + log_cur_idx;
+
+  // Move the partial last block to the front of the buffer.
+  tail = ALIGN_DOWN(log_cur_idx, BLOCK_SIZE);
+  memmove(log_buf, log_buf + tail, log_cur_idx - tail);
+  log_cur_idx -= tail;
+  log_buf_start += tail;
+  memset(log_buf + log_cur_idx, 0, LOG_BUF_SIZE - log_cur_idx);
+#endif /* LOG_COMPRESSION */
 
-int begin_transaction(int table_id) {
-  log_t log;
-  memset(&log, 0, sizeof(log_t));
+  return 0;
+}
 
-  log.type = BEGIN;
-  log_write(table_id, &log);
+/* Make the log durable at least up to lsn.
+ * Called before a page carrying page_lsn goes to disk.
+ */
+int log_flush_to(int64_t lsn){
+  if (log_buf == NULL || lsn <= flushed_lsn)
+    return 0;
+  return log_flush();
+}
+
+/* Write every dirty page and remember that the log before the
+ * current end is no longer needed, so its segments can be reused.
+ */
+int log_checkpoint(void){
+  log_flush();
+  if (log_conn != NULL && log_conn->bfm != NULL)
+    flush_dirty_pages(log_conn);
+  checkpoint_lsn = global_lsn;
+#ifdef LOG_COMPRESSION
+  checkpoint_pos = log_pos;
+  trim_frames();
+#else
+  checkpoint_pos = global_lsn;
+#endif
+  write_log_ctl();
   return 0;
 }
 
-int commit_transaction(int table_id) {
+/* Append a record and return its LSN.
+ * The record is chained to the previous record of its transaction.
+ */
+int64_t log_write(log_t *log) {
+  if (log_is_full()) {
+    log_checkpoint();
+    if (log_is_full())
+      panic("log full");
+  }
+  if (log_cur_idx + LOG_SIZE > LOG_BUF_SIZE) {
+    log_flush();
+  }
+
+  global_lsn += LOG_SIZE;
+  log->lsn = global_lsn;
+  log->prev_lsn = cur_trx ? cur_trx->last_lsn : 0;
+  log->trx_id = cur_trx ? cur_trx->trx_id : 0;
+
+  memcpy(log_buf + log_cur_idx, log, LOG_SIZE);
+  log_cur_idx += LOG_SIZE;
+
+  if (cur_trx)
+    cur_trx->last_lsn = global_lsn;
+  return global_lsn;
+}
+
+/* Read the record whose LSN is lsn
+ */
+int log_read(int64_t lsn, log_t *log) {
+  int64_t off = lsn - LOG_SIZE;
+
+  if (off >= log_buf_start) {
+    memcpy(log, log_buf + (off - log_buf_start), LOG_SIZE);
+    return 0;
+  }
+  if (off < log_reuse_lsn())
+    return -1;
+#ifdef LOG_COMPRESSION
+  {
+    int i = find_frame(off);
+    if (i < 0)
+      return -1;
+    if (frame_raw_lsn != frames[i].lsn &&
+        read_frame(frames[i].pos, frames[i].lsn) == 0)
+      return -1;
+    memcpy(log, frame_raw + (off - frames[i].lsn), LOG_SIZE);
+  }
+#else
+  read_log_bytes(off, log, LOG_SIZE);
+#endif
+  return 0;
+}
+
+/* Log an update of the current transaction and return its LSN.
+ * Returns 0 when no transaction is running.
+ */
+int64_t log_update(int table_id, bkey_t key, addr page_offset, int offset,
+    const char *old_image, const char *new_image) {
   log_t log;
+
+  if (cur_trx == NULL)
+    return 0;
+
   memset(&log, 0, sizeof(log_t));
+  log.type = UPDATE;
+  log.table_id = table_id;
+  log.page_number = page_offset / BLOCK_SIZE;
+  log.offset = offset;
+  log.data_length = VALUE_SIZE;
+  log.key = key;
+  memcpy(log.old_image, old_image, VALUE_SIZE);
+  memcpy(log.new_image, new_image, VALUE_SIZE);
+  return log_write(&log);
+}
 
-  log.type = COMMIT;
-  log_write(table_id, &log);
-  return 0;
+/* Log an insert or a delete of the current transaction with the
+ * value it inserted or deleted, of len bytes, and return its LSN.
+ * Returns 0 when no transaction is running.
+ */
+static int64_t log_record(enum log_type type, int table_id, bkey_t key,
+    const char *value, uint32_t len) {
+  log_t log;
+
+  if (cur_trx == NULL)
+    return 0;
+
+  memset(&log, 0, sizeof(log_t));
+  log.type = type;
+  log.table_id = table_id;
+  log.data_length = len;
+  log.key = key;
+  memcpy(type == INSERT ? log.new_image : log.old_image, value, len);
+  return log_write(&log);
 }
 
-int abort_transaction(int table_id) {
-  log_t abort_log;
-  memset(&abort_log, 0, sizeof(log_t));
+int64_t log_insert(int table_id, bkey_t key, const char *value,
+    uint32_t len) {
+  return log_record(INSERT, table_id, key, value, len);
+}
 
-  abort_log.type = ABORT;
-  log_write(table_id, &abort_log);
-  log_flush(table_id);
+int64_t log_delete(int table_id, bkey_t key, const char *value,
+    uint32_t len) {
+  return log_record(DELETE, table_id, key, value, len);
+}
+
+/* Transaction of the calling thread, or NULL
+ */
+trx_t *current_trx(void) {
+  return cur_trx;
+}
 
-  //TODO: Implement abort
+/* Detach the transaction of this thread and drop its locks
+ */
+static void end_transaction(void) {
+  trx_t **pp = &active_trx;
+
+  while (*pp != cur_trx)
+    pp = &(*pp)->next;
+  *pp = cur_trx->next;
+
+  lock_release_all(cur_trx);
+  free(cur_trx);
+  cur_trx = NULL;
+}
+
+/* Start a transaction for this thread and return its id.
+ * A smaller id means an older transaction for wait-die.
+ * A read-only transaction only takes a read view; it writes no log.
+ */
+int begin_transaction_low(bool read_only) {
   log_t log;
-  off_t prev_lsn = abort_log.prev_lsn;
 
-  while (1) {
-    memset(&log, 0, sizeof(log_t));
-    log_read(table_id, prev_lsn, &log);
-    if (log.type == BEGIN) {
-      break;
-    }
+  if (cur_trx != NULL)
+    return -1;
 
-    // read page
-    nblock nb;
-    memset(&nb, 0, sizeof(nb));
-    lseek(log_fd[table_id], log.page_number, SEEK_SET);
-    if(read(log_fd[table_id], &nb, sizeof(nb)) < 0) {
-      panic("read() error");
-    }
+  cur_trx = (trx_t*)calloc(1, sizeof(trx_t));
+  cur_trx->trx_id = ++global_trx_id;
+  cur_trx->first_lsn = global_lsn + LOG_SIZE;
+  cur_trx->read_only = read_only;
+  cur_trx->next = active_trx;
+  active_trx = cur_trx;
 
+  if (read_only) {
+    mvcc_open_view(cur_trx);
+    return cur_trx->trx_id;
+  }
 
-    // revert to old value
+  memset(&log, 0, sizeof(log_t));
+  log.type = BEGIN;
+  log_write(&log);
+  return cur_trx->trx_id;
+}
 
+/* Commit the transaction of this thread.
+ * One flush makes the updates of every table durable,
+ * then the locks are released (strict two-phase locking).
+ */
+int commit_transaction_low(void) {
+  log_t log;
 
-    // write page
+  if (cur_trx == NULL)
+    return -1;
 
+  if (cur_trx->read_only) {
+    mvcc_close_view(cur_trx);
+    end_transaction();
+    return 0;
+  }
 
+  memset(&log, 0, sizeof(log_t));
+  log.type = COMMIT;
+  log_write(&log);
+  log_flush();
+
+  mvcc_commit(cur_trx);
+  end_transaction();
+  return 0;
+}
 
-    // iterate list
-    prev_lsn = log.prev_lsn;
-    if (log.prev_lsn == 0) {
+/* Roll back the transaction of this thread by following its
+ * prev_lsn chain. Old images are restored by key, because
+ * the record may have moved to another page since it was logged.
+ * An insert is undone by deleting its record, and a delete by
+ * inserting the value it deleted.
+ */
+int abort_transaction_low(void) {
+  log_t log;
+  log_t abort_log;
+  int64_t lsn;
+  table *t;
+
+  if (cur_trx == NULL)
+    return -1;
+
+  if (cur_trx->read_only) {
+    mvcc_close_view(cur_trx);
+    end_transaction();
+    return 0;
+  }
+
+  lsn = cur_trx->last_lsn;
+  while (lsn != 0) {
+    if (log_read(lsn, &log) != 0)
+      panic("abort_transaction");
+    if (log.type == BEGIN)
       break;
+
+    t = &log_conn->tbls[log.table_id];
+    if (log.type == UPDATE) {
+      index_set_low(t, log.key, log.old_image,
+          strnlen(log.old_image, log.data_length));
+      set_value_low(t, log.key, log.old_image,
+          strnlen(log.old_image, log.data_length), 0);
     }
+    else if (log.type == INSERT)
+      delete_record_low(t, log.key, 0);
+    else if (log.type == DELETE)
+      insert_record_low(t, log.key, log.old_image, log.data_length, 0);
+    lsn = log.prev_lsn;
   }
 
+  memset(&abort_log, 0, sizeof(log_t));
+  abort_log.type = ABORT;
+  log_write(&abort_log);
+  log_flush();
+
+  mvcc_abort(cur_trx);
+  end_transaction();
   return 0;
 }
 
-int close_log_file(int table_id){
-  log_flush(table_id);
-  close(log_fd[table_id]);
-  log_fd[table_id] = 0;
-  free(log_buf[table_id]);
-  log_buf[table_id] = NULL;
+int close_log_file(void){
+  int i;
 
-  return 0;
-}
+  if (log_buf == NULL)
+    return 0;
 
-int close_all_log_file() {
-  for (int i = 0; i < MAX_TABLE; ++i) {
-    if (log_fd[i] != 0) {
-      close_log_file(i);
-    }
+  log_checkpoint();
+  for (i = 0; i < LOG_SEG_NUM; i++){
+    close(log_seg_fd[i]);
+    log_seg_fd[i] = 0;
   }
+  close(log_ctl_fd);
+  log_ctl_fd = -1;
+  free(log_buf_mem);
+  log_buf_mem = log_buf = NULL;
+#ifdef LOG_COMPRESSION
+  free(frame_buf_mem);
+  free(frame_raw);
+  free(frames);
+  frame_buf_mem = frame_buf = NULL;
+  frame_raw = NULL;
+  frames = NULL;
+  frame_raw_lsn = -1;
+#endif
+  log_conn = NULL;
 
   return 0;
 }
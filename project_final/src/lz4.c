@@ -0,0 +1,177 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz4.h"
+
+#define MINMATCH 4
+#define LASTLITERALS 5   // the last 5 bytes are always literals
+#define MFLIMIT 12       // a match must start 12 bytes before the end
+#define MAX_DISTANCE 65535
+#define HASH_LOG 12
+#define ML_MASK 15
+#define RUN_MASK 15
+
+static uint32_t read32(const char *p){
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash32(uint32_t seq){
+	return (seq * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/* Write a length which did not fit into the token nibble
+ */
+static char *write_len(char *op, int len){
+	while (len >= 255){
+		*op++ = (char)255;
+		len -= 255;
+	}
+	*op++ = (char)len;
+	return op;
+}
+
+/* Emit one sequence: literals [anchor, ip) followed by a match of
+ * match_len bytes at distance offset. offset 0 emits the last literals.
+ */
+static char *write_seq(char *op, const char *op_end, const char *anchor,
+		const char *ip, int offset, int match_len){
+	int lit_len = ip - anchor;
+	char *token = op++;
+
+	if (op + lit_len + lit_len / 255 + match_len / 255 + 8 > op_end)
+		return NULL;
+
+	if (lit_len >= RUN_MASK){
+		*token = RUN_MASK << 4;
+		op = write_len(op, lit_len - RUN_MASK);
+	}
+	else
+		*token = lit_len << 4;
+	memcpy(op, anchor, lit_len);
+	op += lit_len;
+
+	if (offset == 0)
+		return op;
+
+	*op++ = (char)(offset & 0xff);
+	*op++ = (char)(offset >> 8);
+	match_len -= MINMATCH;
+	if (match_len >= ML_MASK){
+		*token |= ML_MASK;
+		op = write_len(op, match_len - ML_MASK);
+	}
+	else
+		*token |= match_len;
+	return op;
+}
+
+int LZ4_compress_default(const char *src, char *dst, int src_size,
+		int dst_capacity){
+	int32_t table[1 << HASH_LOG];
+	const char *ip = src;
+	const char *anchor = src;
+	const char *end = src + src_size;
+	const char *match_limit = end - MFLIMIT;
+	const char *ref;
+	const char *op_end = dst + dst_capacity;
+	char *op = dst;
+	uint32_t h, seq;
+	int len;
+
+	memset(table, 0xff, sizeof(table));
+
+	if (src_size > MFLIMIT){
+		while (ip < match_limit){
+			seq = read32(ip);
+			h = hash32(seq);
+			ref = table[h] < 0 ? NULL : src + table[h];
+			table[h] = ip - src;
+
+			if (ref == NULL || ip - ref > MAX_DISTANCE || read32(ref) != seq){
+				ip++;
+				continue;
+			}
+
+			len = MINMATCH;
+			while (ip + len < end - LASTLITERALS && ref[len] == ip[len])
+				len++;
+
+			if ((op = write_seq(op, op_end, anchor, ip, ip - ref, len)) == NULL)
+				return 0;
+			ip += len;
+			anchor = ip;
+		}
+	}
+
+	if ((op = write_seq(op, op_end, anchor, end, 0, 0)) == NULL)
+		return 0;
+	return op - dst;
+}
+
+/* Read a length which continues after the token nibble
+ */
+static int read_len(const unsigned char **ip, const unsigned char *ip_end){
+	int len = 0;
+	unsigned char b;
+	do{
+		if (*ip >= ip_end)
+			return -1;
+		b = *(*ip)++;
+		len += b;
+	}while (b == 255);
+	return len;
+}
+
+int LZ4_decompress_safe(const char *src, char *dst, int compressed_size,
+		int dst_capacity){
+	const unsigned char *ip = (const unsigned char*)src;
+	const unsigned char *ip_end = ip + compressed_size;
+	char *op = dst;
+	char *op_end = dst + dst_capacity;
+	const char *ref;
+	int token, len, extra, offset;
+
+	while (ip < ip_end){
+		token = *ip++;
+
+		len = token >> 4;
+		if (len == RUN_MASK){
+			if ((extra = read_len(&ip, ip_end)) < 0)
+				return -1;
+			len += extra;
+		}
+		if (ip + len > ip_end || op + len > op_end)
+			return -1;
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+
+		// The last sequence has no match part.
+		if (ip == ip_end)
+			break;
+
+		if (ip + 2 > ip_end)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		ref = op - offset;
+		if (offset == 0 || ref < dst)
+			return -1;
+
+		len = token & ML_MASK;
+		if (len == ML_MASK){
+			if ((extra = read_len(&ip, ip_end)) < 0)
+				return -1;
+			len += extra;
+		}
+		len += MINMATCH;
+		if (op + len > op_end)
+			return -1;
+
+		// Byte copy, because the match may overlap the output.
+		while (len-- > 0)
+			*op++ = *ref++;
+	}
+	return op - dst;
+}
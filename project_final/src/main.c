@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
+#include "bptree.h"
 
 #define DEF_DB_PATH "./DATA0"
 #define DEF_NUM_BUF 5
@@ -13,10 +14,10 @@ int init_db(uint64_t buf_size);
 int shutdown_db();
 int open_table(char *pathname);
 int close_table(int table_id);
-int insert(int table_id, int64_t key, char *value);
-int update(int table_id, int64_t key, char *value);
-char *find(int table_id, int64_t key);
-int delete(int table_id, int64_t key);
+int insert(int table_id, bkey_t key, char *value);
+int update(int table_id, bkey_t key, char *value);
+char *find(int table_id, bkey_t key);
+int delete(int table_id, bkey_t key);
 
 #define NUM_CHARSET 62
 char charset[NUM_CHARSET+1] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
@@ -44,7 +45,7 @@ int shell(){
 		case 'd':
 			ret = scanf("%ld", &k);
 			UNUSED(ret);
-			if (delete(table_id, k) != 0){
+			if (delete(table_id, key_int(k)) != 0){
 				printf("Delete Failed\n");
 			}
 			break;
@@ -52,7 +53,7 @@ int shell(){
 			memset(v, 0, sizeof(v));
 			ret = scanf("%ld %s", &k, v);
 			UNUSED(ret);
-			if (insert(table_id, k, v) != 0){
+			if (insert(table_id, key_int(k), v) != 0){
 				printf("Insert Failed\n");
 			}
 			break;
@@ -60,14 +61,14 @@ int shell(){
 			memset(v, 0, sizeof(v));
 			ret = scanf("%ld %s", &k, v);
 			UNUSED(ret);
-			if (update(table_id, k, v) != 0){
+			if (update(table_id, key_int(k), v) != 0){
 				printf("Update Failed\n");
 			}
 			break;
 		case 'f':
 			ret = scanf("%ld", &k);
 			UNUSED(ret);
-			if ((find_ret = find(table_id, k)) == NULL){
+			if ((find_ret = find(table_id, key_int(k))) == NULL){
 				printf("Not found\n");
 			} else{
 				printf("%ld %s\n", k, find_ret);
@@ -0,0 +1,239 @@
+#include "bptree.h"
+
+/* Undo-based version store for snapshot reads.
+ * A page always holds the newest value of a record. Every update pushes
+ * the value it replaced, tagged with its writer, into a bucket list,
+ * newest first. A delete pushes the value it removed the same way, and
+ * an insert pushes a version with no record before it. A read view
+ * walks the versions of a key back until the writer is visible to it.
+ * Versions are stamped with a commit number when their writer commits,
+ * and dropped on abort.
+ *
+ * The store is guarded by the engine latch, like the buffer pool.
+ */
+static version *buckets[MVCC_BUCKET_NUM];
+static trx_t *views;          // open read views
+static int64_t commit_no;     // commits so far
+static int64_t num_versions;
+static int gc_countdown;
+
+static version **get_bucket(int table_id, bkey_t key){
+	uint64_t h = key_hash(key);
+	h ^= (h >> 29) ^ (uint64_t)table_id;
+	return &buckets[h % MVCC_BUCKET_NUM];
+}
+
+/* Oldest snapshot any view may still ask for.
+ * New views see every commit made so far.
+ */
+static int64_t oldest_snapshot(void){
+	int64_t snap = commit_no;
+	trx_t *trx;
+	for (trx = views; trx != NULL; trx = trx->view_next){
+		if (trx->snapshot < snap)
+			snap = trx->snapshot;
+	}
+	return snap;
+}
+
+static bool is_visible(trx_t *trx, version *v){
+	return v->trx_id == trx->trx_id ||
+		(v->commit_no != 0 && v->commit_no <= trx->snapshot);
+}
+
+static int bkey_cmp(const void *x, const void *y){
+	return KEY_CMP(*(const bkey_t *)x, *(const bkey_t *)y);
+}
+
+/* Drop every version which all views see past:
+ * its writer committed no later than the oldest snapshot.
+ * Those of inserts and deletes go like those of updates.
+ */
+static void gc_versions(void){
+	int64_t snap = oldest_snapshot();
+	version **pp, *v;
+	int i;
+	for (i = 0; i < MVCC_BUCKET_NUM; i++){
+		pp = &buckets[i];
+		while ((v = *pp) != NULL){
+			if (v->commit_no != 0 && v->commit_no <= snap){
+				*pp = v->next;
+				free(v);
+				num_versions--;
+			}
+			else
+				pp = &v->next;
+		}
+	}
+}
+
+static void maybe_gc(void){
+	if (--gc_countdown > 0)
+		return;
+	gc_countdown = MVCC_GC_INTERVAL;
+	gc_versions();
+}
+
+void init_version_store(void){
+	memset(buckets, 0, sizeof(buckets));
+	views = NULL;
+	commit_no = 0;
+	num_versions = 0;
+	gc_countdown = MVCC_GC_INTERVAL;
+}
+
+void close_version_store(void){
+	version *v, *next;
+	int i;
+	for (i = 0; i < MVCC_BUCKET_NUM; i++){
+		for (v = buckets[i]; v != NULL; v = next){
+			next = v->next;
+			free(v);
+		}
+		buckets[i] = NULL;
+	}
+	views = NULL;
+	num_versions = 0;
+}
+
+/* Take a read view of every commit made so far
+ */
+void mvcc_open_view(trx_t *trx){
+	trx->snapshot = commit_no;
+	trx->view_next = views;
+	views = trx;
+}
+
+void mvcc_close_view(trx_t *trx){
+	trx_t **pp = &views;
+	while (*pp != trx)
+		pp = &(*pp)->view_next;
+	*pp = trx->view_next;
+	maybe_gc();
+}
+
+/* Whether some read view is open, so that writes keep versions
+ */
+bool mvcc_has_views(void){
+	return views != NULL;
+}
+
+/* Save the image an update or a delete of (table_id, key) is about
+ * to replace, or with a NULL image, that an insert adds the record.
+ * Work outside a transaction commits at once, so its version
+ * is only kept while some view may need it.
+ */
+void mvcc_push(int table_id, bkey_t key, const char *old_image){
+	trx_t *trx = current_trx();
+	version **bucket;
+	version *v;
+
+	if (trx == NULL && views == NULL)
+		return;
+
+	bucket = get_bucket(table_id, key);
+	v = (version*)malloc(sizeof(version));
+	v->table_id = table_id;
+	v->key = key;
+	v->absent = old_image == NULL;
+	if (old_image != NULL)
+		memcpy(v->old_image, old_image, VALUE_SIZE);
+	else
+		memset(v->old_image, 0, VALUE_SIZE);
+	if (trx != NULL){
+		v->trx_id = trx->trx_id;
+		v->commit_no = 0;
+		v->trx_next = trx->versions;
+		trx->versions = v;
+	}
+	else{
+		v->trx_id = 0;
+		v->commit_no = ++commit_no;
+		v->trx_next = NULL;
+	}
+	v->next = *bucket;
+	*bucket = v;
+	num_versions++;
+}
+
+/* Make the versions of trx visible to views opened from now on
+ */
+void mvcc_commit(trx_t *trx){
+	version *v;
+	++commit_no;
+	for (v = trx->versions; v != NULL; v = v->trx_next)
+		v->commit_no = commit_no;
+	trx->versions = NULL;
+	maybe_gc();
+}
+
+/* Forget the versions of an aborted trx.
+ * Its writes were undone on the pages already.
+ */
+void mvcc_abort(trx_t *trx){
+	version **pp, *v, *next;
+	for (v = trx->versions; v != NULL; v = next){
+		next = v->trx_next;
+		pp = get_bucket(v->table_id, v->key);
+		while (*pp != v)
+			pp = &(*pp)->next;
+		*pp = v->next;
+		free(v);
+		num_versions--;
+	}
+	trx->versions = NULL;
+}
+
+/* Turn value, the newest image of (table_id, key), into the image
+ * the read view of trx sees. found tells whether the record is in the
+ * table, and then whether the view sees one. Returns true when the
+ * view sees something else than the newest image.
+ */
+bool mvcc_read(trx_t *trx, int table_id, bkey_t key, char *value,
+		bool *found){
+	bool changed = false;
+	version *v;
+	for (v = *get_bucket(table_id, key); v != NULL; v = v->next){
+		if (v->table_id != table_id || !KEY_EQ(v->key, key))
+			continue;
+		if (is_visible(trx, v))
+			break;
+		changed = true;
+		*found = !v->absent;
+		memcpy(value, v->old_image, VALUE_SIZE);
+	}
+	return changed;
+}
+
+/* Keys of table_id in [lo, hi] with a version the view of trx does not
+ * see, sorted in a new array. Their records may be seen otherwise than
+ * they are in the table, or only by the view. Returns their number.
+ */
+int mvcc_changed_keys(trx_t *trx, int table_id, bkey_t lo, bkey_t hi,
+		bkey_t **keys){
+	version *v;
+	int i, j, n = 0, cap = 0;
+
+	*keys = NULL;
+	if (num_versions == 0)
+		return 0;
+	for (i = 0; i < MVCC_BUCKET_NUM; i++){
+		for (v = buckets[i]; v != NULL; v = v->next){
+			if (v->table_id != table_id || KEY_LT(v->key, lo) ||
+					KEY_LT(hi, v->key) || is_visible(trx, v))
+				continue;
+			if (n == cap){
+				cap = cap == 0 ? 64 : cap * 2;
+				*keys = realloc(*keys, cap * sizeof(bkey_t));
+			}
+			(*keys)[n++] = v->key;
+		}
+	}
+	if (n > 0)
+		qsort(*keys, n, sizeof(bkey_t), bkey_cmp);
+	for (i = j = 0; i < n; i++){
+		if (j == 0 || !KEY_EQ((*keys)[j - 1], (*keys)[i]))
+			(*keys)[j++] = (*keys)[i];
+	}
+	return j;
+}
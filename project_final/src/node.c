@@ -0,0 +1,282 @@
+#include "bptree.h"
+
+/* Internal node entries.
+ * A node whose keys share all but their last 4 bytes is narrow: the
+ * shared bytes are kept once in i_prefix, and its entries are nchild
+ * with the last 4 bytes and the page number of the child, so more
+ * of them fit in a page. Other nodes are wide, with child entries.
+ * Lookups read the entries in place. Structural changes load the
+ * node into a wnode, edit it there and store it back in the smaller
+ * format.
+ */
+
+#ifdef BYTE_KEY
+#define SAME_PREFIX(x, y) (memcmp((x).b, (y).b, KEY_SIZE - 4) == 0)
+#else
+#define SAME_PREFIX(x, y) ((x) >> 32 == (y) >> 32)
+#endif
+
+/* Last 4 bytes of a key
+ */
+static uint32_t key_low(bkey_t k){
+#ifdef BYTE_KEY
+	return (uint32_t)k.b[KEY_SIZE - 4] << 24 | (uint32_t)k.b[KEY_SIZE - 3] << 16 |
+		(uint32_t)k.b[KEY_SIZE - 2] << 8 | k.b[KEY_SIZE - 1];
+#else
+	return (uint32_t)k;
+#endif
+}
+
+/* Key with the prefix of another and the given last 4 bytes
+ */
+static bkey_t narrow_key(bkey_t prefix, uint32_t low){
+#ifdef BYTE_KEY
+	prefix.b[KEY_SIZE - 4] = low >> 24;
+	prefix.b[KEY_SIZE - 3] = low >> 16;
+	prefix.b[KEY_SIZE - 2] = low >> 8;
+	prefix.b[KEY_SIZE - 1] = low;
+	return prefix;
+#else
+	return (int64_t)(((uint64_t)prefix & ~(uint64_t)UINT32_MAX) | low);
+#endif
+}
+
+/* Key i of an internal node
+ */
+bkey_t node_key(nblock *nb, int i){
+	if (nb->i_narrow)
+		return narrow_key(nb->i_prefix, nb->i_nchildren[i].k);
+	return nb->i_children[i].k;
+}
+
+/* Child address of an internal node, indexed like get_child()
+ */
+addr node_child(nblock *nb, int idx){
+	if (idx == 0)
+		return nb->i_leftmost;
+	if (nb->i_narrow)
+		return (addr)nb->i_nchildren[idx - 1].pnum * BLOCK_SIZE;
+	return nb->i_children[idx - 1].v;
+}
+
+/* Index of the child whose subtree holds k, for get_child()
+ */
+int node_find_child(nblock *nb, bkey_t k){
+	int lo = 0, hi = nb->num_keys, mid;
+	uint32_t low = key_low(k);
+
+	if (nb->i_narrow){
+		if (!SAME_PREFIX(k, nb->i_prefix))
+			return KEY_LT(k, nb->i_prefix) ? 0 : nb->num_keys;
+		while (lo < hi){
+			mid = (lo + hi) / 2;
+			if (nb->i_nchildren[mid].k <= low)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo;
+	}
+
+	while (lo < hi){
+		mid = (lo + hi) / 2;
+		if (!KEY_LT(k, nb->i_children[mid].k))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+#ifdef ORDER_STATISTIC
+/* Record count of a child, indexed like get_child()
+ */
+uint64_t get_child_count(npage *np, int idx){
+	nblock *nb = B(np);
+	if (idx == 0)
+		return nb->leftmost_cnt;
+	if (nb->i_narrow)
+		return nb->i_nchildren[idx - 1].cnt;
+	return nb->i_children[idx - 1].cnt;
+}
+
+void set_child_count(npage *np, int idx, uint64_t cnt){
+	nblock *nb = B(np);
+	if (idx == 0)
+		nb->leftmost_cnt = cnt;
+	else if (nb->i_narrow)
+		nb->i_nchildren[idx - 1].cnt = cnt;
+	else
+		nb->i_children[idx - 1].cnt = cnt;
+}
+#endif
+
+/* Whether n sorted entries fit an internal node
+ */
+bool node_fits(const child *c, int n){
+	if (n <= NUM_INT_KEY)
+		return true;
+	return n <= NUM_NARROW_KEY && SAME_PREFIX(c[0].k, c[n - 1].k);
+}
+
+/* Keys a node could hold in the format the entries c[0..n-1] allow
+ */
+int node_capacity(const child *c, int n){
+	if (n > 0 && SAME_PREFIX(c[0].k, c[n - 1].k))
+		return NUM_NARROW_KEY;
+	return NUM_INT_KEY;
+}
+
+/* Decode an internal node
+ */
+void node_load(nblock *nb, wnode *w){
+	int i;
+
+	w->num_keys = nb->num_keys;
+	w->leftmost = nb->i_leftmost;
+#ifdef ORDER_STATISTIC
+	w->leftmost_cnt = nb->leftmost_cnt;
+#endif
+	if (!nb->i_narrow){
+		memcpy(w->children, nb->i_children, nb->num_keys * sizeof(child));
+		return;
+	}
+	for (i = 0; i < nb->num_keys; i++){
+		w->children[i].k = narrow_key(nb->i_prefix, nb->i_nchildren[i].k);
+		w->children[i].v = (addr)nb->i_nchildren[i].pnum * BLOCK_SIZE;
+#ifdef ORDER_STATISTIC
+		w->children[i].cnt = nb->i_nchildren[i].cnt;
+#endif
+	}
+}
+
+/* Encode an internal node, narrow when its keys allow it
+ */
+void node_store(nblock *nb, const wnode *w){
+	int i, n = w->num_keys;
+
+	if (!node_fits(w->children, n))
+		panic("node_store");
+
+	nb->num_keys = n;
+	nb->i_leftmost = w->leftmost;
+#ifdef ORDER_STATISTIC
+	nb->leftmost_cnt = w->leftmost_cnt;
+#endif
+	memset(nb->l_data, 0, LEAF_AREA);
+	memset(&nb->i_prefix, 0, sizeof(bkey_t));
+	nb->i_narrow = n > 0 && SAME_PREFIX(w->children[0].k, w->children[n - 1].k);
+	if (!nb->i_narrow){
+		memcpy(nb->i_children, w->children, n * sizeof(child));
+		return;
+	}
+
+	nb->i_prefix = w->children[0].k;
+	for (i = 0; i < n; i++){
+		nb->i_nchildren[i].k = key_low(w->children[i].k);
+		nb->i_nchildren[i].pnum = w->children[i].v / BLOCK_SIZE;
+#ifdef ORDER_STATISTIC
+		nb->i_nchildren[i].cnt = w->children[i].cnt;
+#endif
+	}
+}
+
+/* Whether an internal node can take one more key k
+ */
+bool node_has_room(nblock *nb, bkey_t k){
+	int n = nb->num_keys + 1;
+	bkey_t first, last;
+
+	if (n <= NUM_INT_KEY)
+		return true;
+	if (n > NUM_NARROW_KEY)
+		return false;
+	first = node_key(nb, 0);
+	last = node_key(nb, nb->num_keys - 1);
+	return SAME_PREFIX(first, last) && SAME_PREFIX(k, first);
+}
+
+/* Whether two sibling nodes and the key between them fit one node
+ */
+bool node_can_merge(nblock *left, bkey_t k_prime, nblock *right){
+	int n = left->num_keys + right->num_keys + 1;
+	bkey_t first, last;
+
+	if (n <= NUM_INT_KEY)
+		return true;
+	if (n > NUM_NARROW_KEY)
+		return false;
+	first = left->num_keys > 0 ? node_key(left, 0) : k_prime;
+	last = right->num_keys > 0 ? node_key(right, right->num_keys - 1) : k_prime;
+	return SAME_PREFIX(first, last);
+}
+
+/* Replace key i. Returns false, leaving the node as it was,
+ * when a narrow node cannot be widened to hold k.
+ */
+bool node_set_key(nblock *nb, int i, bkey_t k){
+	wnode w;
+
+	if (!nb->i_narrow){
+		nb->i_children[i].k = k;
+		return true;
+	}
+	if (SAME_PREFIX(k, nb->i_prefix)){
+		nb->i_nchildren[i].k = key_low(k);
+		return true;
+	}
+
+	node_load(nb, &w);
+	w.children[i].k = k;
+	if (!node_fits(w.children, w.num_keys))
+		return false;
+	node_store(nb, &w);
+	return true;
+}
+
+/* The key in (lo, hi] with the most trailing zero bits: the bits of hi
+ * down to the first one where it differs from lo.
+ * Any key there separates lo from hi, and this one is the shortest.
+ */
+bkey_t shortest_separator(bkey_t lo, bkey_t hi){
+#ifdef BYTE_KEY
+	uint8_t m;
+	int i;
+
+	for (i = 0; i < KEY_SIZE && lo.b[i] == hi.b[i]; i++)
+		;
+	if (i == KEY_SIZE)
+		return hi;
+	for (m = lo.b[i] ^ hi.b[i]; m & (m - 1); m &= m - 1)
+		;
+	hi.b[i] &= ~(m - 1);
+	memset(hi.b + i + 1, 0, KEY_SIZE - i - 1);
+	return hi;
+#else
+	uint64_t m;
+
+	for (m = (uint64_t)lo ^ (uint64_t)hi; m & (m - 1); m &= m - 1)
+		;
+	if (m == 0)
+		return hi;
+	return (int64_t)((((uint64_t)hi ^ (1ULL << 63)) & ~(m - 1)) ^ (1ULL << 63));
+#endif
+}
+
+/* Set key i to a separator in (lo, hi], within the prefix of a
+ * narrow node if the range reaches it.
+ * Returns false when the node cannot hold any of them.
+ */
+bool node_set_separator(nblock *nb, int i, bkey_t lo, bkey_t hi){
+	bkey_t first, last;
+
+	if (nb->i_narrow){
+		first = narrow_key(nb->i_prefix, 0);
+		last = narrow_key(nb->i_prefix, UINT32_MAX);
+		if (KEY_LT(lo, first) && !KEY_LT(hi, first))
+			return node_set_key(nb, i, first);
+		if (KEY_LT(lo, last) && KEY_LT(last, hi))
+			hi = last;
+	}
+	return node_set_key(nb, i, shortest_separator(lo, hi));
+}
@@ -0,0 +1,124 @@
+#include "bptree.h"
+
+/* Cache of hot records in front of the trees.
+ * Lookups keep the records they find, with values of up to VALUE_SIZE
+ * bytes, in RCACHE_NUM entries hashed by table and key, so a repeated
+ * lookup is one probe without a page. Writes drop the entry of their
+ * key. When the cache is full, a CLOCK hand clears the reference bits
+ * of the entries it passes and evicts the first one not read since
+ * its last round.
+ *
+ * The cache is guarded by the engine latch, like the buffer pool.
+ */
+typedef struct rcentry{
+	int table_id;              // -1 when the entry is free
+	bkey_t key;
+	uint32_t len;
+	bool ref;                  // read since the hand passed
+	int next;                  // next entry in the bucket, or -1
+	char v[VALUE_SIZE];        // padded with zeros
+} rcentry;
+
+static rcentry entries[RCACHE_NUM];
+static int buckets[RCACHE_BUCKET_NUM];
+static int hand;
+
+static int *get_bucket(int table_id, bkey_t key){
+	uint64_t h = key_hash(key);
+	h ^= (h >> 29) ^ (uint64_t)table_id;
+	return &buckets[h % RCACHE_BUCKET_NUM];
+}
+
+static int *find_entry(int table_id, bkey_t key){
+	int *pi;
+	for (pi = get_bucket(table_id, key); *pi != -1; pi = &entries[*pi].next){
+		if (entries[*pi].table_id == table_id && KEY_EQ(entries[*pi].key, key))
+			return pi;
+	}
+	return NULL;
+}
+
+static void unlink_entry(int *pi){
+	rcentry *e = &entries[*pi];
+	*pi = e->next;
+	e->table_id = -1;
+	e->next = -1;
+}
+
+void init_rcache(void){
+	int i;
+	for (i = 0; i < RCACHE_NUM; i++){
+		entries[i].table_id = -1;
+		entries[i].next = -1;
+	}
+	for (i = 0; i < RCACHE_BUCKET_NUM; i++)
+		buckets[i] = -1;
+	hand = 0;
+}
+
+void close_rcache(void){
+	init_rcache();
+}
+
+/* Copy the cached value of a key to v, VALUE_SIZE bytes padded
+ * with zeros, and its length to len
+ */
+bool rcache_get(int table_id, bkey_t key, char *v, uint32_t *len){
+	int *pi = find_entry(table_id, key);
+	rcentry *e;
+
+	if (pi == NULL)
+		return false;
+	e = &entries[*pi];
+	e->ref = true;
+	memcpy(v, e->v, VALUE_SIZE);
+	*len = e->len;
+	return true;
+}
+
+/* Cache the value of a key, evicting by CLOCK if needed
+ */
+void rcache_put(int table_id, bkey_t key, const char *v, uint32_t len){
+	int *pi = find_entry(table_id, key), *bucket, i;
+	rcentry *e;
+
+	if (len > VALUE_SIZE)
+		return;
+	if (pi == NULL){
+		for (; entries[hand].table_id != -1 && entries[hand].ref;
+				hand = (hand + 1) % RCACHE_NUM)
+			entries[hand].ref = false;
+		i = hand;
+		hand = (hand + 1) % RCACHE_NUM;
+		e = &entries[i];
+		if (e->table_id != -1)
+			unlink_entry(find_entry(e->table_id, e->key));
+		bucket = get_bucket(table_id, key);
+		e->table_id = table_id;
+		e->key = key;
+		e->next = *bucket;
+		*bucket = i;
+	}
+	else
+		e = &entries[*pi];
+	e->ref = false;
+	e->len = len;
+	memset(e->v, 0, VALUE_SIZE);
+	memcpy(e->v, v, len);
+}
+
+void rcache_drop(int table_id, bkey_t key){
+	int *pi = find_entry(table_id, key);
+	if (pi != NULL)
+		unlink_entry(pi);
+}
+
+/* Drop the entries of a table, before its id is reused
+ */
+void rcache_drop_table(int table_id){
+	int i;
+	for (i = 0; i < RCACHE_NUM; i++){
+		if (entries[i].table_id == table_id)
+			rcache_drop(table_id, entries[i].key);
+	}
+}
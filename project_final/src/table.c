@@ -1,31 +1,81 @@
 #include "bptree.h"
 
+/* Write the header page of a new table
+ */
+static void init_header(table *t){
+	hpage *hp;
+
+	hp = alloc_hpage(t);
+	set_dirty(hp);
+	memset(B(hp), 0, BLOCK_SIZE);
+	B(hp)->root = ADDR_NOT_EXIST;
+	B(hp)->free = ADDR_NOT_EXIST;
+	B(hp)->num_page = 1;
+	release_page(t, hp);
+}
+
 /* Open new table
  */
 int open_table_low(conn *c, const char *pathname){
-	hpage *hp;
-	table *t;
 	int tid;
 	if (access( pathname, F_OK ) != -1){
 		tid = open_file(c, pathname);
 	}
 	else{
 		tid = open_file(c, pathname);
-		t = &c->tbls[tid];
-
-		hp = alloc_hpage(t);
-		set_dirty(hp);
-		B(hp)->root = ADDR_NOT_EXIST;
-		B(hp)->free = ADDR_NOT_EXIST;
-		B(hp)->num_page = 1;
-		release_page(t, hp);
+		init_header(&c->tbls[tid]);
 	}
+	if (tid < 0)
+		return tid;
+	fsm_open(&c->tbls[tid]);
+	c->tbls[tid].compact_next = key_min();
+	c->tbls[tid].compact_merges = 0;
+#ifdef BLOOM_FILTER
+	bloom_open(&c->tbls[tid]);
+#endif
+	return tid;
+}
+
+/* Open an empty table in a new file, in the last free table slot,
+ * for a tree the engine keeps for itself
+ */
+int open_temp_table_low(conn *c, const char *pathname){
+	int tid;
+
+	for (tid = MAX_TABLE - 1; tid >= 0 && c->tbls[tid].is_used; tid--)
+		;
+	if (tid < 0)
+		return E_FULL_TABLE;
+	unlink(pathname);
+	open_file_id(c, tid, pathname);
+	init_header(&c->tbls[tid]);
+	fsm_open(&c->tbls[tid]);
+	c->tbls[tid].compact_next = key_min();
+	c->tbls[tid].compact_merges = 0;
+	return tid;
+}
+
+/* Open an existing table read-only on a mapping of its file.
+ * It has no free space maps or bloom filter, as nothing is written.
+ */
+int open_table_mapped_low(conn *c, const char *pathname, int hints){
+	int tid = open_file_mapped(c, pathname, hints);
+
+	if (tid < 0)
+		return tid;
+	c->tbls[tid].compact_next = key_min();
+	c->tbls[tid].compact_merges = 0;
 	return tid;
 }
 
 /* Close the table
  */
 void close_table_low(table *t){
+	close_indexes(t);
+	rcache_drop_table(t->table_id);
+#ifdef BLOOM_FILTER
+	bloom_close(t);
+#endif
 	flush_page(t);
 	close_file(t);
 }